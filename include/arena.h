@@ -0,0 +1,55 @@
+#ifndef LUAVM_ARENA_H
+#define LUAVM_ARENA_H
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/*
+ * Bump allocator for data that lives as long as one compilation, such
+ * as the text of names and string literals. Nothing is freed one by
+ * one, all blocks go away with the arena.
+ */
+class Arena {
+public:
+    static constexpr size_t kBlockSize = 16 * 1024;
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    char* Alloc(size_t n) {
+        if (n > size_t(end_ - ptr_)) {
+            if (n > kBlockSize / 4) {
+                return NewBlock(n);     // the current block stays in use
+            }
+            ptr_ = NewBlock(kBlockSize);
+            end_ = ptr_ + kBlockSize;
+        }
+        char* p = ptr_;
+        ptr_ += n;
+        return p;
+    }
+    // NUL terminated, so that every copy, even an empty one, has its own address
+    std::string_view Copy(const char* s, size_t n) {
+        char* p = Alloc(n + 1);
+        memcpy(p, s, n);
+        p[n] = '\0';
+        return {p, n};
+    }
+    size_t Bytes() const { return bytes_; }
+private:
+    char* NewBlock(size_t n) {
+        blocks_.emplace_back(new char[n]);
+        bytes_ += n;
+        return blocks_.back().get();
+    }
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* ptr_ = nullptr;
+    char* end_ = nullptr;
+    size_t bytes_ = 0;
+};
+
+#endif //LUAVM_ARENA_H
@@ -0,0 +1,186 @@
+#ifndef LUAVM_BINDING_H
+#define LUAVM_BINDING_H
+#include "state.h"
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Expose plain C++ functions to Lua:
+ *
+ *      int64_t Add(int64_t a, int64_t b);
+ *      RegisterFunction(L, "add", &Add);
+ *
+ * The argument unpacking and result pushing code is generated per
+ * signature at compile time. The function pointer is kept in the
+ * NativeClosure, so a call costs one indirect call on top of the
+ * conversions, with no boxing and no allocation.
+ *
+ * Supported parameters: integral and floating point types, bool,
+ * std::string_view and const char* (borrowed from the interned string),
+ * std::string (copied), LuaValue and LuaTable*. Integers that do not
+ * fit their parameter type are an argument error.
+ * Supported results: the same (except LuaTable*), void, and std::tuple
+ * for multiple results. A null const char* result is nil.
+ */
+namespace binding {
+
+template<typename T, typename = void>
+struct Arg;
+
+// integers that do not fit T are an argument error, not truncated
+template<typename T>
+struct Arg<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>> {
+    static T Get(LuaState* L, const LuaValue* v, int idx) {
+        LuaInteger i = v->IsInteger() ? v->i_ : L->CheckInteger(idx);
+        bool fits;
+        if constexpr (std::is_signed_v<T>) {
+            fits = i >= LuaInteger(std::numeric_limits<T>::min()) && i <= LuaInteger(std::numeric_limits<T>::max());
+        } else {
+            fits = i >= 0 && uint64_t(i) <= uint64_t(std::numeric_limits<T>::max());
+        }
+        if (!fits) {
+            L->ArgError(idx, "value out of range");
+        }
+        return T(i);
+    }
+};
+
+template<typename T>
+struct Arg<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+    static T Get(LuaState* L, const LuaValue* v, int idx) {
+        if (v->IsFloat()) {
+            return T(v->n_);
+        }
+        if (v->IsInteger()) {
+            return T(v->i_);
+        }
+        return T(L->CheckNumber(idx));
+    }
+};
+
+template<>
+struct Arg<bool> {
+    static bool Get(LuaState*, const LuaValue* v, int) {
+        return !v->IsFalsy();
+    }
+};
+
+template<>
+struct Arg<std::string_view> {
+    static std::string_view Get(LuaState* L, const LuaValue* v, int idx) {
+        const StringObject* s = v->IsString() ? v->str_ : L->CheckString(idx);
+        return {s->data(), s->size()};
+    }
+};
+
+template<>
+struct Arg<const char*> {
+    static const char* Get(LuaState* L, const LuaValue* v, int idx) {
+        return v->IsString() ? v->str_->data() : L->CheckString(idx)->data();
+    }
+};
+
+template<>
+struct Arg<std::string> {
+    static std::string Get(LuaState* L, const LuaValue* v, int idx) {
+        auto sv = Arg<std::string_view>::Get(L, v, idx);
+        return std::string(sv);
+    }
+};
+
+template<>
+struct Arg<LuaValue> {
+    static LuaValue Get(LuaState*, const LuaValue* v, int) {
+        return *v;
+    }
+};
+
+template<>
+struct Arg<LuaTable*> {
+    static LuaTable* Get(LuaState* L, const LuaValue* v, int idx) {
+        return v->IsTable() ? v->table_ : L->CheckTable(idx);
+    }
+};
+
+template<typename Tuple, size_t... Is>
+inline int PushTuple(LuaState* L, Tuple&& t, std::index_sequence<Is...>);
+
+// push a result, returns the number of values pushed
+template<typename T>
+inline int Push(LuaState* L, T&& v) {
+    using D = std::decay_t<T>;
+    if constexpr (std::is_same_v<D, bool>) {
+        L->PushBoolean(v);
+    } else if constexpr (std::is_integral_v<D>) {
+        L->PushInteger(LuaInteger(v));
+    } else if constexpr (std::is_floating_point_v<D>) {
+        L->PushNumber(LuaNumber(v));
+    } else if constexpr (std::is_same_v<D, std::string_view> || std::is_same_v<D, std::string>) {
+        L->PushString(v.data(), v.size());
+    } else if constexpr (std::is_same_v<D, const char*> || std::is_same_v<D, char*>) {
+        if (v == nullptr) {
+            L->PushNil();
+        } else {
+            L->PushString(v);
+        }
+    } else if constexpr (std::is_same_v<D, LuaValue>) {
+        L->Push(v);
+    } else {
+        return PushTuple(L, std::forward<T>(v), std::make_index_sequence<std::tuple_size_v<D>>());
+    }
+    return 1;
+}
+
+template<typename Tuple, size_t... Is>
+inline int PushTuple(LuaState* L, Tuple&& t, std::index_sequence<Is...>) {
+    return (0 + ... + Push(L, std::get<Is>(std::forward<Tuple>(t))));
+}
+
+template<typename R, typename... Args, size_t... Is>
+inline int Invoke(LuaState* L, R (*fn)(Args...), std::index_sequence<Is...>) {
+    static_assert(sizeof...(Args) <= LUA_MINSTACK, "too many parameters");
+    if (L->GetTop() < int(sizeof...(Args))) {
+        L->SetTop(int(sizeof...(Args)));    // missing arguments are nil
+    }
+    const LuaValue* base = L->Index(1);
+    // braced initialization converts the arguments left to right, so the
+    // first bad argument is the one reported
+    std::tuple<std::decay_t<Args>...> args{
+        Arg<std::decay_t<Args>>::Get(L, base + Is, int(Is) + 1)...
+    };
+    if constexpr (std::is_void_v<R>) {
+        fn(std::get<Is>(std::move(args))...);
+        return 0;
+    } else {
+        return Push(L, fn(std::get<Is>(std::move(args))...));
+    }
+}
+
+template<typename R, typename... Args>
+int Thunk(LuaState* L) {
+    auto fn = reinterpret_cast<R (*)(Args...)>(L->CurrentNative()->target_);
+    return Invoke(L, fn, std::index_sequence_for<Args...>());
+}
+
+}
+
+// make fn callable from Lua through a native function object
+template<typename R, typename... Args>
+NativeClosure* BindFunction(LuaState* L, const char* name, R (*fn)(Args...)) {
+    NativeClosure* f = L->NewNative(&binding::Thunk<R, Args...>, name);
+    f->target_ = reinterpret_cast<NativeClosure::Target>(fn);
+    return f;
+}
+
+// bind fn and store it in the global name
+template<typename R, typename... Args>
+void RegisterFunction(LuaState* L, const char* name, R (*fn)(Args...)) {
+    L->SetGlobal(name, LuaValue::Object(BindFunction(L, name, fn)));
+}
+
+#endif //LUAVM_BINDING_H
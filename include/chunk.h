@@ -7,7 +7,12 @@
 #include "typedefs.h"
 #include "string"
 #include "vector"
+#include "memory"
+#include <cstdint>
+#include <stdexcept>
 #include "slice.h"
+#include "memstat.h"
+#include "value.h"
 
 #define LUA_SIGNATURE       "\x1b\x4c\x75\x61"
 #define LUAC_VERSION        0x53
@@ -35,15 +40,12 @@ public:
     LuaNil(){}
 };
 
-typedef int64_t LuaInteger;
-typedef double LuaNumber;
-typedef bool LuaBoolean;
-
 class LuaString {
 public:
     LuaString(): str_("") {}
     LuaString(const std::string& str): str_(str) {}
     LuaString(std::string&& str): str_(std::move(str)) {}
+    LuaString(LuaString&& lstr): str_(std::move(lstr.str_)) {}
     LuaString& operator=(std::string&& str) {
         str_ = std::move(str);
         return *this;
@@ -55,6 +57,9 @@ public:
     size_t size() const {
         return str_.size();
     }
+    size_t HeapBytes() const {
+        return memstat::HeapBytes(str_);
+    }
     void Encode(char *p) {
         if (str_.size() == 0) {
             (*p) = 0x00;
@@ -75,6 +80,9 @@ public:
     }
 private:
     friend class Constant;
+    friend class LuaState;
+    friend class ChunkWriter;
+    friend class FuncState;
     std::string str_;
 };
 
@@ -84,9 +92,14 @@ public:
         tag_ = ConstantTag::NIL;
     }
     Constant(Constant&& from) {
+        tag_ = ConstantTag::NIL;
         *this = std::move(from);
     }
     Constant& operator=(Constant&& from) {
+        if (this == &from) {
+            return *this;
+        }
+        Reset();
         tag_ = from.tag_;
         switch (tag_) {
             case ConstantTag::NIL:
@@ -102,43 +115,54 @@ public:
                 break;
             case ConstantTag::STRING:
             case ConstantTag::SSTRING:
-                string_ = std::move(from.string_);
+                new (&string_) LuaString(std::move(from.string_));
                 break;
         }
         return *this;
     }
     ~Constant() {
-        if (tag_ == ConstantTag::SSTRING || tag_ == ConstantTag::STRING) {
-            string_.~LuaString();
-        }
+        Reset();
     }
     void SetShortString(LuaString&& str) {
+        Reset();
         tag_ = ConstantTag::SSTRING;
-        string_ = std::move(str);
+        new (&string_) LuaString(std::move(str));
     }
     void SetLongString(LuaString&& str) {
+        Reset();
         tag_ = ConstantTag::STRING;
-        string_ = std::move(str);
+        new (&string_) LuaString(std::move(str));
     }
     void SetString(LuaString&& str) {
+        Reset();
         tag_ = str.size() >= 255 ? ConstantTag::STRING : ConstantTag::SSTRING;
-        string_ = std::move(str);
+        new (&string_) LuaString(std::move(str));
     }
     void SetNil() {
-        tag_ = ConstantTag::NIL;
+        Reset();
     }
     void SetBoolean(LuaBoolean b) {
+        Reset();
         tag_ = ConstantTag::BOOLEAN;
         bool_ = b;
     }
     void SetNumber(LuaNumber n) {
+        Reset();
         tag_ = ConstantTag::NUMBER;
         number_ = n;
     }
     void SetInterger(LuaInteger n) {
+        Reset();
         tag_ = ConstantTag::INTEGER;
         integer_ = n;
     }
+    // heap bytes owned beyond the Constant object
+    size_t HeapBytes() const {
+        if (tag_ == ConstantTag::SSTRING || tag_ == ConstantTag::STRING) {
+            return string_.HeapBytes();
+        }
+        return 0;
+    }
     [[nodiscard]] std::string String() const {
         std::string s("UNKNOWN CONSTANT TYPE");
         char *buf = nullptr;
@@ -163,6 +187,16 @@ public:
         return s;
     }
 private:
+    // string_ lives in a union, so it is only constructed while tag_ says so
+    void Reset() {
+        if (tag_ == ConstantTag::SSTRING || tag_ == ConstantTag::STRING) {
+            string_.~LuaString();
+        }
+        tag_ = ConstantTag::NIL;
+    }
+    friend class LuaState;
+    friend class ChunkWriter;
+    friend class FuncState;
     ConstantTag tag_;
     union {
         LuaBoolean bool_;
@@ -188,13 +222,65 @@ public:
         endPC_ = from.endPC_;
         return *this;
     }
+    size_t HeapBytes() const {
+        return memstat::HeapBytes(varName_);
+    }
 private:
     friend class Chunk;
+    friend class ChunkWriter;
+    friend class Parser;
     std::string varName_;
     uint32_t startPC_;
     uint32_t endPC_;
 };
 
+/*
+ * Line of every instruction, stored as in Lua 5.4: one signed byte per
+ * instruction holding the difference to the line of the previous one,
+ * plus an absolute (pc, line) checkpoint whenever the difference does
+ * not fit in a byte, and at least every kMaxWithoutAbs instructions.
+ *
+ * A lookup binary searches the checkpoints, then adds at most
+ * kMaxWithoutAbs deltas.
+ */
+class LineInfo {
+public:
+    static constexpr int8_t kAbsMarker = -0x80;    // delta stored in abs_
+    static constexpr size_t kMaxWithoutAbs = 128;
+
+    explicit LineInfo(uint32_t lineDefined = 0)
+        : lastLine_(lineDefined), sinceAbs_(0), lineDefined_(lineDefined) {}
+
+    void Reserve(size_t n) {
+        deltas_.reserve(n);
+        abs_.reserve(n / kMaxWithoutAbs + 1);
+    }
+    // line of the next instruction
+    void Append(uint32_t line);
+    // line of instruction pc, -1 if out of range
+    int GetLine(size_t pc) const;
+    size_t Size() const { return deltas_.size(); }
+    bool Empty() const { return deltas_.empty(); }
+    size_t HeapBytes() const {
+        return memstat::HeapBytes(deltas_) + memstat::HeapBytes(abs_);
+    }
+    size_t SlackBytes() const {
+        return memstat::SlackBytes(deltas_) + memstat::SlackBytes(abs_);
+    }
+
+private:
+    struct AbsLine {
+        uint32_t pc_;
+        uint32_t line_;
+    };
+
+    std::vector<int8_t> deltas_;
+    std::vector<AbsLine> abs_;  // sorted by pc
+    uint32_t lastLine_;
+    uint32_t sinceAbs_;         // instructions since the last checkpoint
+    uint32_t lineDefined_;      // the base line before the first instruction
+};
+
 class Upvalue {
 public:
     Upvalue(byte_t inStack, byte_t idx)
@@ -202,10 +288,22 @@ public:
     {}
 private:
     friend class Chunk;
+    friend class LuaState;
+    friend class ChunkWriter;
     byte_t inStack_;
     byte_t idx_;
 };
 
+/*
+ * What to do with the debug sections of each function (line info, local
+ * variable names, upvalue names) while loading a chunk.
+ */
+enum class DebugInfo : byte_t {
+    Load,       // decode them along with the code
+    Lazy,       // keep their raw bytes, decode on first use
+    Strip,      // skip them, errors report no line
+};
+
 class Prototype {
 public:
     Prototype(){}
@@ -214,6 +312,12 @@ public:
         *this = std::move(from);
     }
 
+    ~Prototype() {
+        for (auto p:protos_) {
+            delete p;
+        }
+    }
+
     Prototype& operator=(Prototype&& from) {
         // TODO: use memcpy for first 5 members
         lineDefined_ = from.lineDefined_;
@@ -229,13 +333,57 @@ public:
         lineInfo_ = std::move(from.lineInfo_);
         locVars_ = std::move(from.locVars_);
         upvalueNames_ = std::move(from.upvalueNames_);
+        k_ = std::move(from.k_);
+        debugBytes_ = from.debugBytes_;
+        debugRange_ = from.debugRange_;
+        from.debugBytes_ = nullptr;
+        cache_ = from.cache_;
 
         return *this;
     }
 
+    // memory owned by this function only, nested protos excluded
+    MemoryUsage Usage() const;
+    const std::vector<Prototype*>& Protos() const { return protos_; }
+
+    // debug sections, decoded here if they were loaded lazily
+    const LineInfo& Lines() {
+        if (debugBytes_) {
+            LoadDebugInfo();
+        }
+        return lineInfo_;
+    }
+    const std::vector<LocalVar>& LocVars() {
+        if (debugBytes_) {
+            LoadDebugInfo();
+        }
+        return locVars_;
+    }
+    const std::vector<std::string>& UpvalueNames() {
+        if (debugBytes_) {
+            LoadDebugInfo();
+        }
+        return upvalueNames_;
+    }
+
 private:
+    // where the raw debug sections of a lazily loaded function start in
+    // the buffer kept by its Chunk, and the size of each section
+    struct DebugRange {
+        size_t offset_;
+        uint32_t lineInfo_;
+        uint32_t locVars_;
+        uint32_t upvalueNames_;
+    };
+
+    void LoadDebugInfo();
+
     friend class ChunkReader;
+    friend class ChunkWriter;
     friend class Chunk;
+    friend class LuaState;
+    friend class FuncState;
+    friend class Parser;
     uint32_t lineDefined_;
     uint32_t lastLineDefined_;
     byte_t numParams_;
@@ -246,9 +394,13 @@ private:
     std::vector<Constant> constants_;
     std::vector<Upvalue> upvalues_;
     std::vector<Prototype*> protos_;
-    std::vector<uint32_t> lineInfo_;
+    LineInfo lineInfo_;
     std::vector<LocalVar> locVars_;
     std::vector<std::string> upvalueNames_;
+    std::vector<LuaValue> k_;   // constants_ as runtime values, set by LuaState::Load
+    const std::string* debugBytes_ = nullptr;  // set while the debug sections are not decoded
+    DebugRange debugRange_{};
+    LuaClosure* cache_ = nullptr;   // last closure built by OP_CLOSURE, see LuaState::CachedClosure
 };
 
 class ChunkHeader {
@@ -270,27 +422,78 @@ private:
 };
 
 class ChunkReader;
+class ChunkStream;
 
 class Chunk {
 public:
-    explicit Chunk(const char* data, size_t n);
+    explicit Chunk(const char* data, size_t n, DebugInfo debug = DebugInfo::Load);
+    explicit Chunk(ChunkStream* stream, DebugInfo debug = DebugInfo::Load);
+    // takes the main function of a compiled source, see Parser
+    explicit Chunk(Prototype* main);
+    Chunk(const Chunk&) = delete;
+    Chunk& operator=(const Chunk&) = delete;
+    ~Chunk();
+    Prototype* MainFunc() const { return mainFunc_; }
+    void Print() { Print(mainFunc_); }
     void Print(Prototype* f);
+    void PrintMemory();
+    MemoryUsage Usage() const;  // whole prototype tree
 private:
+    void PrintMemory(Prototype* f, MemoryUsage* total);
+    void Load(ChunkReader& reader, DebugInfo debug);
     void PrintHeader(Prototype* f);
     void PrintDetail(Prototype* f);
     void PrintCode(Prototype* f);
     void CheckHeader(ChunkReader& reader);
     ChunkHeader header_;
     byte_t sizeUpvalue_;
-    Prototype* mainFunc_;
+    Prototype* mainFunc_ = nullptr;
+    std::string debugBytes_;    // raw debug sections of all functions, DebugInfo::Lazy only
 };
 
+/*
+ * Malformed binary chunk. offset_ is the position in the chunk of the
+ * field that could not be read, it is also part of the message.
+ */
+class ChunkError : public std::runtime_error {
+public:
+    ChunkError(const std::string& msg, size_t offset)
+        : std::runtime_error(msg + " at byte " + std::to_string(offset)), offset_(offset) {}
+    size_t offset_;
+};
+
+/*
+ * Decodes a binary chunk either from one contiguous buffer, or from a
+ * ChunkStream through a small sliding window, so that the whole chunk
+ * never has to be buffered in memory.
+ *
+ * Input is not trusted: every count is checked before anything is
+ * allocated for it. From a buffer one comparison against the bytes left
+ * covers a whole array; from a stream an array only grows as its bytes
+ * arrive. Errors throw ChunkError.
+ *
+ * A stream is only asked for bytes the chunk is known to contain, so
+ * whatever follows the chunk on a pipe or socket is left unread.
+ */
 class ChunkReader {
 public:
-    ChunkReader(const Slice& data): data_(data) {}
-    ChunkReader(const std::string& data): data_(data) {}
+    static constexpr size_t kDefaultWindow = 16 * 1024;
+    static constexpr int kMaxNesting = 200;         // as the parser, see Parser::EnterLevel
+    static constexpr uint32_t kStreamBatch = 4096;  // elements allocated ahead from a stream
+
+    ChunkReader(const Slice& data)
+        : data_(data), stream_(nullptr), windowSize_(0), received_(data.size()) {}
+    ChunkReader(const std::string& data)
+        : data_(data), stream_(nullptr), windowSize_(0), received_(data.size()) {}
+    explicit ChunkReader(ChunkStream* stream, size_t window = kDefaultWindow);
+    // keep is where DebugInfo::Lazy appends the raw debug sections
+    void SetDebugInfo(DebugInfo debug, std::string* keep) {
+        debug_ = debug;
+        keep_ = debug == DebugInfo::Lazy ? keep : nullptr;
+    }
     byte_t ReadByte();
     Slice ReadBytes(uint32_t n);
+    void ReadInto(char* dst, size_t n);
     uint32_t ReadUint32();
     uint64_t ReadUint64();
     LuaInteger ReadLuaInteger();
@@ -300,13 +503,70 @@ public:
     std::vector<Constant> ReadConstants();
     Constant ReadConstant();
     std::vector<Upvalue> ReadUpvalues();
-    std::vector<uint32_t> ReadLineInfo();
+    LineInfo ReadLineInfo(uint32_t lineDefined);
     std::vector<LocalVar> ReadLocVars();
     std::vector<std::string> ReadUpvalueNames();
     Prototype* ReadProto(const std::string& parentSource);
     std::vector<Prototype*> ReadProtos(const std::string& parentSource);
+    // position of the next byte in the chunk
+    size_t Offset() const { return received_ - data_.size(); }
 private:
+    // n bytes more than counted so far in extent_ are part of the chunk
+    void Extend(uint64_t n) {
+        extent_ = n < SIZE_MAX - extent_ ? extent_ + n : SIZE_MAX;
+    }
+    // make sure at least n contiguous bytes are available in data_
+    void Need(size_t n) {
+        if (data_.size() < n) {
+            Fill(n);
+        }
+    }
+    void Fill(size_t n);
+    // count of the array that follows, each element taking at least elemBytes
+    uint32_t ReadCount(size_t elemBytes, const char* section);
+    // elements of an n array to allocate before reading any of them
+    size_t Ahead(uint32_t n) const { return stream_ && n > kStreamBatch ? kStreamBatch : n; }
+    uint64_t ReadStringSize();
+    // consume n bytes, copying them to keep_ if set
+    void Pass(size_t n);
+    uint32_t PassCount(size_t elemBytes, const char* section);
+    void PassString();
+    void SkipDebugInfo(Prototype* proto);
+
     Slice data_;
+    ChunkStream* stream_;
+    std::unique_ptr<char[]> window_;
+    size_t windowSize_;
+    DebugInfo debug_ = DebugInfo::Load;
+    std::string* keep_ = nullptr;
+    size_t received_;   // bytes taken from the buffer or the stream so far
+    // the chunk is known to reach this offset: every field is counted
+    // at its smallest size when first known to exist, then extended as
+    // its actual size is read. A stream is never read past it.
+    size_t extent_ = 0;
+    int depth_ = 0;     // nesting of the function being read
+};
+
+/*
+ * Encodes prototypes in the binary chunk format of luac 5.3, so that the
+ * output can be read back by ChunkReader. Lazily loaded debug info is
+ * decoded on the way, stripped functions are written without it.
+ */
+class ChunkWriter {
+public:
+    explicit ChunkWriter(std::string* out): out_(out) {}
+    void WriteChunk(Prototype* main);
+    void WriteHeader();
+    void WriteProto(Prototype* f, const std::string& parentSource);
+private:
+    void WriteByte(byte_t b) { out_->push_back(char(b)); }
+    void WriteUint32(uint32_t i) { out_->append(reinterpret_cast<const char*>(&i), sizeof(i)); }
+    void WriteUint64(uint64_t i) { out_->append(reinterpret_cast<const char*>(&i), sizeof(i)); }
+    void WriteLuaNumber(LuaNumber n) { out_->append(reinterpret_cast<const char*>(&n), sizeof(n)); }
+    void WriteLuaString(const std::string& s);
+    void WriteConstant(const Constant& c);
+
+    std::string* out_;
 };
 
 #endif //LUAVM_CHUNK_H
@@ -0,0 +1,88 @@
+#ifndef LUAVM_CHUNK_STREAM_H
+#define LUAVM_CHUNK_STREAM_H
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/*
+ * A source of chunk bytes which may arrive incrementally
+ * (file, pipe, socket...).
+ */
+class ChunkStream {
+public:
+    virtual ~ChunkStream() = default;
+    // Read at most n bytes into buf. Blocks until at least one byte is
+    // available, returns 0 at the end of stream.
+    virtual size_t Read(char* buf, size_t n) = 0;
+    // At least n bytes will be read after those read so far, a stream
+    // may fetch them ahead. Nothing beyond them is part of the chunk yet.
+    virtual void Expect(size_t /*n*/) {}
+    // Called from another thread: a blocked Read, and every later one,
+    // returns 0 until Resume. Streams that never block need not
+    // implement them.
+    virtual void Cancel() {}
+    // Reads work again, once no Read is in progress
+    virtual void Resume() {}
+};
+
+/*
+ * Reads from a file descriptor, the caller owns the fd. Reads wait on
+ * the fd and on a pipe that Cancel writes to.
+ */
+class FdChunkStream : public ChunkStream {
+public:
+    explicit FdChunkStream(int fd);
+    ~FdChunkStream() override;
+    FdChunkStream(const FdChunkStream&) = delete;
+    FdChunkStream& operator=(const FdChunkStream&) = delete;
+    size_t Read(char* buf, size_t n) override;
+    void Cancel() override;
+    void Resume() override;
+private:
+    int fd_;
+    int cancel_[2];
+};
+
+/*
+ * Pulls bytes from another stream on a background thread into a bounded
+ * ring buffer, so that I/O overlaps with parsing. Only the bytes asked
+ * for by Read or Expect are fetched, so nothing past the chunk is taken
+ * from the source. The destructor cancels a pending read of the
+ * producer and resumes the source, which can then be read on. A Read
+ * that finds the ring empty and the producer idle reads in place.
+ */
+class PrefetchChunkStream : public ChunkStream {
+public:
+    static constexpr size_t kDefaultCapacity = 64 * 1024;
+
+    explicit PrefetchChunkStream(ChunkStream* source,
+                                 size_t capacity = kDefaultCapacity);
+    ~PrefetchChunkStream() override;
+    size_t Read(char* buf, size_t n) override;
+    void Expect(size_t n) override;
+private:
+    // the producer may fetch up to n bytes after those consumed
+    void Want(size_t n);
+    void Produce();
+
+    ChunkStream* source_;
+    std::unique_ptr<char[]> ring_;
+    size_t capacity_;
+    size_t head_;       // next byte to consume
+    size_t size_;       // bytes buffered
+    size_t consumed_;   // bytes handed out by Read
+    size_t wanted_;     // bytes asked for by Read or Expect, the producer stops there
+    bool reading_;      // a read of the source is in progress
+    bool eof_;
+    bool stop_;
+    std::exception_ptr error_;
+    std::mutex mu_;
+    std::condition_variable notEmpty_;
+    std::condition_variable wantMore_;
+    std::thread producer_;
+};
+
+#endif //LUAVM_CHUNK_STREAM_H
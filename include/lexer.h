@@ -0,0 +1,101 @@
+#ifndef LUAVM_LEXER_H
+#define LUAVM_LEXER_H
+#include "arena.h"
+#include "typedefs.h"
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/*
+ * Tokens beyond single characters, in the order of luaX_tokens. The
+ * reserved words come first.
+ */
+#define FIRST_RESERVED  257
+enum {
+    TK_AND = FIRST_RESERVED, TK_BREAK,
+    TK_DO, TK_ELSE, TK_ELSEIF, TK_END, TK_FALSE, TK_FOR, TK_FUNCTION,
+    TK_GOTO, TK_IF, TK_IN, TK_LOCAL, TK_NIL, TK_NOT, TK_OR, TK_REPEAT,
+    TK_RETURN, TK_THEN, TK_TRUE, TK_UNTIL, TK_WHILE,
+    TK_IDIV, TK_CONCAT, TK_DOTS, TK_EQ, TK_GE, TK_LE, TK_NE,
+    TK_SHL, TK_SHR, TK_DBCOLON, TK_EOS,
+    TK_FLT, TK_INT, TK_NAME, TK_STRING
+};
+
+struct Token {
+    int type_ = TK_EOS;
+    union {
+        LuaNumber n_;       // TK_FLT
+        LuaInteger i_ = 0;  // TK_INT
+    };
+    std::string_view s_;    // TK_NAME and TK_STRING, interned
+};
+
+/*
+ * Lua 5.3 scanner over a source held in memory. Names and string
+ * literals are interned into the arena, so equal strings share their
+ * bytes for the whole compilation.
+ *
+ * Errors throw std::runtime_error as "chunkid:line: message near token".
+ */
+class Lexer {
+public:
+    Lexer(const char* source, size_t n, const std::string& chunkName, Arena* arena);
+    void Next();
+    int Lookahead();
+    const Token& Current() const { return t_; }
+    int Type() const { return t_.type_; }
+    int Line() const { return line_; }
+    int LastLine() const { return lastLine_; }
+    std::string_view NewString(const char* s, size_t n);
+    // the message is reported near the current token
+    [[noreturn]] void SyntaxError(const std::string& msg) { Error(msg, t_.type_); }
+    // token 0 leaves out the "near" part
+    [[noreturn]] void Error(const std::string& msg, int token);
+    static std::string TokenToString(int token);
+private:
+    int Lex(Token* tok);
+    void NextChar() {
+        current_ = p_ < end_ ? static_cast<unsigned char>(*p_++) : EOZ;
+    }
+    // position of current_ in the source
+    const char* Pos() const { return current_ == EOZ ? end_ : p_ - 1; }
+    // continue at q, end_ for the end of the source
+    void SkipTo(const char* q) {
+        p_ = q;
+        NextChar();
+    }
+    void SaveAndNext() {
+        buf_.push_back(char(current_));
+        NextChar();
+    }
+    bool CheckNext1(int c);
+    bool CheckNext2(const char* set);
+    void IncLine();
+    int SkipSep();
+    void ReadLongString(Token* tok, int sep);
+    void ReadString(int del, Token* tok);
+    int ReadNumeral(Token* tok);
+    void EscCheck(bool ok, const char* msg);
+    int GetHexa();
+    int ReadHexaEsc();
+    void Utf8Esc();
+    int ReadDecEsc();
+    std::string TokenText(int token) const;
+
+    static constexpr int EOZ = -1;
+
+    const char* p_;
+    const char* end_;
+    int current_;
+    int line_ = 1;
+    int lastLine_ = 1;
+    Token t_;
+    Token ahead_;
+    std::string buf_;       // text of the token being read, for messages
+    std::string chunkId_;
+    Arena* arena_;
+    // interned strings, the value is the token of a reserved word or 0
+    std::unordered_map<std::string_view, int> strings_;
+};
+
+#endif //LUAVM_LEXER_H
@@ -0,0 +1,14 @@
+#ifndef LUAVM_LUALIB_H
+#define LUAVM_LUALIB_H
+#include "state.h"
+
+// base functions (print, pairs, pcall...) as globals, plus _G and _VERSION
+void OpenBase(LuaState* L);
+// the string table, also set as __index of the string metatable
+void OpenString(LuaState* L);
+void OpenLibs(LuaState* L);
+
+// tostring(v), honouring __tostring
+StringObject* ToString(LuaState* L, const LuaValue& v);
+
+#endif //LUAVM_LUALIB_H
@@ -0,0 +1,79 @@
+#ifndef LUAVM_MEMSTAT_H
+#define LUAVM_MEMSTAT_H
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Heap bytes owned by a loaded Prototype, split by section. Containers
+ * are charged by capacity, the part past size() is also summed in slack_.
+ */
+class MemoryUsage {
+public:
+    size_t Total() const {
+        return proto_ + source_ + code_ + constants_ + upvalues_ + protos_ +
+               lineInfo_ + locVars_ + upvalueNames_;
+    }
+
+    MemoryUsage& operator+=(const MemoryUsage& u) {
+        proto_ += u.proto_;
+        source_ += u.source_;
+        code_ += u.code_;
+        constants_ += u.constants_;
+        upvalues_ += u.upvalues_;
+        protos_ += u.protos_;
+        lineInfo_ += u.lineInfo_;
+        locVars_ += u.locVars_;
+        upvalueNames_ += u.upvalueNames_;
+        slack_ += u.slack_;
+        return *this;
+    }
+
+    size_t proto_ = 0;          // the Prototype object itself
+    size_t source_ = 0;
+    size_t code_ = 0;
+    size_t constants_ = 0;      // including string payloads
+    size_t upvalues_ = 0;
+    size_t protos_ = 0;         // array of nested proto pointers
+    size_t lineInfo_ = 0;
+    size_t locVars_ = 0;        // including variable names
+    size_t upvalueNames_ = 0;
+    size_t slack_ = 0;          // allocated but unused capacity
+};
+
+namespace memstat {
+
+// heap block owned by s, 0 if it is stored inline (SSO)
+inline size_t HeapBytes(const std::string& s) {
+    auto p = s.data();
+    auto self = reinterpret_cast<const char*>(&s);
+    if (p >= self && p < self + sizeof(s)) {
+        return 0;
+    }
+    return s.capacity() + 1;
+}
+
+template<typename T>
+inline size_t HeapBytes(const std::vector<T>& v) {
+    return v.capacity() * sizeof(T);
+}
+
+template<typename T>
+inline size_t SlackBytes(const std::vector<T>& v) {
+    return (v.capacity() - v.size()) * sizeof(T);
+}
+
+/*
+ * Counters fed by the global allocation hook (alloc_hook.cc). They stay
+ * zero unless the hook is linked into the executable.
+ */
+void RecordAlloc(size_t n);
+void RecordFree(size_t n);
+void SetHookInstalled();
+bool HookInstalled();
+size_t LiveBytes();
+size_t LiveBlocks();
+
+}
+
+#endif //LUAVM_MEMSTAT_H
@@ -66,6 +66,8 @@ enum {
     OP_EXTRAARG
 };
 
+#define NUM_OPCODES     (int(OP_EXTRAARG) + 1)
+
 enum OprandType {
     OpArgN = 0, // argument is not used
     OpArgU,     // argument is used
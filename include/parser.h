@@ -0,0 +1,326 @@
+#ifndef LUAVM_PARSER_H
+#define LUAVM_PARSER_H
+#include "chunk.h"
+#include "lexer.h"
+#include "vm.h"
+#include <vector>
+
+/*
+ * Kinds of expression descriptors, as lparser.h: where the value of an
+ * expression is, or what is still to be emitted to get it.
+ */
+enum ExpKind {
+    VVOID,      // empty expression list, or no value
+    VNIL,
+    VTRUE,
+    VFALSE,
+    VK,         // constant, info_ is its index
+    VKFLT,      // float literal, nval_
+    VKINT,      // integer literal, ival_
+    VNONRELOC,  // value in register info_
+    VLOCAL,     // local variable in register info_
+    VUPVAL,     // upvalue info_
+    VINDEXED,   // t[k], see ind_
+    VJMP,       // test, info_ is the pc of its jump
+    VRELOCABLE, // result register of the instruction at info_ is still open
+    VCALL,      // info_ is the pc of the CALL
+    VVARARG     // info_ is the pc of the VARARG
+};
+
+struct ExpDesc {
+    ExpKind k_;
+    int info_;
+    LuaInteger ival_;
+    LuaNumber nval_;
+    struct {
+        short idx_;     // R/K index of the key
+        byte_t t_;      // register or upvalue of the table
+        byte_t vt_;     // VLOCAL or VUPVAL, kind of t_
+    } ind_;
+    int t_;     // jumps to patch when the expression is true
+    int f_;     // jumps to patch when it is false
+};
+
+enum BinOpr {
+    OPR_ADD, OPR_SUB, OPR_MUL, OPR_MOD, OPR_POW,
+    OPR_DIV, OPR_IDIV,
+    OPR_BAND, OPR_BOR, OPR_BXOR, OPR_SHL, OPR_SHR,
+    OPR_CONCAT,
+    OPR_EQ, OPR_LT, OPR_LE, OPR_NE, OPR_GT, OPR_GE,
+    OPR_AND, OPR_OR,
+    OPR_NOBINOPR
+};
+
+enum UnOpr { OPR_MINUS, OPR_BNOT, OPR_NOT, OPR_LEN, OPR_NOUNOPR };
+
+#define NO_JUMP (-1)
+
+class Parser;
+
+struct BlockCnt {
+    BlockCnt* previous_;
+    int firstLabel_;    // index of the first label of this block
+    int firstGoto_;     // index of the first pending goto of this block
+    byte_t nactvar_;    // active locals outside the block
+    bool upval_;        // some local of the block is captured
+    bool isLoop_;
+};
+
+// constant as a key of the per chunk constant cache
+struct ConstKey {
+    ConstantTag tag_;
+    union {
+        LuaBoolean b_;
+        LuaNumber n_;
+        LuaInteger i_;
+    };
+    std::string_view s_;    // interned, compared by address
+
+    bool operator==(const ConstKey& o) const;
+};
+
+struct ConstKeyHash {
+    size_t operator()(const ConstKey& k) const;
+};
+
+/*
+ * State of the function being compiled, and the code generator of
+ * lcode.c working on it. Instructions are emitted as the parser goes,
+ * an expression is only held as an ExpDesc until its operator decides
+ * where its value goes.
+ */
+class FuncState {
+public:
+    int Code(uint32_t i);
+    int CodeABC(int op, int a, int b, int c);
+    int CodeABx(int op, int a, unsigned int bx);
+    int CodeAsBx(int op, int a, int sbx) { return CodeABx(op, a, unsigned(sbx + MAXARG_sBx)); }
+    int CodeK(int reg, int k);
+    void Nil(int from, int n);
+    int Jump();
+    void Ret(int first, int nret);
+    int GetLabel();
+    void Concat(int* l1, int l2);
+    void PatchList(int list, int target);
+    void PatchToHere(int list);
+    void PatchClose(int list, int level);
+    void FixLine(int line) { lines_.back() = line; }
+    void CheckStack(int n);
+    void ReserveRegs(int n);
+    int StringK(std::string_view s);
+    int IntK(LuaInteger i);
+    void SetReturns(ExpDesc* e, int nresults);
+    void SetMultRet(ExpDesc* e) { SetReturns(e, -1); }
+    void SetOneRet(ExpDesc* e);
+    void DischargeVars(ExpDesc* e);
+    void Exp2NextReg(ExpDesc* e);
+    int Exp2AnyReg(ExpDesc* e);
+    void Exp2AnyRegUp(ExpDesc* e);
+    void Exp2Val(ExpDesc* e);
+    int Exp2RK(ExpDesc* e);
+    void StoreVar(ExpDesc* var, ExpDesc* ex);
+    void Self(ExpDesc* e, ExpDesc* key);
+    void GoIfTrue(ExpDesc* e);
+    void GoIfFalse(ExpDesc* e);
+    void Indexed(ExpDesc* t, ExpDesc* k);
+    void Prefix(UnOpr op, ExpDesc* e, int line);
+    void Infix(BinOpr op, ExpDesc* v);
+    void Posfix(BinOpr op, ExpDesc* e1, ExpDesc* e2, int line);
+    void SetList(int base, int nelems, int tostore);
+    uint32_t& Instr(const ExpDesc* e) { return f_->code_[e->info_]; }
+
+    Prototype* f_ = nullptr;
+    FuncState* prev_ = nullptr;
+    Parser* parser_ = nullptr;
+    BlockCnt* bl_ = nullptr;
+    std::vector<int> lines_;    // line of each instruction, f_->lineInfo_ is built at the end
+    int pc_ = 0;                // next instruction
+    int lastTarget_ = 0;        // pc of the last jump target
+    int jpc_ = NO_JUMP;         // jumps to pc_ that are not patched yet
+    int nk_ = 0;                // constants
+    int np_ = 0;                // nested functions
+    int firstLocal_ = 0;        // first local of this function in Parser::actvar_
+    int nlocvars_ = 0;          // entries of f_->locVars_
+    int nactvar_ = 0;           // active locals
+    int nups_ = 0;              // upvalues
+    int freereg_ = 0;           // first free register
+    std::vector<std::string_view> upvalNames_;
+private:
+    int GetJump(int pc);
+    void FixJump(int pc, int dest);
+    int CondJump(int op, int a, int b, int c);
+    uint32_t* GetJumpControl(int pc);
+    bool PatchTestReg(int node, int reg);
+    void RemoveValues(int list);
+    void PatchListAux(int list, int vtarget, int reg, int dtarget);
+    void DischargeJpc();
+    int CodeExtraArg(int a);
+    void FreeReg(int reg);
+    void FreeExp(ExpDesc* e);
+    void FreeExps(ExpDesc* e1, ExpDesc* e2);
+    int AddK(const ConstKey& key);
+    int NumberK(LuaNumber n);
+    int BoolK(bool b);
+    int NilK();
+    void Discharge2Reg(ExpDesc* e, int reg);
+    void Discharge2AnyReg(ExpDesc* e);
+    int CodeLoadBool(int a, int b, int jump);
+    bool NeedValue(int list);
+    void Exp2Reg(ExpDesc* e, int reg);
+    void NegateCondition(ExpDesc* e);
+    int JumpOnCond(ExpDesc* e, int cond);
+    void CodeNot(ExpDesc* e);
+    bool ConstFolding(int op, ExpDesc* e1, const ExpDesc* e2);
+    void CodeUnExpVal(int op, ExpDesc* e, int line);
+    void CodeBinExpVal(int op, ExpDesc* e1, ExpDesc* e2, int line);
+    void CodeComp(BinOpr opr, ExpDesc* e1, ExpDesc* e2);
+};
+
+/*
+ * Single pass compiler from Lua 5.3 source to the Prototype tree that
+ * ChunkReader would load from the output of luac for the same source:
+ * the same instructions, constants, upvalues and debug info. Names and
+ * literals are kept in an arena; there is no syntax tree, every rule
+ * emits code into its FuncState as soon as it is recognized.
+ *
+ * chunkName is the source of the functions: "@file", "=name" or the
+ * text itself. Syntax errors throw std::runtime_error.
+ */
+class Parser {
+public:
+    static Prototype* Compile(const char* source, size_t n, const std::string& chunkName);
+private:
+    friend class FuncState;
+
+    struct LabelDesc {
+        std::string_view name_;
+        int pc_;
+        int line_;
+        byte_t nactvar_;    // active locals at this position
+    };
+
+    struct LhsAssign {
+        LhsAssign* prev_;
+        ExpDesc v_;
+    };
+
+    struct ConsControl {
+        ExpDesc v_;         // last list item read
+        ExpDesc* t_;        // the table
+        int nh_;            // record elements
+        int na_;            // array elements
+        int tostore_;       // array elements not stored yet
+    };
+
+    Parser(const char* source, size_t n, const std::string& chunkName);
+    [[noreturn]] void SemError(const std::string& msg) { lex_.Error(msg, 0); }
+    [[noreturn]] void ErrorExpected(int token);
+    [[noreturn]] void ErrorLimit(FuncState* fs, int limit, const char* what);
+    void CheckLimit(FuncState* fs, int v, int l, const char* what) {
+        if (v > l) {
+            ErrorLimit(fs, l, what);
+        }
+    }
+    bool TestNext(int c);
+    void Check(int c);
+    void CheckNext(int c);
+    void CheckCondition(bool c, const char* msg) {
+        if (!c) {
+            lex_.SyntaxError(msg);
+        }
+    }
+    void CheckMatch(int what, int who, int where);
+    std::string_view StrCheckName();
+    void InitExp(ExpDesc* e, ExpKind k, int i);
+    void CodeString(ExpDesc* e, std::string_view s);
+    void CheckName(ExpDesc* e);
+    int RegisterLocalVar(std::string_view name);
+    void NewLocalVar(std::string_view name);
+    void NewLocalVarLiteral(const char* name) { NewLocalVar(lex_.NewString(name, strlen(name))); }
+    LocalVar* GetLocVar(FuncState* fs, int i);
+    void AdjustLocalVars(int nvars);
+    void RemoveVars(FuncState* fs, int toLevel);
+    int SearchUpvalue(FuncState* fs, std::string_view name);
+    int NewUpvalue(FuncState* fs, std::string_view name, ExpDesc* v);
+    int SearchVar(FuncState* fs, std::string_view n);
+    void MarkUpval(FuncState* fs, int level);
+    void SingleVarAux(FuncState* fs, std::string_view n, ExpDesc* var, bool base);
+    void SingleVar(ExpDesc* var);
+    void AdjustAssign(int nvars, int nexps, ExpDesc* e);
+    void EnterLevel();
+    void LeaveLevel() { level_--; }
+    void CloseGoto(int g, LabelDesc* label);
+    bool FindLabel(int g);
+    int NewLabelEntry(std::vector<LabelDesc>* l, std::string_view name, int line, int pc);
+    void FindGotos(LabelDesc* lb);
+    void MoveGotosOut(FuncState* fs, BlockCnt* bl);
+    void EnterBlock(FuncState* fs, BlockCnt* bl, bool isLoop);
+    void BreakLabel();
+    [[noreturn]] void UndefGoto(LabelDesc* gt);
+    void LeaveBlock(FuncState* fs);
+    Prototype* AddPrototype();
+    void CodeClosure(ExpDesc* v);
+    void OpenFunc(FuncState* fs, BlockCnt* bl);
+    void CloseFunc();
+
+    // grammar rules
+    bool BlockFollow(bool withUntil);
+    void StatList();
+    void FieldSel(ExpDesc* v);
+    void YIndex(ExpDesc* v);
+    void RecField(ConsControl* cc);
+    void CloseListField(FuncState* fs, ConsControl* cc);
+    void LastListField(FuncState* fs, ConsControl* cc);
+    void ListField(ConsControl* cc);
+    void Field(ConsControl* cc);
+    void Constructor(ExpDesc* t);
+    void ParList();
+    void Body(ExpDesc* e, bool isMethod, int line);
+    int ExpList(ExpDesc* v);
+    void FuncArgs(ExpDesc* f, int line);
+    void PrimaryExp(ExpDesc* v);
+    void SuffixedExp(ExpDesc* v);
+    void SimpleExp(ExpDesc* v);
+    BinOpr SubExpr(ExpDesc* v, int limit);
+    void Expr(ExpDesc* v) { SubExpr(v, 0); }
+    void Block();
+    void CheckConflict(LhsAssign* lh, ExpDesc* v);
+    void Assignment(LhsAssign* lh, int nvars);
+    int Cond();
+    void GotoStat(int pc);
+    void CheckRepeated(FuncState* fs, std::string_view label);
+    void SkipNoopStat();
+    void LabelStat(std::string_view label, int line);
+    void WhileStat(int line);
+    void RepeatStat(int line);
+    int Exp1();
+    void ForBody(int base, int line, int nvars, bool isNum);
+    void ForNum(std::string_view varName, int line);
+    void ForList(std::string_view indexName);
+    void ForStat(int line);
+    void TestThenBlock(int* escapeList);
+    void IfStat(int line);
+    void LocalFunc();
+    void LocalStat();
+    bool FuncName(ExpDesc* v);
+    void FuncStat(int line);
+    void ExprStat();
+    void RetStat();
+    void Statement();
+    void MainFunc(FuncState* fs);
+
+    Arena arena_;
+    Lexer lex_;
+    std::string source_;
+    FuncState* fs_ = nullptr;
+    std::string_view envName_;      // "_ENV"
+    std::string_view breakName_;    // label of break statements
+    int level_ = 0;                 // nesting of statements and expressions
+    std::vector<short> actvar_;     // locVars_ index of the active locals of all open functions
+    std::vector<LabelDesc> gt_;     // pending gotos
+    std::vector<LabelDesc> label_;  // active labels
+    // constant -> index where it was last added, shared by all functions as in lcode.c
+    std::unordered_map<ConstKey, int, ConstKeyHash> kcache_;
+};
+
+#endif //LUAVM_PARSER_H
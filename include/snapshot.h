@@ -0,0 +1,42 @@
+#ifndef LUAVM_SNAPSHOT_H
+#define LUAVM_SNAPSHOT_H
+#include "state.h"
+
+/*
+ * A file mapped privately: pages are shared with the page cache until
+ * written, a write only copies the page touched.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const char* path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    const char* Data() const { return data_; }
+    size_t Size() const { return size_; }
+private:
+    char* data_;
+    size_t size_;
+};
+
+/*
+ * Image of a LuaState between calls: its loaded chunks and every object
+ * reachable from the globals and the string metatable. Objects refer to
+ * each other by index and to the file by offset, so the image can be
+ * mapped anywhere.
+ *
+ * Restore maps the image and rebuilds the objects in one pass without
+ * running any Lua code, string bytes are used in place from the mapping.
+ * Native functions are stored relative to the code of the executable
+ * and the image records its build-id, so it is rejected by any other
+ * executable. Like binary chunks it must come from a trusted source.
+ */
+class Snapshot {
+public:
+    // L must not be running a function
+    static void Save(LuaState* L, const char* path);
+    // replaces the globals and the string metatable of L, a fresh state
+    static void Restore(LuaState* L, const char* path);
+};
+
+#endif //LUAVM_SNAPSHOT_H
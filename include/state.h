@@ -0,0 +1,237 @@
+#ifndef LUAVM_STATE_H
+#define LUAVM_STATE_H
+#include "value.h"
+#include "table.h"
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#define LUA_MULTRET         (-1)
+#define LUA_MINSTACK        20          // free slots guaranteed to a native function
+#define LUAI_MAXSTACK       1000000     // slots
+#define LUAI_MAXCCALLS      200         // nested native -> Lua calls
+#define BASIC_STACK_SIZE    (2 * LUA_MINSTACK)
+#define BASIC_CI_SIZE       64
+#define EXTRA_STACK         5           // slack above ci->top_ for metamethod calls
+
+class Chunk;
+class MappedFile;
+
+// call status
+#define CIST_LUA            (1<<0)  // call is running a Lua function
+#define CIST_FRESH          (1<<1)  // Execute() returns when this frame returns
+#define CIST_TAIL           (1<<2)  // frame was reused by a tail call
+
+/*
+ * One activation record. Frames live in a pre-allocated array and are
+ * only ever pushed and popped, so calling never allocates.
+ *
+ * Stack layout of a Lua frame:
+ *
+ *      func_ | extra args (vararg only) | base_ = fixed params, registers | top_
+ *
+ * Varargs stay where the caller put them; the fixed parameters are moved
+ * above them, so no extra storage is needed for '...'.
+ */
+class CallInfo {
+public:
+    LuaValue* func_;
+    LuaValue* base_;
+    LuaValue* top_;             // end of the registers of this frame
+    const uint32_t* savedpc_;
+    int nresults_;              // results wanted by the caller, or LUA_MULTRET
+    byte_t status_;
+};
+
+enum TMS {
+    TM_INDEX = 0,
+    TM_NEWINDEX,
+    TM_LEN,
+    TM_EQ,
+    TM_ADD,     // ADD..SHR follow the opcode order of OP_ADD..OP_SHR
+    TM_SUB,
+    TM_MUL,
+    TM_MOD,
+    TM_POW,
+    TM_DIV,
+    TM_IDIV,
+    TM_BAND,
+    TM_BOR,
+    TM_BXOR,
+    TM_SHL,
+    TM_SHR,
+    TM_UNM,
+    TM_BNOT,
+    TM_LT,
+    TM_LE,
+    TM_CONCAT,
+    TM_CALL,
+    TM_N
+};
+
+/*
+ * Error raised by Lua code or by the runtime, carries any Lua value.
+ */
+class LuaError : public std::runtime_error {
+public:
+    LuaError(const std::string& msg, const LuaValue& value)
+        : std::runtime_error(msg), value_(value) {}
+    LuaValue value_;
+};
+
+class LuaState {
+public:
+    LuaState();
+    ~LuaState();
+    LuaState(const LuaState&) = delete;
+    LuaState& operator=(const LuaState&) = delete;
+
+    /*
+     * Takes ownership of chunk and pushes its main function, with _ENV
+     * bound to the globals table.
+     */
+    void Load(Chunk* chunk);
+    // call the function below the nargs arguments on the top of the stack
+    void Call(int nargs, int nresults);
+    // like Call, but on error returns false with the error value pushed
+    bool PCall(int nargs, int nresults);
+
+    // stack access for native functions: index 1 is the first argument,
+    // negative indices count from the top
+    int GetTop() const { return int(top_ - (ci_->func_ + 1)); }
+    void SetTop(int idx);
+    void Pop(int n) { SetTop(-n - 1); }
+    LuaValue* Index(int idx);
+    void CheckStack(int n);
+    // the native function being run, valid inside a NativeFunction only
+    NativeClosure* CurrentNative() const { return ci_->func_->ncl_; }
+
+    void Push(const LuaValue& v) { *top_++ = v; }
+    void PushNil() { (top_++)->type_ = ValueType::Nil; }
+    void PushBoolean(LuaBoolean b) { *top_++ = LuaValue::Boolean(b); }
+    void PushInteger(LuaInteger i) { *top_++ = LuaValue::Integer(i); }
+    void PushNumber(LuaNumber n) { *top_++ = LuaValue::Number(n); }
+    void PushString(const char* s, size_t len) { *top_++ = LuaValue::Object(NewString(s, len)); }
+    void PushString(const char* s) { PushString(s, strlen(s)); }
+    void PushString(const std::string& s) { PushString(s.data(), s.size()); }
+    void PushFString(const char* fmt, ...);
+
+    StringObject* NewString(const char* s, size_t len);
+    StringObject* NewString(const char* s) { return NewString(s, strlen(s)); }
+    LuaTable* NewTable(size_t narray = 0, size_t nhash = 0);
+    NativeClosure* NewNative(NativeFunction fn, const char* name = "?", size_t nupvals = 0);
+
+    LuaTable* Globals() const { return globals_; }
+    void SetGlobal(const char* name, const LuaValue& v);
+    LuaValue GetGlobal(const char* name);
+    void Register(const char* name, NativeFunction fn);
+    // set fields of t from a null terminated {name, fn} list
+    void SetFuncs(LuaTable* t, const std::pair<const char*, NativeFunction>* funcs);
+
+    // operations honouring metamethods
+    // (values are taken by copy: a metamethod call may move the stack)
+    LuaValue GetTable(LuaValue t, LuaValue key);
+    void SetTable(LuaValue t, LuaValue key, LuaValue val);
+    void RawSet(LuaTable* t, const LuaValue& key, const LuaValue& val);
+    bool Equals(LuaValue a, LuaValue b);
+    bool LessThan(LuaValue a, LuaValue b);
+    bool LessEqual(LuaValue a, LuaValue b);
+    LuaValue Arith(int op, LuaValue a, LuaValue b);
+    LuaValue Length(LuaValue v);
+    void Concat(int n);     // concatenate n values on the top, leave the result
+    LuaTable* GetMetatable(const LuaValue& v) const;
+    void SetStringMetatable(LuaTable* mt) { stringMeta_ = mt; }
+    const LuaValue* GetTM(const LuaValue& v, TMS event) const;
+
+    // conversions without metamethods
+    static bool ToNumber(const LuaValue& v, LuaValue* out);
+    static bool ToInteger(const LuaValue& v, LuaInteger* out);
+    StringObject* ToStringObject(const LuaValue& v);    // numbers and strings only
+
+    // error raising, Error() prefixes the position of the calling Lua code
+    [[noreturn]] void Error(const char* fmt, ...);
+    [[noreturn]] void Throw(const LuaValue& err);
+    [[noreturn]] void ArgError(int arg, const char* msg);
+    [[noreturn]] void TypeError(int arg, const char* expected);
+    void CheckAny(int arg);
+    LuaInteger CheckInteger(int arg);
+    LuaNumber CheckNumber(int arg);
+    StringObject* CheckString(int arg);
+    LuaTable* CheckTable(int arg);
+    LuaInteger OptInteger(int arg, LuaInteger def);
+
+    std::string Where(int level);   // "chunkname:currentline: "
+
+    // while set, counts[op] is incremented for every instruction dispatched,
+    // counts must have NUM_OPCODES slots. nullptr turns counting off
+    void SetOpcodeCounts(uint64_t* counts) { opcodeCounts_ = counts; }
+
+private:
+    friend class Snapshot;
+
+    bool PreCall(LuaValue* func, int nresults);
+    bool PosCall(CallInfo* ci, LuaValue* firstResult, int nres);
+    // kCount: the loop variant that fills opcodeCounts_
+    template<bool kCount>
+    void Execute();
+    LuaValue* TryCallTM(LuaValue* func);
+    LuaValue CallTM(const LuaValue& f, const LuaValue& a, const LuaValue& b,
+                    const LuaValue* c = nullptr);
+    bool CallOrderTM(const LuaValue& a, const LuaValue& b, TMS event, bool* result);
+    [[noreturn]] void OrderError(const LuaValue& a, const LuaValue& b);
+
+    void GrowStack(size_t n);
+    CallInfo* NextCI() {
+        if (ci_ + 1 == cis_.get() + ciSize_) {
+            GrowCI();
+        }
+        return ++ci_;
+    }
+    void GrowCI();
+    int CurrentLine(CallInfo* ci) const;
+
+    LuaClosure* NewLuaClosure(Prototype* p);
+    LuaClosure* CachedClosure(Prototype* p, UpVal* const* encup, LuaValue* base);
+    UpVal* FindUpval(LuaValue* level);
+    void CloseUpvals(LuaValue* level);
+    void BindProto(Prototype* p);
+    void Link(GCObject* o) {
+        o->gcNext_ = allgc_;
+        allgc_ = o;
+    }
+    // borrow: use s in place instead of copying, s must be null terminated
+    // and outlive the state
+    StringObject* InternString(const char* s, size_t len, bool borrow);
+    void ResizeStrings(size_t n);
+
+    LuaValue* stack_;
+    LuaValue* stackLast_;       // last usable slot, EXTRA_STACK slots beyond it
+    size_t stackSize_;
+    LuaValue* top_;
+    std::unique_ptr<CallInfo[]> cis_;
+    size_t ciSize_;
+    CallInfo* ci_;
+    int nCcalls_;
+    UpVal* openUpval_;          // open upvalues of all frames, highest stack level first
+    GCObject* allgc_;
+    std::vector<StringObject*> strings_;    // intern table
+    size_t nstrings_;
+    uint32_t seed_;
+    LuaTable* globals_;
+    LuaTable* stringMeta_;
+    StringObject* tmNames_[TM_N];
+    std::vector<std::unique_ptr<Chunk>> chunks_;
+    std::vector<std::unique_ptr<MappedFile>> images_;   // restored snapshots
+    std::string concatBuf_;
+    uint64_t* opcodeCounts_ = nullptr;
+};
+
+// number formatting and parsing as done by tostring/tonumber
+size_t NumberToString(const LuaValue& v, char* buf, size_t n);
+bool StringToNumber(const char* s, size_t len, LuaValue* out);
+// arithmetic on numbers only, false where it would raise an error, see vm.cc
+bool RawArith(int op, const LuaValue& a, const LuaValue& b, LuaValue* out);
+// name of a chunk in messages, from the source of its functions
+std::string ChunkId(const std::string& source);
+
+#endif //LUAVM_STATE_H
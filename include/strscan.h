@@ -0,0 +1,29 @@
+#ifndef LUAVM_STRSCAN_H
+#define LUAVM_STRSCAN_H
+#include <cstddef>
+
+/*
+ * Byte searching used by the string library. On x86 the AVX2 or SSE2
+ * version is picked once at startup from the cpu features, other targets
+ * (or a build with LUAVM_NO_SIMD) use the scalar version.
+ *
+ * All functions return a pointer into s, or nullptr if nothing is found,
+ * and never read past s + n.
+ */
+namespace strscan {
+
+// first occurrence of byte c
+const char* FindByte(const char* s, size_t n, char c);
+
+// first occurrence of any byte of set[0, nset)
+const char* FindAnyOf(const char* s, size_t n, const char* set, size_t nset);
+
+// first occurrence of needle[0, m), s itself for an empty needle
+const char* Find(const char* s, size_t n, const char* needle, size_t m);
+
+// "avx2", "sse2" or "scalar"
+const char* Implementation();
+
+}
+
+#endif //LUAVM_STRSCAN_H
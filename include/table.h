@@ -0,0 +1,56 @@
+#ifndef LUAVM_TABLE_H
+#define LUAVM_TABLE_H
+#include "value.h"
+
+/*
+ * Lua table with an array part for keys 1..n and an open addressing hash
+ * part for everything else. Removing a key only clears its value, so
+ * that Next() keeps working while fields are assigned nil during a
+ * traversal; dead keys are dropped the next time the hash part grows.
+ */
+class LuaTable : public GCObject {
+public:
+    LuaTable(): GCObject(ValueType::Table) {}
+    LuaTable(size_t narray, size_t nhash);
+    ~LuaTable();
+    LuaTable(const LuaTable&) = delete;
+    LuaTable& operator=(const LuaTable&) = delete;
+
+    // never returns nullptr, absent keys give a nil value
+    const LuaValue* Get(const LuaValue& key) const;
+    const LuaValue* GetInt(LuaInteger key) const;
+    const LuaValue* GetStr(const StringObject* key) const;
+
+    // key must not be nil or NaN, the caller reports those errors
+    void Set(const LuaValue& key, const LuaValue& val);
+    void SetInt(LuaInteger key, const LuaValue& val);
+
+    LuaInteger Length() const;
+
+    // advance (key, val) to the next pair, starting from a nil key.
+    // returns false after the last pair or if key is not in the table
+    bool Next(LuaValue* key, LuaValue* val) const;
+
+    size_t ArraySize() const { return array_.size(); }
+
+    LuaTable* metatable_ = nullptr;
+
+private:
+    struct Node {
+        LuaValue key_;  // nil marks a free slot
+        LuaValue val_;
+    };
+
+    static uint64_t HashKey(const LuaValue& key);
+    const Node* FindNode(const LuaValue& key) const;
+    LuaValue* HashSlotForSet(const LuaValue& key);
+    void ResizeHash(size_t n);
+    void MigrateToArray();
+
+    std::vector<LuaValue> array_;
+    Node* nodes_ = nullptr;
+    size_t nodeCap_ = 0;    // power of 2, or 0
+    size_t nodeUsed_ = 0;   // slots with a key, dead keys included
+};
+
+#endif //LUAVM_TABLE_H
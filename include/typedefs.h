@@ -8,4 +8,8 @@
 
 typedef unsigned char byte_t;
 
+typedef int64_t LuaInteger;
+typedef double LuaNumber;
+typedef bool LuaBoolean;
+
 #endif //LUAVM_TYPEDEFS_H
@@ -0,0 +1,202 @@
+#ifndef LUAVM_VALUE_H
+#define LUAVM_VALUE_H
+#include "typedefs.h"
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+class LuaState;
+class Prototype;
+class LuaTable;
+class LuaClosure;
+class NativeClosure;
+class StringObject;
+class UpVal;
+
+// a native function receives its arguments at stack index 1..GetTop()
+// and returns how many values on the top of the stack are its results
+typedef int (*NativeFunction)(LuaState* L);
+
+enum class ValueType : byte_t {
+    Nil = 0,
+    Boolean,
+    Integer,
+    Number,
+    String,
+    Table,
+    LuaFunction,
+    NativeFunction,
+    UpVal,          // never stored in a LuaValue, used for GCObject only
+};
+
+/*
+ * Header of every heap object owned by a LuaState, all of them are
+ * chained in one list and released together with the state.
+ */
+class GCObject {
+public:
+    explicit GCObject(ValueType type): gcNext_(nullptr), type_(type) {}
+    GCObject* gcNext_;
+    ValueType type_;
+};
+
+/*
+ * Tagged value of 16 bytes. Kept trivially copyable so that register
+ * windows can be slid with plain copies.
+ */
+class LuaValue {
+public:
+    LuaValue(): type_(ValueType::Nil), i_(0) {}
+
+    static LuaValue Boolean(LuaBoolean b) {
+        LuaValue v;
+        v.type_ = ValueType::Boolean;
+        v.b_ = b;
+        return v;
+    }
+    static LuaValue Integer(LuaInteger i) {
+        LuaValue v;
+        v.type_ = ValueType::Integer;
+        v.i_ = i;
+        return v;
+    }
+    static LuaValue Number(LuaNumber n) {
+        LuaValue v;
+        v.type_ = ValueType::Number;
+        v.n_ = n;
+        return v;
+    }
+    static LuaValue Object(GCObject* o) {
+        LuaValue v;
+        v.type_ = o->type_;
+        v.gc_ = o;
+        return v;
+    }
+
+    ValueType Type() const { return type_; }
+    bool IsNil() const { return type_ == ValueType::Nil; }
+    bool IsInteger() const { return type_ == ValueType::Integer; }
+    bool IsFloat() const { return type_ == ValueType::Number; }
+    bool IsNumber() const { return type_ == ValueType::Integer || type_ == ValueType::Number; }
+    bool IsString() const { return type_ == ValueType::String; }
+    bool IsTable() const { return type_ == ValueType::Table; }
+    bool IsFunction() const {
+        return type_ == ValueType::LuaFunction || type_ == ValueType::NativeFunction;
+    }
+    bool IsFalsy() const {
+        return type_ == ValueType::Nil || (type_ == ValueType::Boolean && !b_);
+    }
+    bool IsCollectable() const { return type_ >= ValueType::String; }
+
+    // integer or float as float, only valid if IsNumber()
+    LuaNumber AsNumber() const {
+        return type_ == ValueType::Integer ? LuaNumber(i_) : n_;
+    }
+
+    // same type and same payload, no int/float coercion
+    bool RawEquals(const LuaValue& o) const {
+        if (type_ != o.type_) {
+            return false;
+        }
+        switch (type_) {
+            case ValueType::Nil:
+                return true;
+            case ValueType::Boolean:
+                return b_ == o.b_;
+            case ValueType::Number:
+                return n_ == o.n_;
+            default:
+                return i_ == o.i_;  // integer or object pointer
+        }
+    }
+
+    const char* TypeName() const;
+
+    ValueType type_;
+    union {
+        LuaBoolean b_;
+        LuaInteger i_;
+        LuaNumber n_;
+        GCObject* gc_;
+        StringObject* str_;
+        LuaTable* table_;
+        LuaClosure* lcl_;
+        NativeClosure* ncl_;
+    };
+};
+
+/*
+ * Immutable, interned string. The bytes follow the object in the same
+ * allocation unless the string is borrowed from an external buffer.
+ */
+class StringObject : public GCObject {
+public:
+    StringObject(const char* data, size_t len, uint32_t hash)
+        : GCObject(ValueType::String), hnext_(nullptr), data_(data), len_(len), hash_(hash) {}
+    const char* data() const { return data_; }
+    size_t size() const { return len_; }
+    uint32_t Hash() const { return hash_; }
+
+    static uint32_t HashBytes(const char* s, size_t len, uint32_t seed) {
+        uint32_t h = seed ^ uint32_t(len);
+        size_t step = (len >> 5) + 1;
+        for (; len >= step; len -= step) {
+            h ^= ((h << 5) + (h >> 2) + byte_t(s[len - 1]));
+        }
+        return h;
+    }
+
+    StringObject* hnext_;   // chain in the intern table
+    const char* data_;
+    size_t len_;
+    uint32_t hash_;
+};
+
+/*
+ * Points to a stack slot while the variable is alive (open), and to its
+ * own copy once the frame that owns the slot has returned (closed).
+ */
+class UpVal : public GCObject {
+public:
+    UpVal(): GCObject(ValueType::UpVal), v_(&closed_), openNext_(nullptr) {}
+    bool IsOpen() const { return v_ != &closed_; }
+    LuaValue* v_;
+    LuaValue closed_;
+    UpVal* openNext_;
+};
+
+/*
+ * Lua function: its prototype and the upvalues it captured, stored inline
+ * after the object in the same allocation, see LuaState::NewLuaClosure.
+ */
+class LuaClosure : public GCObject {
+public:
+    LuaClosure(Prototype* proto, uint32_t nupvals)
+        : GCObject(ValueType::LuaFunction), proto_(proto), nupvals_(nupvals) {
+        for (uint32_t i = 0; i < nupvals; ++i) {
+            upvals_[i] = nullptr;
+        }
+    }
+    // bytes of a closure with n upvalues
+    static size_t SizeFor(uint32_t n) {
+        return sizeof(LuaClosure) + (n > 1 ? n - 1 : 0) * sizeof(UpVal*);
+    }
+    Prototype* proto_;
+    uint32_t nupvals_;
+    UpVal* upvals_[1];  // nupvals_ entries
+};
+
+class NativeClosure : public GCObject {
+public:
+    typedef void (*Target)();
+
+    NativeClosure(NativeFunction fn, const char* name, size_t nupvals = 0)
+        : GCObject(ValueType::NativeFunction), fn_(fn), name_(name), target_(nullptr),
+          upvals_(nupvals) {}
+    NativeFunction fn_;
+    const char* name_;  // for error messages
+    Target target_;     // C++ function behind a binding thunk (binding.h)
+    std::vector<LuaValue> upvals_;  // private state, e.g. of an iterator
+};
+
+#endif //LUAVM_VALUE_H
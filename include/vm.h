@@ -8,8 +8,46 @@
 #include "opcodes.h"
 #include "string"
 
-#define MAXARG_Bx (1<<18-1)        // 262143
+#define MAXARG_Bx ((1<<18)-1)      // 262143
 #define MAXARG_sBx (MAXARG_Bx >> 1) // 131071
+#define MAXARG_Ax ((1<<26)-1)
+#define MAXARG_A 255
+#define MAXARG_B 511
+#define MAXARG_C 511
+
+/*
+ * Field accessors for the interpreter loop, layout of an instruction:
+ *   | B:9 | C:9 | A:8 | op:6 |  or  | Bx:18 | A:8 | op:6 |  or  | Ax:26 | op:6 |
+ */
+#define GET_OPCODE(i)   (int((i) & 0x3f))
+#define GETARG_A(i)     (int(((i) >> 6) & 0xff))
+#define GETARG_B(i)     (int(((i) >> 23) & 0x1ff))
+#define GETARG_C(i)     (int(((i) >> 14) & 0x1ff))
+#define GETARG_Bx(i)    (int((i) >> 14))
+#define GETARG_sBx(i)   (GETARG_Bx(i) - MAXARG_sBx)
+#define GETARG_Ax(i)    (int((i) >> 6))
+
+/*
+ * Builders and setters used by the code generator
+ */
+#define CREATE_ABC(o,a,b,c) (uint32_t(o) | uint32_t(a) << 6 | uint32_t(b) << 23 | uint32_t(c) << 14)
+#define CREATE_ABx(o,a,bx)  (uint32_t(o) | uint32_t(a) << 6 | uint32_t(bx) << 14)
+#define CREATE_Ax(o,ax)     (uint32_t(o) | uint32_t(ax) << 6)
+#define SET_OPCODE(i,o)     ((i) = ((i) & ~0x3fu) | uint32_t(o))
+#define SETARG_A(i,v)       ((i) = ((i) & ~(0xffu << 6)) | (uint32_t(v) & 0xff) << 6)
+#define SETARG_B(i,v)       ((i) = ((i) & ~(0x1ffu << 23)) | (uint32_t(v) & 0x1ff) << 23)
+#define SETARG_C(i,v)       ((i) = ((i) & ~(0x1ffu << 14)) | (uint32_t(v) & 0x1ff) << 14)
+#define SETARG_Bx(i,v)      ((i) = ((i) & 0x3fffu) | uint32_t(v) << 14)
+#define SETARG_sBx(i,v)     SETARG_Bx(i, (v) + MAXARG_sBx)
+
+#define BITRK           (1 << 8)    // B/C of an RK operand refers to a constant
+#define ISK(x)          ((x) & BITRK)
+#define INDEXK(x)       ((x) & ~BITRK)
+#define RKASK(x)        ((x) | BITRK)
+#define MAXINDEXRK      (BITRK - 1)
+#define NO_REG          MAXARG_A    // no register, in TESTSET patching
+
+#define LFIELDS_PER_FLUSH   50      // SETLIST batch size
 
 
 class Instruction {
@@ -20,8 +58,8 @@ public:
 
     void ABC(uint32_t* a, uint32_t* b, uint32_t* c) const {
         *a = (instruction_ >> 6 & 0xff);
-        *b = (instruction_ >> 14 & 0x1ff);
-        *c = (instruction_ >> 23 & 0x1ff);
+        *b = (instruction_ >> 23 & 0x1ff);
+        *c = (instruction_ >> 14 & 0x1ff);
     }
 
     void ABx(uint32_t* a, uint32_t* bx) const {
@@ -42,7 +80,7 @@ public:
         return opcodes[Opcode()].name_;
     }
 
-    OpMode OpMode() const {
+    ::OpMode OpMode() const {
         return opcodes[Opcode()].opMode_;
     }
 
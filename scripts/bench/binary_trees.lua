@@ -0,0 +1,30 @@
+-- binary-trees from the Computer Language Benchmarks Game: table
+-- allocation and recursion. Objects live until the state is closed,
+-- so the depth is kept small
+local function bottomUp(depth)
+  if depth == 0 then return {} end
+  depth = depth - 1
+  return {bottomUp(depth), bottomUp(depth)}
+end
+
+local function check(tree)
+  if tree[1] then
+    return 1 + check(tree[1]) + check(tree[2])
+  end
+  return 1
+end
+
+return function()
+  local maxDepth = 12
+  local total = check(bottomUp(maxDepth + 1))
+  local longLived = bottomUp(maxDepth)
+  for depth = 4, maxDepth, 2 do
+    local iters = 1 << (maxDepth - depth + 4)
+    local sum = 0
+    for _ = 1, iters do
+      sum = sum + check(bottomUp(depth))
+    end
+    total = total + sum
+  end
+  return total + check(longLived)
+end
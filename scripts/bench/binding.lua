@@ -0,0 +1,2 @@
+local function empty(a, b) end
+return function(f, n, a, b) for i = 1, n do f(a, b) end end, empty
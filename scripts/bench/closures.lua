@@ -0,0 +1,46 @@
+-- closures: callbacks created in tight loops, capturing nothing, loop
+-- locals or outer upvalues, closed on every iteration and on return
+local function map(t, f)
+  local r = {}
+  for i = 1, #t do r[i] = f(t[i]) end
+  return r
+end
+
+local function fold(t, f, acc)
+  for i = 1, #t do acc = f(acc, t[i]) end
+  return acc
+end
+
+return function()
+  local data = {}
+  for i = 1, 2000 do data[i] = i end
+  local sum = 0
+
+  for round = 1, 20 do
+    local doubled = map(data, function(x) return x * 2 end)
+    local scaled = map(doubled, function(x) return x + round end)
+    sum = sum + fold(scaled, function(a, b) return a + b end, 0)
+  end
+
+  local counters = {}
+  for i = 1, 20000 do
+    local n = i
+    counters[i % 64 + 1] = function() n = n + 1; return n end
+  end
+  for i = 1, #counters do sum = sum + counters[i]() end
+
+  local function adder(k)
+    return function(x) return x + k end
+  end
+  for i = 1, 20000 do
+    sum = sum + adder(i)(1)
+  end
+
+  for i = 1, 10000 do
+    local a, b = i, -i
+    local swap = function() a, b = b, a end
+    swap()
+    if a > 0 then sum = sum + a end
+  end
+  return sum
+end
@@ -0,0 +1,37 @@
+-- start-up of an application made of many modules: every module builds
+-- its tables, closures and strings once, nothing runs after that
+
+modules = {}
+
+local function define(name)
+  local M = {name = name}
+  local prefix = name .. "."
+  for i = 1, 40 do
+    M["handler" .. i] = function(x) return prefix .. i .. ":" .. tostring(x) end
+  end
+  local codes = {}
+  for i = 1, 300 do
+    codes[string.format("%s_%04d", name, i)] = i * 7 % 97
+  end
+  M.codes = codes
+  local words = {}
+  for w in string.gmatch(string.rep("alpha beta gamma delta ", 25), "%a+") do
+    words[#words + 1] = w:upper() .. #words
+  end
+  M.words = words
+  M.config = setmetatable({}, {__index = {level = 3, verbose = false, ratio = 0.75}})
+  modules[name] = M
+  return M
+end
+
+for i = 1, 200 do
+  define("mod" .. i)
+end
+
+function check()
+  local n = 0
+  for name, M in pairs(modules) do
+    n = n + M.codes[name .. "_0007"] + #M.words + M.config.level
+  end
+  return n, modules.mod7.handler3(42), ("%d"):format(n)
+end
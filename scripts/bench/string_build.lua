@@ -0,0 +1,19 @@
+-- string building: concatenation, formatting, tostring and the string
+-- library on short strings
+return function()
+  local parts = {}
+  local n = 0
+  for i = 1, 30000 do
+    local s = "item" .. i .. ":" .. (i * 3) % 17
+    s = s:upper():sub(2, -2)
+    parts[#parts + 1] = string.format("%s=%d", s, #s)
+    n = n + #parts[#parts]
+  end
+  local line = ""
+  for i = 1, 2000 do
+    line = line .. tostring(i % 10)
+  end
+  local count = 0
+  for _ in line:gmatch("5") do count = count + 1 end
+  return n + #line + count
+end
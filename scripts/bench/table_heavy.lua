@@ -0,0 +1,31 @@
+-- table-heavy: array fill and traversal, hash inserts with string and
+-- integer keys, pairs/ipairs iteration and field updates
+return function()
+  local arr = {}
+  for i = 1, 50000 do arr[i] = i * 2 end
+  local sum = 0
+  for _, v in ipairs(arr) do sum = sum + v end
+
+  local map = {}
+  for i = 1, 20000 do
+    map["k" .. (i % 5000)] = (map["k" .. (i % 5000)] or 0) + i
+  end
+  for _, v in pairs(map) do sum = sum + v end
+
+  local objs = {}
+  for i = 1, 10000 do
+    objs[i] = {id = i, score = 0, tags = {i % 7, i % 11}}
+  end
+  for round = 1, 5 do
+    for i = 1, #objs do
+      local o = objs[i]
+      o.score = o.score + o.tags[1] * round + o.tags[2]
+    end
+  end
+  for i = 1, #objs do sum = sum + objs[i].score end
+
+  local sparse = {}
+  for i = 1, 20000 do sparse[i * 7919 % 65536] = i end
+  for k, v in pairs(sparse) do sum = sum + (k ~ v) end
+  return sum
+end
@@ -0,0 +1,34 @@
+// Replaces the global operator new/delete with counting versions. Link it
+// into an executable to get real heap numbers from memstat::LiveBytes().
+//
+#include "memstat.h"
+#include <cstdlib>
+#include <new>
+
+// keep the block size in front of the user pointer, aligned for any type
+static constexpr size_t kHeader = alignof(std::max_align_t);
+
+static const bool installed = (memstat::SetHookInstalled(), true);
+
+void* operator new(size_t n) {
+    auto p = static_cast<char*>(malloc(n + kHeader));
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    *reinterpret_cast<size_t*>(p) = n;
+    memstat::RecordAlloc(n);
+    return p + kHeader;
+}
+
+void operator delete(void* p) noexcept {
+    if (p == nullptr) {
+        return;
+    }
+    auto base = static_cast<char*>(p) - kHeader;
+    memstat::RecordFree(*reinterpret_cast<size_t*>(base));
+    free(base);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
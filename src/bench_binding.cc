@@ -0,0 +1,88 @@
+#include "binding.h"
+#include "chunk.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string_view>
+
+/*
+ * usage: luavm_bench_binding [calls] [chunk]
+ *
+ * Times a Lua loop calling f(a, b) for an empty Lua function, a raw
+ * NativeFunction and functions bound through binding.h. The loop comes
+ * from scripts/bench/binding.luac.
+ */
+
+static int64_t Add(int64_t a, int64_t b) {
+    return a + b;
+}
+
+static double Mul(double a, double b) {
+    return a * b;
+}
+
+static size_t Length(std::string_view a, std::string_view b) {
+    return a.size() + b.size();
+}
+
+static int RawAdd(LuaState* L) {
+    L->PushInteger(L->CheckInteger(1) + L->CheckInteger(2));
+    return 1;
+}
+
+static double Run(LuaState* L, const LuaValue& f, LuaInteger n, const LuaValue& a, const LuaValue& b) {
+    L->Push(*L->Index(1));
+    L->Push(f);
+    L->PushInteger(n);
+    L->Push(a);
+    L->Push(b);
+    auto start = std::chrono::steady_clock::now();
+    L->Call(4, 0);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / double(n);
+}
+
+int main(int argc, char *argv[]) {
+    LuaInteger n = argc > 1 ? atoll(argv[1]) : 10000000;
+    const char* path = argc > 2 ? argv[2] : LUAVM_SCRIPTS_DIR "/bench/binding.luac";
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        printf("failed to open %s\n", path);
+        exit(-1);
+    }
+    std::stringstream buf;
+    buf << file.rdbuf();
+    std::string bytes = buf.str();
+
+    LuaState L;
+    try {
+        L.Load(new Chunk(bytes.data(), bytes.size()));
+        L.Call(0, 2);   // loop runner at 1, empty Lua function at 2
+
+        LuaValue one = LuaValue::Integer(1), two = LuaValue::Integer(2);
+        LuaValue x = LuaValue::Number(1.5), y = LuaValue::Number(2.5);
+        LuaValue s = LuaValue::Object(L.NewString("hello")), t = LuaValue::Object(L.NewString("world"));
+
+        double base = Run(&L, *L.Index(2), n, one, two);
+        printf("%-24s %8s %8s\n", "function", "ns/call", "ratio");
+        printf("%-24s %8.2f %8.2f\n", "empty Lua function", base, 1.0);
+        struct {
+            const char* name;
+            LuaValue f;
+            LuaValue a;
+            LuaValue b;
+        } cases[] = {
+                {"raw NativeFunction", LuaValue::Object(L.NewNative(&RawAdd, "rawadd")), one, two},
+                {"bound int64 add", LuaValue::Object(BindFunction(&L, "add", &Add)), one, two},
+                {"bound double mul", LuaValue::Object(BindFunction(&L, "mul", &Mul)), x, y},
+                {"bound string_view len", LuaValue::Object(BindFunction(&L, "len", &Length)), s, t},
+        };
+        for (auto& c : cases) {
+            double ns = Run(&L, c.f, n, c.a, c.b);
+            printf("%-24s %8.2f %8.2f\n", c.name, ns, ns / base);
+        }
+    } catch (const std::exception& e) {
+        printf("benchmark failed : %s\n", e.what());
+        exit(-1);
+    }
+}
@@ -0,0 +1,140 @@
+#include "chunk.h"
+#include "lualib.h"
+#include "opcodes.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+/*
+ * usage: luavm_bench_exec [runs] [workload...]
+ *
+ * Runs each workload of scripts/bench <runs> times and prints one JSON
+ * document to stdout. A workload chunk returns a function doing one
+ * iteration and returning a checksum, so loading is not timed.
+ *
+ * Wall times come from runs without instrumentation; one extra run
+ * with SetOpcodeCounts gives the dispatch histogram, and with the
+ * median time the instructions per second.
+ */
+
+static const char* const defaultWorkloads[] = {
+        "fib", "nbody", "binary_trees", "spectral_norm", "string_build", "table_heavy", "closures",
+};
+
+typedef std::chrono::duration<double, std::milli> Millis;
+
+static std::string ReadFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    std::stringstream buf;
+    buf << file.rdbuf();
+    return buf.str();
+}
+
+// the function on the top of the stack is called and left there
+static std::string RunOnce(LuaState* L) {
+    L->Push(*L->Index(-1));
+    L->Call(0, 1);
+    StringObject* s = ToString(L, *L->Index(-1));
+    std::string checksum(s->data(), s->size());
+    L->Pop(1);
+    return checksum;
+}
+
+static std::string OpName(int op) {
+    std::string name = opcodes[op].name_;
+    name.erase(name.find_last_not_of(' ') + 1);
+    return name;
+}
+
+static void PrintJsonString(const std::string& s) {
+    putchar('"');
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            putchar('\\');
+            putchar(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void Bench(const char* name, int runs, bool first) {
+    std::string bytes = ReadFile(std::string(LUAVM_SCRIPTS_DIR "/bench/") + name + ".luac");
+    LuaState L;
+    OpenLibs(&L);
+    L.Load(new Chunk(bytes.data(), bytes.size()));
+    L.Call(0, 1);
+
+    std::vector<double> times;
+    std::string checksum;
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        checksum = RunOnce(&L);
+        times.push_back(Millis(std::chrono::steady_clock::now() - start).count());
+    }
+    uint64_t counts[NUM_OPCODES] = {};
+    L.SetOpcodeCounts(counts);
+    RunOnce(&L);
+    L.SetOpcodeCounts(nullptr);
+
+    uint64_t total = 0;
+    for (uint64_t n : counts) {
+        total += n;
+    }
+    std::sort(times.begin(), times.end());
+    double median = times[times.size() / 2];
+    double mean = 0;
+    for (double t : times) {
+        mean += t / double(times.size());
+    }
+
+    printf("%s    {\"name\": ", first ? "" : ",\n");
+    PrintJsonString(name);
+    printf(", \"runs\": %d, \"checksum\": ", runs);
+    PrintJsonString(checksum);
+    printf(",\n     \"wall_ms\": {\"min\": %.3f, \"median\": %.3f, \"mean\": %.3f, \"max\": %.3f},\n",
+           times.front(), median, mean, times.back());
+    printf("     \"instructions\": %llu, \"instructions_per_sec\": %.0f,\n",
+           static_cast<unsigned long long>(total), double(total) / (median / 1000.0));
+    printf("     \"opcodes\": {");
+    bool firstOp = true;
+    for (int op = 0; op < NUM_OPCODES; ++op) {
+        if (counts[op] == 0) {
+            continue;
+        }
+        printf("%s\"%s\": %llu", firstOp ? "" : ", ", OpName(op).c_str(),
+               static_cast<unsigned long long>(counts[op]));
+        firstOp = false;
+    }
+    printf("}}");
+}
+
+int main(int argc, char *argv[]) {
+    int runs = argc > 1 ? atoi(argv[1]) : 5;
+    if (runs < 1) {
+        printf("usage: %s [runs] [workload...]\n", argv[0]);
+        exit(-1);
+    }
+    std::vector<const char*> workloads(argv + std::min(argc, 2), argv + argc);
+    if (workloads.empty()) {
+        workloads.assign(std::begin(defaultWorkloads), std::end(defaultWorkloads));
+    }
+    printf("{\"vm\": \"luavm\", \"runs\": %d, \"workloads\": [\n", runs);
+    try {
+        for (size_t i = 0; i < workloads.size(); ++i) {
+            Bench(workloads[i], runs, i == 0);
+        }
+    } catch (const std::exception& e) {
+        fflush(stdout);
+        fprintf(stderr, "benchmark failed : %s\n", e.what());
+        exit(-1);
+    }
+    printf("\n]}\n");
+}
@@ -0,0 +1,97 @@
+#include "snapshot.h"
+#include "chunk.h"
+#include "lualib.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+/*
+ * usage: luavm_bench_snapshot [runs] [chunk] [image]
+ *
+ * Cold start: open the libraries, load the chunk and run its init code.
+ * Warm start: restore the image saved after one cold start. Both states
+ * must then give the same results for check(). The default chunk is
+ * scripts/bench/modules.luac.
+ */
+
+typedef std::chrono::duration<double, std::milli> Millis;
+
+static std::string Check(LuaState* L) {
+    L->Push(L->GetGlobal("check"));
+    L->Call(0, 3);
+    std::string r;
+    for (int i = 1; i <= 3; ++i) {
+        StringObject* s = ToString(L, *L->Index(i));
+        r.append(s->data(), s->size()).push_back(' ');
+    }
+    L->SetTop(0);
+    return r;
+}
+
+static void ColdStart(LuaState* L, const std::string& bytes) {
+    OpenLibs(L);
+    L->Load(new Chunk(bytes.data(), bytes.size(), DebugInfo::Lazy));
+    L->Call(0, 0);
+}
+
+static double Median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+int main(int argc, char *argv[]) {
+    int runs = argc > 1 ? atoi(argv[1]) : 20;
+    const char* path = argc > 2 ? argv[2] : LUAVM_SCRIPTS_DIR "/bench/modules.luac";
+    const char* image = argc > 3 ? argv[3] : "/tmp/luavm_bench_snapshot.img";
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        printf("failed to open %s\n", path);
+        exit(-1);
+    }
+    std::stringstream buf;
+    buf << file.rdbuf();
+    std::string bytes = buf.str();
+
+    try {
+        std::string expected;
+        {
+            LuaState L;
+            ColdStart(&L, bytes);
+            Snapshot::Save(&L, image);
+            expected = Check(&L);
+        }
+        std::ifstream img(image, std::ios::binary | std::ios::ate);
+        printf("image: %s, %lld bytes\n", image, static_cast<long long>(img.tellg()));
+
+        std::vector<double> cold, warm;
+        for (int i = 0; i < runs; ++i) {
+            // teardown is left out of both timings
+            auto start = std::chrono::steady_clock::now();
+            std::unique_ptr<LuaState> L(new LuaState());
+            ColdStart(L.get(), bytes);
+            cold.push_back(Millis(std::chrono::steady_clock::now() - start).count());
+            L.reset();
+
+            start = std::chrono::steady_clock::now();
+            L.reset(new LuaState());
+            Snapshot::Restore(L.get(), image);
+            warm.push_back(Millis(std::chrono::steady_clock::now() - start).count());
+        }
+
+        LuaState L;
+        Snapshot::Restore(&L, image);
+        std::string got = Check(&L);
+        if (got != expected) {
+            printf("warm state differs: %s vs %s\n", got.c_str(), expected.c_str());
+            exit(-1);
+        }
+        printf("%-12s %10s\n", "start", "ms");
+        printf("%-12s %10.3f\n", "cold", Median(cold));
+        printf("%-12s %10.3f\n", "warm", Median(warm));
+        printf("speedup %.1fx, check() = %s\n", Median(cold) / Median(warm), got.c_str());
+    } catch (const std::exception& e) {
+        printf("benchmark failed : %s\n", e.what());
+        exit(-1);
+    }
+}
@@ -2,64 +2,93 @@
 // Created by 于承业 on 2023/10/17.
 //
 #include "chunk.h"
+#include "chunk_stream.h"
+#include <algorithm>
+#include <stdexcept>
 
 /*
  * Parse a binary chunk from data
  */
-Chunk::Chunk(const char *data, size_t n) {
+Chunk::Chunk(const char *data, size_t n, DebugInfo debug) {
     ChunkReader reader((Slice(data, n)));
+    Load(reader, debug);
+}
+
+/*
+ * Parse a binary chunk while its bytes are still arriving
+ */
+Chunk::Chunk(ChunkStream *stream, DebugInfo debug) {
+    ChunkReader reader(stream);
+    Load(reader, debug);
+}
+
+Chunk::Chunk(Prototype *main) : mainFunc_(main) {
+    sizeUpvalue_ = byte_t(main->upvalues_.size());
+}
+
+Chunk::~Chunk() {
+    delete mainFunc_;
+}
+
+void Chunk::Load(ChunkReader &reader, DebugInfo debug) {
+    reader.SetDebugInfo(debug, &debugBytes_);
     CheckHeader(reader);
     sizeUpvalue_ = reader.ReadByte();
     mainFunc_ = reader.ReadProto("");
-    Print(mainFunc_);
+    debugBytes_.shrink_to_fit();
+}
+
+// the header field of size bytes just read does not match this build
+[[noreturn]] static void HeaderMismatch(const ChunkReader& reader, const char* field, size_t size) {
+    throw ChunkError(std::string(field) + " mismatch", reader.Offset() - size);
 }
 
 void Chunk::CheckHeader(ChunkReader& reader) {
     Slice s;
     if ((s = reader.ReadBytes(4)) != LUA_SIGNATURE) {
-        throw std::runtime_error(std::string("Signature mismatch"));
+        HeaderMismatch(reader, "Signature", 4);
     }
     memcpy(&header_.signature_, s.data(), sizeof(header_.signature_));
 
     if ((header_.version_ = reader.ReadByte()) != LUAC_VERSION) {
-        throw std::runtime_error(std::string("Version mismatch"));
+        HeaderMismatch(reader, "Version", 1);
     }
 
     if ((header_.format_ = reader.ReadByte()) != LUAC_FORMAT) {
-        throw std::runtime_error(std::string("Format mismatch"));
+        HeaderMismatch(reader, "Format", 1);
     }
 
     if ((s = reader.ReadBytes(6)) != LUAC_DATA) {
-        throw std::runtime_error(std::string("LUAC_DATA mismatch"));
+        HeaderMismatch(reader, "LUAC_DATA", 6);
     }
     memcpy(&header_.luacData, s.data(), sizeof(header_.luacData));
 
     if ((header_.cintSize_ = reader.ReadByte()) != CINT_SIZE) {
-        throw std::runtime_error(std::string("CINT_SIZE mismatch"));
+        HeaderMismatch(reader, "CINT_SIZE", 1);
     }
 
     if ((header_.sizetSize_ = reader.ReadByte()) != SIZET_SIZE) {
-        throw std::runtime_error(std::string("SIZET_SIZE mismatch"));
+        HeaderMismatch(reader, "SIZET_SIZE", 1);
     }
 
     if ((header_.instructionSize_ = reader.ReadByte()) != INSTRUCTION_SIZE) {
-        throw std::runtime_error(std::string("INSTRUCTION_SIZE mismatch"));
+        HeaderMismatch(reader, "INSTRUCTION_SIZE", 1);
     }
 
     if ((header_.luaIntegerSize_ = reader.ReadByte()) != LUA_INTEGER_SIZE) {
-        throw std::runtime_error(std::string("LUA_INTEGER_SIZE mismatch"));
+        HeaderMismatch(reader, "LUA_INTEGER_SIZE", 1);
     }
 
     if ((header_.luaNumberSize_ = reader.ReadByte()) != LUA_NUMBER_SIZE) {
-        throw std::runtime_error(std::string("LUA_NUMBER_SIZE mismatch"));
+        HeaderMismatch(reader, "LUA_NUMBER_SIZE", 1);
     }
 
     if ((header_.luacInt_ = reader.ReadLuaInteger()) != LUAC_INT) {
-        throw std::runtime_error(std::string("Endianness mismatch"));
+        HeaderMismatch(reader, "Endianness", 8);
     }
 
     if ((header_.luacNum_ = reader.ReadLuaNumber()) != LUAC_NUM) {
-        throw std::runtime_error(std::string("Float format mismatch"));
+        HeaderMismatch(reader, "Float format", 8);
     }
 }
 
@@ -82,15 +111,15 @@ void Chunk::PrintHeader(Prototype* f) {
            f->numParams_, varArgFlag.c_str(), f->maxStackSize_, f->upvalues_.size());
 
     printf("%zu locals, %zu constants, %zu functions\n",
-           f->locVars_.size(), f->constants_.size(), f->protos_.size());
+           f->LocVars().size(), f->constants_.size(), f->protos_.size());
 }
 
 void Chunk::PrintCode(Prototype *f) {
     static char buf[4096];
     for (int i = 0; i < f->code_.size(); ++i) {
         buf[0] = '-'; buf[1] = '\0';
-        if (!f->lineInfo_.empty()) {
-            snprintf(buf, sizeof(buf), "%d", f->lineInfo_[i]);
+        if (!f->Lines().Empty()) {
+            snprintf(buf, sizeof(buf), "%d", f->Lines().GetLine(i));
         }
         printf("\t%d\t[%s]\t0x%08X\n", i+1, buf, f->code_[i]);
     }
@@ -105,9 +134,9 @@ void Chunk::PrintDetail(Prototype *f) {
         printf("\t%d\t%s\n", i++, k.String().c_str());
     }
 
-    printf("locals (%zu):\n", f->locVars_.size());
+    printf("locals (%zu):\n", f->LocVars().size());
     i = 0;
-    for (auto& l:f->locVars_) {
+    for (auto& l:f->LocVars()) {
         printf("\t%d\t%s\t%d\t%d\n", i++,
                l.varName_.c_str(),
                l.startPC_,
@@ -115,7 +144,7 @@ void Chunk::PrintDetail(Prototype *f) {
     }
 
     auto upvalName = [this](Prototype* f_, byte_t idx) -> std::string {
-        return f_->upvalueNames_.empty() ? "-" : f_->upvalueNames_[idx];
+        return f_->UpvalueNames().empty() ? "-" : f_->UpvalueNames()[idx];
     };
     printf("upvalues (%zu):\n", f->upvalues_.size());
     i = 0;
@@ -135,162 +164,123 @@ void Chunk::Print(Prototype* f) {
     }
 }
 
-byte_t ChunkReader::ReadByte() {
-    byte_t b = *reinterpret_cast<const byte_t*>(data_.data());
-    data_.remove_prefix(sizeof(byte_t));
-    return b;
-}
-
-uint32_t ChunkReader::ReadUint32() {
-    uint32_t i = *reinterpret_cast<const uint32_t*>(data_.data());
-    data_.remove_prefix(sizeof(uint32_t));
-    return i;
-}
-
-uint64_t ChunkReader::ReadUint64() {
-    uint64_t i = *reinterpret_cast<const uint64_t*>(data_.data());
-    data_.remove_prefix(sizeof(uint64_t));
-    return i;
-}
-
-LuaInteger ChunkReader::ReadLuaInteger() {
-    return LuaInteger(ReadUint64());
-}
-
-LuaNumber ChunkReader::ReadLuaNumber() {
-    double f = *reinterpret_cast<const double*>(data_.data());
-    data_.remove_prefix(sizeof(double ));
-    return f;
-}
-
-std::string ChunkReader::ReadLuaString() {
-    uint64_t size = ReadByte();
-
-    if (size == 0) {
-        return "";
-    } else if (size == 0xFF) {
-        size = ReadUint64();
+void LineInfo::Append(uint32_t line) {
+    int64_t delta = int64_t(line) - int64_t(lastLine_);
+    if (delta <= kAbsMarker || delta > 0x7f || sinceAbs_ >= kMaxWithoutAbs) {
+        abs_.push_back(AbsLine{uint32_t(deltas_.size()), line});
+        delta = kAbsMarker;
+        sinceAbs_ = 0;
     }
-    Slice bytes = ReadBytes(size - 1);
-    return {bytes.data(), bytes.size()};
+    deltas_.push_back(int8_t(delta));
+    ++sinceAbs_;
+    lastLine_ = line;
 }
 
-Slice ChunkReader::ReadBytes(uint32_t n) {
-    Slice s(data_.data(), n);
-    data_.remove_prefix(n);
-    return s;
-}
-
-Prototype *ChunkReader::ReadProto(const std::string& parentSource) {
-    auto proto = new Prototype();
-    proto->source_ = ReadLuaString();
-    if (proto->source_.empty()) {
-        proto->source_ = parentSource; // copy
+int LineInfo::GetLine(size_t pc) const {
+    if (pc >= deltas_.size()) {
+        return -1;
     }
-    proto->lineDefined_ = ReadUint32();
-    proto->lastLineDefined_ = ReadUint32();
-    proto->numParams_ = ReadByte();
-    proto->isVarArg_ = ReadByte();
-    proto->maxStackSize_ = ReadByte();
-    proto->code_ = ReadCode();
-    proto->constants_ = ReadConstants();
-    proto->upvalues_ = ReadUpvalues();
-    proto->protos_ = ReadProtos(proto->source_);
-    proto->lineInfo_ = ReadLineInfo();
-    proto->locVars_ = ReadLocVars();
-    proto->upvalueNames_ = ReadUpvalueNames();
-
-    return proto;
-}
-
-
-
-std::vector<uint32_t> ChunkReader::ReadCode() {
-    auto size = ReadUint32();
-    std::vector<uint32_t> code(size);
-    for (auto& c:code) {
-        c = ReadUint32();
+    // start from the last checkpoint at or before pc
+    auto it = std::upper_bound(abs_.begin(), abs_.end(), pc,
+                               [](size_t p, const AbsLine& a) { return p < a.pc_; });
+    size_t basePc = 0;
+    int64_t line = lineDefined_;
+    if (it != abs_.begin()) {
+        --it;
+        basePc = size_t(it->pc_) + 1;
+        line = it->line_;
     }
-    return code;
-}
-
-std::vector<Constant> ChunkReader::ReadConstants() {
-    uint32_t size = ReadUint32();
-    std::vector<Constant> v(size);
-    for (auto& c:v) {
-        c = std::move(ReadConstant());
+    for (size_t i = basePc; i <= pc; ++i) {
+        line += deltas_[i];
     }
-    return v;
+    return int(line);
 }
 
-Constant ChunkReader::ReadConstant() {
-    auto tag = ConstantTag(ReadByte());
-    Constant constant;
-    switch (tag) {
-        case ConstantTag::BOOLEAN:
-            constant.SetBoolean(ReadByte() != 0);
-            break;
-        case ConstantTag::INTEGER:
-            constant.SetInterger(ReadLuaInteger());
-            break;
-        case ConstantTag::NUMBER:
-            constant.SetNumber(ReadLuaNumber());
-            break;
-        case ConstantTag::SSTRING:
-        case ConstantTag::STRING:
-            constant.SetString(ReadLuaString());
-            break;
-        case ConstantTag::NIL:
-            break;
-    }
-    return constant;
+void Prototype::LoadDebugInfo() {
+    const DebugRange& r = debugRange_;
+    ChunkReader reader(Slice(debugBytes_->data() + r.offset_,
+                             size_t(r.lineInfo_) + r.locVars_ + r.upvalueNames_));
+    lineInfo_ = reader.ReadLineInfo(lineDefined_);
+    locVars_ = reader.ReadLocVars();
+    upvalueNames_ = reader.ReadUpvalueNames();
+    debugBytes_ = nullptr;
 }
 
-std::vector<Upvalue> ChunkReader::ReadUpvalues() {
-    auto size = ReadUint32();
-    std::vector<Upvalue> v;
-    v.reserve(size);
-    for (int i = 0; i < size; ++i) {
-        v.emplace_back(ReadByte(), ReadByte());
+MemoryUsage Prototype::Usage() const {
+    using namespace memstat;
+    MemoryUsage u;
+    u.proto_ = sizeof(Prototype);
+    u.source_ = HeapBytes(source_);
+    u.code_ = HeapBytes(code_);
+    u.constants_ = HeapBytes(constants_) + HeapBytes(k_);
+    for (auto& k:constants_) {
+        u.constants_ += k.HeapBytes();
     }
-    return v;
-}
-
-std::vector<uint32_t> ChunkReader::ReadLineInfo() {
-    std::vector<uint32_t> v(ReadUint32());
-    for (auto& n:v) {
-        n = ReadUint32();
+    u.upvalues_ = HeapBytes(upvalues_);
+    u.protos_ = HeapBytes(protos_);
+    u.lineInfo_ = lineInfo_.HeapBytes();
+    u.locVars_ = HeapBytes(locVars_);
+    for (auto& l:locVars_) {
+        u.locVars_ += l.HeapBytes();
+    }
+    u.upvalueNames_ = HeapBytes(upvalueNames_);
+    for (auto& n:upvalueNames_) {
+        u.upvalueNames_ += HeapBytes(n);
+    }
+    if (debugBytes_) {
+        // still raw, in the buffer of the chunk
+        u.lineInfo_ += debugRange_.lineInfo_;
+        u.locVars_ += debugRange_.locVars_;
+        u.upvalueNames_ += debugRange_.upvalueNames_;
     }
-    return v;
+    u.slack_ = SlackBytes(code_) + SlackBytes(constants_) +
+               SlackBytes(upvalues_) + SlackBytes(protos_) +
+               lineInfo_.SlackBytes() + SlackBytes(locVars_) +
+               SlackBytes(upvalueNames_);
+    return u;
 }
 
-std::vector<LocalVar> ChunkReader::ReadLocVars() {
-    auto size = ReadUint32();
-    std::vector<LocalVar> v;
-    v.reserve(size);
-    for(int i = 0; i < size; ++i) {
-        v.emplace_back(ReadLuaString(), ReadUint32(), ReadUint32());
+MemoryUsage Chunk::Usage() const {
+    MemoryUsage total;
+    std::vector<const Prototype*> pending{mainFunc_};
+    while (!pending.empty()) {
+        auto f = pending.back();
+        pending.pop_back();
+        total += f->Usage();
+        pending.insert(pending.end(), f->protos_.begin(), f->protos_.end());
     }
-    return v;
+    return total;
 }
 
-std::vector<std::string> ChunkReader::ReadUpvalueNames() {
-    auto size = ReadUint32();
-    std::vector<std::string> v;
-    v.reserve(size);
-    for (int i = 0; i < size; ++i) {
-        v.emplace_back(ReadLuaString());
-    }
-    return v;
+static void PrintUsageRow(const char* name, const MemoryUsage& u) {
+    printf("%-24s %8zu %8zu %8zu %8zu %8zu %8zu %8zu %8zu %8zu %8zu\n",
+           name, u.code_, u.constants_, u.upvalues_, u.protos_,
+           u.lineInfo_, u.locVars_, u.upvalueNames_,
+           u.proto_ + u.source_, u.slack_, u.Total());
 }
 
-std::vector<Prototype *> ChunkReader::ReadProtos(const std::string& parentSource) {
-    auto size = ReadUint32();
-    std::vector<Prototype*> v;
-    v.reserve(size);
-    for (int i = 0; i < size; ++i) {
-        v.push_back(ReadProto(parentSource));
+void Chunk::PrintMemory(Prototype *f, MemoryUsage *total) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s <%u,%u>",
+             f->lineDefined_ > 0 ? "function" : "main",
+             f->lineDefined_, f->lastLineDefined_);
+    auto u = f->Usage();
+    PrintUsageRow(name, u);
+    *total += u;
+    for (auto sub:f->protos_) {
+        PrintMemory(sub, total);
     }
-    return v;
 }
 
+/*
+ * Per-function memory breakdown in bytes, the last column sums all but slack
+ */
+void Chunk::PrintMemory() {
+    printf("\nmemory <%s> (bytes)\n", mainFunc_->source_.c_str());
+    printf("%-24s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+           "function", "code", "consts", "upvals", "protos", "lines",
+           "locals", "upnames", "other", "slack", "total");
+    MemoryUsage total;
+    PrintMemory(mainFunc_, &total);
+    PrintUsageRow("total", total);
+}
@@ -1,3 +1,397 @@
 //
 // Created by 于承业 on 2023/10/17.
 //
+#include "chunk.h"
+#include "chunk_stream.h"
+#include <algorithm>
+#include <stdexcept>
+
+// smallest encoding of a function: empty source, fixed fields and 7 counts
+static constexpr size_t kMinProtoBytes = 1 + 2 * sizeof(uint32_t) + 3 + 7 * sizeof(uint32_t);
+// header, then the upvalue count of the main function
+static constexpr size_t kHeaderBytes = 4 + 2 + 6 + 5 + sizeof(LuaInteger) + sizeof(LuaNumber) + 1;
+
+ChunkReader::ChunkReader(ChunkStream *stream, size_t window)
+    : stream_(stream),
+      window_(new char[window]),
+      windowSize_(window),
+      received_(0),
+      extent_(kHeaderBytes + kMinProtoBytes) {
+    data_ = Slice(window_.get(), 0);
+}
+
+/*
+ * Slide the unread bytes to the front of the window and pull from the
+ * stream until at least n bytes are buffered, reading ahead up to the
+ * extent of the chunk known so far. Only ReadBytes may ask for more
+ * than a window, in which case the window grows to fit.
+ */
+void ChunkReader::Fill(size_t n) {
+    if (stream_ == nullptr) {
+        throw ChunkError("truncated chunk", Offset());
+    }
+    size_t at = Offset();
+    if (n > windowSize_) {
+        std::unique_ptr<char[]> w(new char[n]);
+        memcpy(w.get(), data_.data(), data_.size());
+        data_ = Slice(w.get(), data_.size());
+        window_ = std::move(w);
+        windowSize_ = n;
+    } else if (data_.data() != window_.get()) {
+        memmove(window_.get(), data_.data(), data_.size());
+        data_ = Slice(window_.get(), data_.size());
+    }
+    size_t size = data_.size();
+    size_t ahead = extent_ > received_ ? extent_ - received_ : 0;
+    stream_->Expect(ahead);
+    while (size < n) {
+        size_t r = stream_->Read(window_.get() + size, std::min(windowSize_ - size, std::max(n - size, ahead)));
+        if (r == 0) {
+            throw ChunkError("truncated chunk", at);
+        }
+        size += r;
+        received_ += r;
+        ahead = ahead > r ? ahead - r : 0;
+    }
+    data_ = Slice(window_.get(), size);
+}
+
+/*
+ * Copy n bytes into dst, refilling the window as many times as needed
+ */
+void ChunkReader::ReadInto(char *dst, size_t n) {
+    while (n > 0) {
+        if (data_.empty()) {
+            Fill(1);
+        }
+        size_t len = n < data_.size() ? n : data_.size();
+        memcpy(dst, data_.data(), len);
+        data_.remove_prefix(len);
+        dst += len;
+        n -= len;
+    }
+}
+
+byte_t ChunkReader::ReadByte() {
+    Need(sizeof(byte_t));
+    byte_t b = *reinterpret_cast<const byte_t*>(data_.data());
+    data_.remove_prefix(sizeof(byte_t));
+    return b;
+}
+
+// fields are unaligned in the chunk, memcpy compiles to a plain load
+uint32_t ChunkReader::ReadUint32() {
+    Need(sizeof(uint32_t));
+    uint32_t i;
+    memcpy(&i, data_.data(), sizeof(i));
+    data_.remove_prefix(sizeof(uint32_t));
+    return i;
+}
+
+uint64_t ChunkReader::ReadUint64() {
+    Need(sizeof(uint64_t));
+    uint64_t i;
+    memcpy(&i, data_.data(), sizeof(i));
+    data_.remove_prefix(sizeof(uint64_t));
+    return i;
+}
+
+LuaInteger ChunkReader::ReadLuaInteger() {
+    return LuaInteger(ReadUint64());
+}
+
+LuaNumber ChunkReader::ReadLuaNumber() {
+    Need(sizeof(double));
+    double f;
+    memcpy(&f, data_.data(), sizeof(f));
+    data_.remove_prefix(sizeof(double ));
+    return f;
+}
+
+/*
+ * Length of the string that follows, stored plus one so that 0 is no
+ * string. From a buffer it is checked against the bytes left.
+ */
+uint64_t ChunkReader::ReadStringSize() {
+    size_t at = Offset();
+    uint64_t size = ReadByte();
+    if (size == 0xFF) {
+        Extend(sizeof(uint64_t));
+        size = ReadUint64();
+    }
+    if (size == 0) {
+        return 0;
+    }
+    if (stream_ == nullptr && size - 1 > data_.size()) {
+        throw ChunkError("truncated string", at);
+    }
+    Extend(size - 1);
+    return size - 1;
+}
+
+std::string ChunkReader::ReadLuaString() {
+    uint64_t size = ReadStringSize();
+    if (stream_ == nullptr) {
+        std::string s(data_.data(), size);
+        data_.remove_prefix(size);
+        return s;
+    }
+    // from a stream the string grows with the bytes that actually arrive
+    std::string s;
+    s.reserve(std::min<uint64_t>(size, kDefaultWindow));
+    while (size > 0) {
+        if (data_.empty()) {
+            Fill(1);
+        }
+        size_t len = size < data_.size() ? size : data_.size();
+        s.append(data_.data(), len);
+        data_.remove_prefix(len);
+        size -= len;
+    }
+    return s;
+}
+
+uint32_t ChunkReader::ReadCount(size_t elemBytes, const char *section) {
+    size_t at = Offset();
+    uint32_t n = ReadUint32();
+    if (stream_ == nullptr && uint64_t(n) * elemBytes > data_.size()) {
+        throw ChunkError(std::string("truncated ") + section, at);
+    }
+    Extend(uint64_t(n) * elemBytes);
+    return n;
+}
+
+Slice ChunkReader::ReadBytes(uint32_t n) {
+    Need(n);
+    Slice s(data_.data(), n);
+    data_.remove_prefix(n);
+    return s;
+}
+
+Prototype *ChunkReader::ReadProto(const std::string& parentSource) {
+    std::unique_ptr<Prototype> proto(new Prototype());
+    proto->source_ = ReadLuaString();
+    if (proto->source_.empty()) {
+        proto->source_ = parentSource; // copy
+    }
+    proto->lineDefined_ = ReadUint32();
+    proto->lastLineDefined_ = ReadUint32();
+    proto->numParams_ = ReadByte();
+    proto->isVarArg_ = ReadByte();
+    proto->maxStackSize_ = ReadByte();
+    proto->code_ = ReadCode();
+    proto->constants_ = ReadConstants();
+    proto->upvalues_ = ReadUpvalues();
+    proto->protos_ = ReadProtos(proto->source_);
+    if (debug_ == DebugInfo::Load) {
+        proto->lineInfo_ = ReadLineInfo(proto->lineDefined_);
+        proto->locVars_ = ReadLocVars();
+        proto->upvalueNames_ = ReadUpvalueNames();
+    } else {
+        SkipDebugInfo(proto.get());
+    }
+
+    return proto.release();
+}
+
+std::vector<uint32_t> ChunkReader::ReadCode() {
+    uint32_t size = ReadCount(sizeof(uint32_t), "code");
+    std::vector<uint32_t> code;
+    // one copy from a buffer, batches that follow the bytes from a stream
+    uint32_t step = stream_ ? kStreamBatch : size;
+    while (code.size() < size) {
+        size_t done = code.size();
+        size_t n = std::min<size_t>(size - done, step);
+        code.resize(done + n);
+        ReadInto(reinterpret_cast<char*>(code.data() + done), n * sizeof(uint32_t));
+    }
+    return code;
+}
+
+std::vector<Constant> ChunkReader::ReadConstants() {
+    uint32_t size = ReadCount(1, "constants");
+    std::vector<Constant> v;
+    v.reserve(Ahead(size));
+    for (uint32_t i = 0; i < size; ++i) {
+        v.push_back(ReadConstant());
+    }
+    return v;
+}
+
+Constant ChunkReader::ReadConstant() {
+    size_t at = Offset();
+    auto tag = ConstantTag(ReadByte());
+    Constant constant;
+    switch (tag) {
+        case ConstantTag::BOOLEAN:
+            Extend(1);
+            constant.SetBoolean(ReadByte() != 0);
+            break;
+        case ConstantTag::INTEGER:
+            Extend(sizeof(LuaInteger));
+            constant.SetInterger(ReadLuaInteger());
+            break;
+        case ConstantTag::NUMBER:
+            Extend(sizeof(LuaNumber));
+            constant.SetNumber(ReadLuaNumber());
+            break;
+        case ConstantTag::SSTRING:
+        case ConstantTag::STRING:
+            Extend(1);
+            constant.SetString(ReadLuaString());
+            break;
+        case ConstantTag::NIL:
+            break;
+        default:
+            throw ChunkError("unknown constant tag " + std::to_string(int(tag)), at);
+    }
+    return constant;
+}
+
+std::vector<Upvalue> ChunkReader::ReadUpvalues() {
+    uint32_t size = ReadCount(2, "upvalues");
+    std::vector<Upvalue> v;
+    v.reserve(Ahead(size));
+    for (uint32_t i = 0; i < size; ++i) {
+        byte_t inStack = ReadByte();
+        byte_t idx = ReadByte();
+        v.emplace_back(inStack, idx);
+    }
+    return v;
+}
+
+/*
+ * The absolute lines of the chunk are decoded in batches and compressed
+ * on the fly, they are never held all at once.
+ */
+LineInfo ChunkReader::ReadLineInfo(uint32_t lineDefined) {
+    uint32_t size = ReadCount(sizeof(uint32_t), "line info");
+    LineInfo info(lineDefined);
+    info.Reserve(Ahead(size));
+    uint32_t batch[256];
+    while (size > 0) {
+        uint32_t n = size < 256 ? size : 256;
+        ReadInto(reinterpret_cast<char*>(batch), n * sizeof(uint32_t));
+        for (uint32_t i = 0; i < n; ++i) {
+            info.Append(batch[i]);
+        }
+        size -= n;
+    }
+    return info;
+}
+
+std::vector<LocalVar> ChunkReader::ReadLocVars() {
+    uint32_t size = ReadCount(1 + 2 * sizeof(uint32_t), "local variables");
+    std::vector<LocalVar> v;
+    v.reserve(Ahead(size));
+    for (uint32_t i = 0; i < size; ++i) {
+        std::string varName = ReadLuaString();
+        uint32_t startPC = ReadUint32();
+        uint32_t endPC = ReadUint32();
+        v.emplace_back(std::move(varName), startPC, endPC);
+    }
+    return v;
+}
+
+std::vector<std::string> ChunkReader::ReadUpvalueNames() {
+    uint32_t size = ReadCount(1, "upvalue names");
+    std::vector<std::string> v;
+    v.reserve(Ahead(size));
+    for (uint32_t i = 0; i < size; ++i) {
+        v.emplace_back(ReadLuaString());
+    }
+    return v;
+}
+
+void ChunkReader::Pass(size_t n) {
+    if (stream_ == nullptr && n > data_.size()) {
+        throw ChunkError("truncated chunk", Offset());
+    }
+    while (n > 0) {
+        if (data_.empty()) {
+            Fill(1);
+        }
+        size_t len = n < data_.size() ? n : data_.size();
+        if (keep_) {
+            keep_->append(data_.data(), len);
+        }
+        data_.remove_prefix(len);
+        n -= len;
+    }
+}
+
+uint32_t ChunkReader::PassCount(size_t elemBytes, const char *section) {
+    uint32_t n = ReadCount(elemBytes, section);
+    if (keep_) {
+        keep_->append(reinterpret_cast<const char*>(&n), sizeof(n));
+    }
+    return n;
+}
+
+void ChunkReader::PassString() {
+    byte_t b = ReadByte();
+    if (keep_) {
+        keep_->push_back(char(b));
+    }
+    uint64_t size = b;
+    if (size == 0xFF) {
+        Extend(sizeof(uint64_t));
+        size = ReadUint64();
+        if (keep_) {
+            keep_->append(reinterpret_cast<const char*>(&size), sizeof(size));
+        }
+    }
+    if (size > 0) {
+        Extend(size - 1);
+        Pass(size - 1);
+    }
+}
+
+/*
+ * Walk over the line info, local variable and upvalue name sections
+ * without decoding them. They are contiguous, so in lazy mode the
+ * function only needs to remember where its copy starts.
+ */
+void ChunkReader::SkipDebugInfo(Prototype *proto) {
+    size_t start = keep_ ? keep_->size() : 0;
+    Pass(size_t(PassCount(sizeof(uint32_t), "line info")) * sizeof(uint32_t));
+    size_t lineEnd = keep_ ? keep_->size() : 0;
+    for (uint32_t i = 0, n = PassCount(1 + 2 * sizeof(uint32_t), "local variables"); i < n; ++i) {
+        PassString();
+        Pass(2 * sizeof(uint32_t));     // startpc, endpc
+    }
+    size_t locVarsEnd = keep_ ? keep_->size() : 0;
+    for (uint32_t i = 0, n = PassCount(1, "upvalue names"); i < n; ++i) {
+        PassString();
+    }
+    if (keep_) {
+        proto->debugBytes_ = keep_;
+        proto->debugRange_.offset_ = start;
+        proto->debugRange_.lineInfo_ = uint32_t(lineEnd - start);
+        proto->debugRange_.locVars_ = uint32_t(locVarsEnd - lineEnd);
+        proto->debugRange_.upvalueNames_ = uint32_t(keep_->size() - locVarsEnd);
+    }
+}
+
+std::vector<Prototype *> ChunkReader::ReadProtos(const std::string& parentSource) {
+    size_t at = Offset();
+    uint32_t size = ReadCount(kMinProtoBytes, "functions");
+    if (size > 0 && depth_ >= kMaxNesting) {
+        throw ChunkError("functions nested too deeply", at);
+    }
+    std::vector<Prototype*> v;
+    v.reserve(Ahead(size));
+    ++depth_;
+    try {
+        for (uint32_t i = 0; i < size; ++i) {
+            v.push_back(ReadProto(parentSource));
+        }
+    } catch (...) {
+        for (auto p:v) {
+            delete p;
+        }
+        throw;
+    }
+    --depth_;
+    return v;
+}
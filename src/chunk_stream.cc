@@ -0,0 +1,196 @@
+#include "chunk_stream.h"
+#include "unistd.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+FdChunkStream::FdChunkStream(int fd) : fd_(fd) {
+    if (pipe(cancel_) < 0) {
+        throw std::runtime_error(std::string("pipe failed: ") + strerror(errno));
+    }
+    // so that Resume can drain it
+    fcntl(cancel_[0], F_SETFL, O_NONBLOCK);
+}
+
+FdChunkStream::~FdChunkStream() {
+    close(cancel_[0]);
+    close(cancel_[1]);
+}
+
+size_t FdChunkStream::Read(char *buf, size_t n) {
+    while (true) {
+        pollfd fds[2] = {{fd_, POLLIN, 0}, {cancel_[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
+        }
+        // the byte written by Cancel is only drained by Resume
+        if (fds[1].revents) {
+            return 0;
+        }
+        ssize_t r = read(fd_, buf, n);
+        if (r >= 0) {
+            return size_t(r);
+        }
+        if (errno != EINTR && errno != EAGAIN) {
+            throw std::runtime_error(std::string("read failed: ") + strerror(errno));
+        }
+    }
+}
+
+void FdChunkStream::Cancel() {
+    char c = 0;
+    while (write(cancel_[1], &c, 1) < 0 && errno == EINTR) {}
+}
+
+void FdChunkStream::Resume() {
+    char buf[64];
+    while (read(cancel_[0], buf, sizeof(buf)) > 0 || errno == EINTR) {}
+}
+
+PrefetchChunkStream::PrefetchChunkStream(ChunkStream *source, size_t capacity)
+    : source_(source),
+      ring_(new char[capacity]),
+      capacity_(capacity),
+      head_(0),
+      size_(0),
+      consumed_(0),
+      wanted_(0),
+      reading_(false),
+      eof_(false),
+      stop_(false) {
+    producer_ = std::thread(&PrefetchChunkStream::Produce, this);
+}
+
+PrefetchChunkStream::~PrefetchChunkStream() {
+    bool reading;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+        // Read is not running, so only the producer can be reading
+        reading = reading_;
+    }
+    wantMore_.notify_all();
+    // its read may be waiting for bytes that never come
+    if (reading) {
+        source_->Cancel();
+    }
+    producer_.join();
+    if (reading) {
+        source_->Resume();
+    }
+}
+
+/*
+ * Producer loop: read directly into the free region of the ring, the lock
+ * is only held while updating the indices.
+ */
+void PrefetchChunkStream::Produce() {
+    while (true) {
+        size_t tail, room;
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            wantMore_.wait(lock, [this] {
+                return stop_ || (!reading_ && !eof_ && size_ < capacity_ && consumed_ + size_ < wanted_);
+            });
+            if (stop_) {
+                return;
+            }
+            tail = (head_ + size_) % capacity_;
+            room = std::min({capacity_ - size_, capacity_ - tail, wanted_ - consumed_ - size_});
+            reading_ = true;
+        }
+        size_t n = 0;
+        std::exception_ptr error;
+        try {
+            n = source_->Read(ring_.get() + tail, room);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            reading_ = false;
+            size_ += n;
+            if (n == 0) {
+                eof_ = true;
+                error_ = error;
+            }
+        }
+        notEmpty_.notify_one();
+        if (n == 0) {
+            return;
+        }
+    }
+}
+
+size_t PrefetchChunkStream::Read(char *buf, size_t n) {
+    std::unique_lock<std::mutex> lock(mu_);
+    Want(n);
+    while (size_ == 0 && !eof_) {
+        if (reading_) {
+            notEmpty_.wait(lock);
+            continue;
+        }
+        // nothing buffered and the producer idle: waking it up would
+        // only add a round trip, read in place
+        reading_ = true;
+        lock.unlock();
+        size_t r = 0;
+        std::exception_ptr error;
+        try {
+            r = source_->Read(buf, n);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+        reading_ = false;
+        consumed_ += r;
+        if (r == 0) {
+            eof_ = true;
+            error_ = error;
+        }
+        lock.unlock();
+        wantMore_.notify_one();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return r;
+    }
+    if (size_ == 0) {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return 0;
+    }
+    size_t copied = 0;
+    while (copied < n && size_ > 0) {
+        size_t len = std::min({n - copied, size_, capacity_ - head_});
+        memcpy(buf + copied, ring_.get() + head_, len);
+        head_ = (head_ + len) % capacity_;
+        size_ -= len;
+        copied += len;
+    }
+    consumed_ += copied;
+    lock.unlock();
+    wantMore_.notify_one();
+    return copied;
+}
+
+void PrefetchChunkStream::Expect(size_t n) {
+    std::lock_guard<std::mutex> lock(mu_);
+    Want(n);
+}
+
+void PrefetchChunkStream::Want(size_t n) {
+    if (n > wanted_ - consumed_) {
+        wanted_ = n < SIZE_MAX - consumed_ ? consumed_ + n : SIZE_MAX;
+        wantMore_.notify_one();
+    }
+}
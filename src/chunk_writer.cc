@@ -0,0 +1,107 @@
+#include "chunk.h"
+
+void ChunkWriter::WriteChunk(Prototype *main) {
+    WriteHeader();
+    WriteByte(byte_t(main->upvalues_.size()));
+    WriteProto(main, "");
+}
+
+void ChunkWriter::WriteHeader() {
+    out_->append(LUA_SIGNATURE);
+    WriteByte(LUAC_VERSION);
+    WriteByte(LUAC_FORMAT);
+    out_->append(LUAC_DATA);
+    WriteByte(CINT_SIZE);
+    WriteByte(SIZET_SIZE);
+    WriteByte(INSTRUCTION_SIZE);
+    WriteByte(LUA_INTEGER_SIZE);
+    WriteByte(LUA_NUMBER_SIZE);
+    WriteUint64(uint64_t(LuaInteger(LUAC_INT)));
+    WriteLuaNumber(LUAC_NUM);
+}
+
+// size + 1 in one byte, or 0xFF and a size_t. 0 is a missing string,
+// as written for the source of nested functions
+void ChunkWriter::WriteLuaString(const std::string &s) {
+    uint64_t size = s.size() + 1;
+    if (size < 0xFF) {
+        WriteByte(byte_t(size));
+    } else {
+        WriteByte(0xFF);
+        WriteUint64(size);
+    }
+    out_->append(s);
+}
+
+void ChunkWriter::WriteConstant(const Constant &c) {
+    ConstantTag tag = c.tag_;
+    if (tag == ConstantTag::SSTRING || tag == ConstantTag::STRING) {
+        // luac tags strings longer than LUAI_MAXSHORTLEN (40) as long
+        tag = c.string_.size() > 40 ? ConstantTag::STRING : ConstantTag::SSTRING;
+    }
+    WriteByte(byte_t(tag));
+    switch (c.tag_) {
+        case ConstantTag::NIL:
+            break;
+        case ConstantTag::BOOLEAN:
+            WriteByte(c.bool_ ? 1 : 0);
+            break;
+        case ConstantTag::NUMBER:
+            WriteLuaNumber(c.number_);
+            break;
+        case ConstantTag::INTEGER:
+            WriteUint64(uint64_t(c.integer_));
+            break;
+        case ConstantTag::SSTRING:
+        case ConstantTag::STRING:
+            WriteLuaString(c.string_.str_);
+            break;
+    }
+}
+
+void ChunkWriter::WriteProto(Prototype *f, const std::string &parentSource) {
+    // like luac, nested functions of the same source leave it empty
+    if (f->source_ == parentSource) {
+        WriteByte(0);
+    } else {
+        WriteLuaString(f->source_);
+    }
+    WriteUint32(f->lineDefined_);
+    WriteUint32(f->lastLineDefined_);
+    WriteByte(f->numParams_);
+    WriteByte(f->isVarArg_);
+    WriteByte(f->maxStackSize_);
+    WriteUint32(uint32_t(f->code_.size()));
+    out_->append(reinterpret_cast<const char*>(f->code_.data()), f->code_.size() * sizeof(uint32_t));
+    WriteUint32(uint32_t(f->constants_.size()));
+    for (auto& c:f->constants_) {
+        WriteConstant(c);
+    }
+    WriteUint32(uint32_t(f->upvalues_.size()));
+    for (auto& uv:f->upvalues_) {
+        WriteByte(uv.inStack_);
+        WriteByte(uv.idx_);
+    }
+    WriteUint32(uint32_t(f->protos_.size()));
+    for (auto p:f->protos_) {
+        WriteProto(p, f->source_);
+    }
+
+    const LineInfo& lines = f->Lines();
+    WriteUint32(uint32_t(lines.Size()));
+    for (size_t pc = 0; pc < lines.Size(); ++pc) {
+        WriteUint32(uint32_t(lines.GetLine(pc)));
+    }
+    const auto& locVars = f->LocVars();
+    WriteUint32(uint32_t(locVars.size()));
+    for (auto& var:locVars) {
+        WriteLuaString(var.varName_);
+        WriteUint32(var.startPC_);
+        WriteUint32(var.endPC_);
+    }
+    const auto& names = f->UpvalueNames();
+    WriteUint32(uint32_t(names.size()));
+    for (auto& name:names) {
+        WriteLuaString(name);
+    }
+}
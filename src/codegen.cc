@@ -0,0 +1,845 @@
+#include "parser.h"
+#include "state.h"
+#include <cmath>
+#include <cstdlib>
+
+#define MAXREGS 255
+#define hasjumps(e) ((e)->t_ != (e)->f_)
+
+// e is a numeral literal without pending jumps, its value goes to v if set
+static bool ToNumeral(const ExpDesc* e, LuaValue* v) {
+    if (hasjumps(e)) {
+        return false;
+    }
+    switch (e->k_) {
+        case VKINT:
+            if (v) {
+                *v = LuaValue::Integer(e->ival_);
+            }
+            return true;
+        case VKFLT:
+            if (v) {
+                *v = LuaValue::Number(e->nval_);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool ConstKey::operator==(const ConstKey &o) const {
+    if (tag_ != o.tag_) {
+        return false;
+    }
+    switch (tag_) {
+        case ConstantTag::BOOLEAN: return b_ == o.b_;
+        case ConstantTag::NUMBER:  return n_ == o.n_;
+        case ConstantTag::INTEGER: return i_ == o.i_;
+        case ConstantTag::SSTRING: return s_.data() == o.s_.data();
+        default:                   return true;
+    }
+}
+
+size_t ConstKeyHash::operator()(const ConstKey &k) const {
+    switch (k.tag_) {
+        case ConstantTag::BOOLEAN: return std::hash<bool>()(k.b_);
+        case ConstantTag::NUMBER:  return std::hash<LuaNumber>()(k.n_ == 0 ? 0 : k.n_);
+        case ConstantTag::INTEGER: return std::hash<LuaInteger>()(k.i_);
+        case ConstantTag::SSTRING: return std::hash<const void*>()(k.s_.data());
+        default:                   return 0;
+    }
+}
+
+int FuncState::Code(uint32_t i) {
+    DischargeJpc();     // pc_ is about to change
+    f_->code_.push_back(i);
+    lines_.push_back(parser_->lex_.LastLine());
+    return pc_++;
+}
+
+int FuncState::CodeABC(int op, int a, int b, int c) {
+    return Code(CREATE_ABC(op, a, b, c));
+}
+
+int FuncState::CodeABx(int op, int a, unsigned int bx) {
+    return Code(CREATE_ABx(op, a, bx));
+}
+
+int FuncState::CodeExtraArg(int a) {
+    return Code(CREATE_Ax(OP_EXTRAARG, a));
+}
+
+int FuncState::CodeK(int reg, int k) {
+    if (k <= MAXARG_Bx) {
+        return CodeABx(OP_LOADK, reg, k);
+    }
+    int p = CodeABx(OP_LOADKX, reg, 0);
+    CodeExtraArg(k);
+    return p;
+}
+
+/*
+ * Set n registers from 'from' to nil, merged into the previous LOADNIL
+ * when the ranges touch and nothing jumps in between
+ */
+void FuncState::Nil(int from, int n) {
+    int l = from + n - 1;
+    if (pc_ > lastTarget_) {
+        uint32_t& previous = f_->code_[pc_ - 1];
+        if (GET_OPCODE(previous) == OP_LOADNIL) {
+            int pfrom = GETARG_A(previous);
+            int pl = pfrom + GETARG_B(previous);
+            if ((pfrom <= from && from <= pl + 1) || (from <= pfrom && pfrom <= l + 1)) {
+                if (pfrom < from) {
+                    from = pfrom;
+                }
+                if (pl > l) {
+                    l = pl;
+                }
+                SETARG_A(previous, from);
+                SETARG_B(previous, l - from);
+                return;
+            }
+        }
+    }
+    CodeABC(OP_LOADNIL, from, n - 1, 0);
+}
+
+/*
+ * Jump lists are chained through the sBx of their jumps, NO_JUMP ends
+ * a list.
+ */
+int FuncState::GetJump(int pc) {
+    int offset = GETARG_sBx(f_->code_[pc]);
+    return offset == NO_JUMP ? NO_JUMP : pc + 1 + offset;
+}
+
+void FuncState::FixJump(int pc, int dest) {
+    int offset = dest - (pc + 1);
+    if (std::abs(offset) > MAXARG_sBx) {
+        parser_->lex_.SyntaxError("control structure too long");
+    }
+    SETARG_sBx(f_->code_[pc], offset);
+}
+
+void FuncState::Concat(int *l1, int l2) {
+    if (l2 == NO_JUMP) {
+        return;
+    } else if (*l1 == NO_JUMP) {
+        *l1 = l2;
+    } else {
+        int list = *l1;
+        int next;
+        while ((next = GetJump(list)) != NO_JUMP) {
+            list = next;
+        }
+        FixJump(list, l2);
+    }
+}
+
+// the jumps waiting for the next instruction go with the new one
+int FuncState::Jump() {
+    int jpc = jpc_;
+    jpc_ = NO_JUMP;
+    int j = CodeAsBx(OP_JMP, 0, NO_JUMP);
+    Concat(&j, jpc);
+    return j;
+}
+
+void FuncState::Ret(int first, int nret) {
+    CodeABC(OP_RETURN, first, nret + 1, 0);
+}
+
+int FuncState::CondJump(int op, int a, int b, int c) {
+    CodeABC(op, a, b, c);
+    return Jump();
+}
+
+int FuncState::GetLabel() {
+    lastTarget_ = pc_;
+    return pc_;
+}
+
+// the test controlling the jump at pc, or the jump itself
+uint32_t *FuncState::GetJumpControl(int pc) {
+    uint32_t* pi = &f_->code_[pc];
+    if (pc >= 1 && opcodes[GET_OPCODE(pi[-1])].testFlag_) {
+        return pi - 1;
+    }
+    return pi;
+}
+
+/*
+ * Make the TESTSET controlling a jump put its value in reg, or turn it
+ * into a TEST if there is no register to set. False if the jump is not
+ * controlled by a TESTSET.
+ */
+bool FuncState::PatchTestReg(int node, int reg) {
+    uint32_t* i = GetJumpControl(node);
+    if (GET_OPCODE(*i) != OP_TESTSET) {
+        return false;
+    }
+    if (reg != NO_REG && reg != GETARG_B(*i)) {
+        SETARG_A(*i, reg);
+    } else {
+        *i = CREATE_ABC(OP_TEST, GETARG_B(*i), 0, GETARG_C(*i));
+    }
+    return true;
+}
+
+void FuncState::RemoveValues(int list) {
+    for (; list != NO_JUMP; list = GetJump(list)) {
+        PatchTestReg(list, NO_REG);
+    }
+}
+
+// jumps with a value go to vtarget with it in reg, the others to dtarget
+void FuncState::PatchListAux(int list, int vtarget, int reg, int dtarget) {
+    while (list != NO_JUMP) {
+        int next = GetJump(list);
+        if (PatchTestReg(list, reg)) {
+            FixJump(list, vtarget);
+        } else {
+            FixJump(list, dtarget);
+        }
+        list = next;
+    }
+}
+
+void FuncState::DischargeJpc() {
+    PatchListAux(jpc_, pc_, NO_REG, pc_);
+    jpc_ = NO_JUMP;
+}
+
+void FuncState::PatchToHere(int list) {
+    GetLabel();
+    Concat(&jpc_, list);
+}
+
+void FuncState::PatchList(int list, int target) {
+    if (target == pc_) {
+        PatchToHere(list);
+    } else {
+        PatchListAux(list, target, NO_REG, target);
+    }
+}
+
+// jumps of the list close the upvalues from level up
+void FuncState::PatchClose(int list, int level) {
+    level++;    // A of JMP is level + 1, 0 means nothing to close
+    for (; list != NO_JUMP; list = GetJump(list)) {
+        SETARG_A(f_->code_[list], level);
+    }
+}
+
+void FuncState::CheckStack(int n) {
+    int newStack = freereg_ + n;
+    if (newStack > f_->maxStackSize_) {
+        if (newStack >= MAXREGS) {
+            parser_->lex_.SyntaxError("function or expression needs too many registers");
+        }
+        f_->maxStackSize_ = byte_t(newStack);
+    }
+}
+
+void FuncState::ReserveRegs(int n) {
+    CheckStack(n);
+    freereg_ += n;
+}
+
+// constants and locals are not on the top, they are never freed here
+void FuncState::FreeReg(int reg) {
+    if (!ISK(reg) && reg >= nactvar_) {
+        freereg_--;
+    }
+}
+
+void FuncState::FreeExp(ExpDesc *e) {
+    if (e->k_ == VNONRELOC) {
+        FreeReg(e->info_);
+    }
+}
+
+// free the registers of both, the one on top first
+void FuncState::FreeExps(ExpDesc *e1, ExpDesc *e2) {
+    int r1 = e1->k_ == VNONRELOC ? e1->info_ : -1;
+    int r2 = e2->k_ == VNONRELOC ? e2->info_ : -1;
+    if (r1 > r2) {
+        FreeReg(r1);
+        FreeReg(r2);
+    } else {
+        FreeReg(r2);
+        FreeReg(r1);
+    }
+}
+
+/*
+ * Index of a constant of f_. The cache remembers where a value was
+ * last added in any function of the chunk, like the scanner table of
+ * lcode.c, so the indexes (and duplicates) are the same as with luac.
+ */
+int FuncState::AddK(const ConstKey &key) {
+    auto it = parser_->kcache_.find(key);
+    if (it != parser_->kcache_.end()) {
+        int k = it->second;
+        if (k < nk_) {
+            const Constant& c = f_->constants_[k];
+            bool same = false;
+            switch (key.tag_) {
+                case ConstantTag::NIL:     same = c.tag_ == ConstantTag::NIL; break;
+                case ConstantTag::BOOLEAN: same = c.tag_ == ConstantTag::BOOLEAN && c.bool_ == key.b_; break;
+                case ConstantTag::NUMBER:  same = c.tag_ == ConstantTag::NUMBER && c.number_ == key.n_; break;
+                case ConstantTag::INTEGER: same = c.tag_ == ConstantTag::INTEGER && c.integer_ == key.i_; break;
+                default:
+                    same = (c.tag_ == ConstantTag::SSTRING || c.tag_ == ConstantTag::STRING) &&
+                           c.string_.str_ == key.s_;
+                    break;
+            }
+            if (same) {
+                return k;
+            }
+        }
+        it->second = nk_;
+    } else {
+        parser_->kcache_.emplace(key, nk_);
+    }
+    if (nk_ > MAXARG_Ax) {
+        parser_->lex_.SyntaxError("too many constants");
+    }
+    Constant c;
+    switch (key.tag_) {
+        case ConstantTag::BOOLEAN: c.SetBoolean(key.b_); break;
+        case ConstantTag::NUMBER:  c.SetNumber(key.n_); break;
+        case ConstantTag::INTEGER: c.SetInterger(key.i_); break;
+        case ConstantTag::SSTRING: c.SetString(std::string(key.s_)); break;
+        default: break;
+    }
+    f_->constants_.push_back(std::move(c));
+    return nk_++;
+}
+
+int FuncState::StringK(std::string_view s) {
+    ConstKey key{ConstantTag::SSTRING, {}, s};
+    return AddK(key);
+}
+
+int FuncState::IntK(LuaInteger i) {
+    ConstKey key{ConstantTag::INTEGER, {}, {}};
+    key.i_ = i;
+    return AddK(key);
+}
+
+int FuncState::NumberK(LuaNumber n) {
+    ConstKey key{ConstantTag::NUMBER, {}, {}};
+    key.n_ = n;
+    return AddK(key);
+}
+
+int FuncState::BoolK(bool b) {
+    ConstKey key{ConstantTag::BOOLEAN, {}, {}};
+    key.b_ = b;
+    return AddK(key);
+}
+
+int FuncState::NilK() {
+    ConstKey key{ConstantTag::NIL, {}, {}};
+    return AddK(key);
+}
+
+// open call or vararg e returns nresults values, -1 for all of them
+void FuncState::SetReturns(ExpDesc *e, int nresults) {
+    if (e->k_ == VCALL) {
+        SETARG_C(Instr(e), nresults + 1);
+    } else if (e->k_ == VVARARG) {
+        uint32_t& i = Instr(e);
+        SETARG_B(i, nresults + 1);
+        SETARG_A(i, freereg_);
+        ReserveRegs(1);
+    }
+}
+
+void FuncState::SetOneRet(ExpDesc *e) {
+    if (e->k_ == VCALL) {
+        // a call already returns one value
+        e->k_ = VNONRELOC;
+        e->info_ = GETARG_A(Instr(e));
+    } else if (e->k_ == VVARARG) {
+        SETARG_B(Instr(e), 2);
+        e->k_ = VRELOCABLE;
+    }
+}
+
+// emit the read of a variable, its value is then available somewhere
+void FuncState::DischargeVars(ExpDesc *e) {
+    switch (e->k_) {
+        case VLOCAL:
+            e->k_ = VNONRELOC;
+            break;
+        case VUPVAL:
+            e->info_ = CodeABC(OP_GETUPVAL, 0, e->info_, 0);
+            e->k_ = VRELOCABLE;
+            break;
+        case VINDEXED: {
+            int op;
+            FreeReg(e->ind_.idx_);
+            if (e->ind_.vt_ == VLOCAL) {
+                FreeReg(e->ind_.t_);
+                op = OP_GETTABLE;
+            } else {
+                op = OP_GETTABUP;
+            }
+            e->info_ = CodeABC(op, 0, e->ind_.t_, e->ind_.idx_);
+            e->k_ = VRELOCABLE;
+            break;
+        }
+        case VVARARG:
+        case VCALL:
+            SetOneRet(e);
+            break;
+        default:
+            break;
+    }
+}
+
+void FuncState::Discharge2Reg(ExpDesc *e, int reg) {
+    DischargeVars(e);
+    switch (e->k_) {
+        case VNIL:
+            Nil(reg, 1);
+            break;
+        case VFALSE:
+        case VTRUE:
+            CodeABC(OP_LOADBOOL, reg, e->k_ == VTRUE, 0);
+            break;
+        case VK:
+            CodeK(reg, e->info_);
+            break;
+        case VKFLT:
+            CodeK(reg, NumberK(e->nval_));
+            break;
+        case VKINT:
+            CodeK(reg, IntK(e->ival_));
+            break;
+        case VRELOCABLE:
+            SETARG_A(Instr(e), reg);
+            break;
+        case VNONRELOC:
+            if (reg != e->info_) {
+                CodeABC(OP_MOVE, reg, e->info_, 0);
+            }
+            break;
+        default:
+            return;     // VJMP, nothing to do yet
+    }
+    e->info_ = reg;
+    e->k_ = VNONRELOC;
+}
+
+void FuncState::Discharge2AnyReg(ExpDesc *e) {
+    if (e->k_ != VNONRELOC) {
+        ReserveRegs(1);
+        Discharge2Reg(e, freereg_ - 1);
+    }
+}
+
+int FuncState::CodeLoadBool(int a, int b, int jump) {
+    GetLabel();     // these may be jump targets
+    return CodeABC(OP_LOADBOOL, a, b, jump);
+}
+
+// some jump of the list is not controlled by a TESTSET, so it has no value
+bool FuncState::NeedValue(int list) {
+    for (; list != NO_JUMP; list = GetJump(list)) {
+        if (GET_OPCODE(*GetJumpControl(list)) != OP_TESTSET) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Put the value of e in reg, including the true or false coming from
+ * its pending jumps
+ */
+void FuncState::Exp2Reg(ExpDesc *e, int reg) {
+    Discharge2Reg(e, reg);
+    if (e->k_ == VJMP) {
+        Concat(&e->t_, e->info_);
+    }
+    if (hasjumps(e)) {
+        int pf = NO_JUMP;   // LOADBOOL false
+        int pt = NO_JUMP;   // LOADBOOL true
+        if (NeedValue(e->t_) || NeedValue(e->f_)) {
+            int fj = e->k_ == VJMP ? NO_JUMP : Jump();
+            pf = CodeLoadBool(reg, 0, 1);
+            pt = CodeLoadBool(reg, 1, 0);
+            PatchToHere(fj);
+        }
+        int final = GetLabel();
+        PatchListAux(e->f_, final, reg, pf);
+        PatchListAux(e->t_, final, reg, pt);
+    }
+    e->f_ = e->t_ = NO_JUMP;
+    e->info_ = reg;
+    e->k_ = VNONRELOC;
+}
+
+void FuncState::Exp2NextReg(ExpDesc *e) {
+    DischargeVars(e);
+    FreeExp(e);
+    ReserveRegs(1);
+    Exp2Reg(e, freereg_ - 1);
+}
+
+int FuncState::Exp2AnyReg(ExpDesc *e) {
+    DischargeVars(e);
+    if (e->k_ == VNONRELOC) {
+        if (!hasjumps(e)) {
+            return e->info_;
+        }
+        if (e->info_ >= nactvar_) {     // a temporary can take the final value
+            Exp2Reg(e, e->info_);
+            return e->info_;
+        }
+    }
+    Exp2NextReg(e);
+    return e->info_;
+}
+
+// a register or an upvalue
+void FuncState::Exp2AnyRegUp(ExpDesc *e) {
+    if (e->k_ != VUPVAL || hasjumps(e)) {
+        Exp2AnyReg(e);
+    }
+}
+
+void FuncState::Exp2Val(ExpDesc *e) {
+    if (hasjumps(e)) {
+        Exp2AnyReg(e);
+    } else {
+        DischargeVars(e);
+    }
+}
+
+// R/K operand for e: a constant if it fits in 9 bits, else a register
+int FuncState::Exp2RK(ExpDesc *e) {
+    Exp2Val(e);
+    switch (e->k_) {
+        case VTRUE:  e->info_ = BoolK(true); break;
+        case VFALSE: e->info_ = BoolK(false); break;
+        case VNIL:   e->info_ = NilK(); break;
+        case VKINT:  e->info_ = IntK(e->ival_); break;
+        case VKFLT:  e->info_ = NumberK(e->nval_); break;
+        case VK:     break;
+        default:     return Exp2AnyReg(e);
+    }
+    e->k_ = VK;
+    if (e->info_ <= MAXINDEXRK) {
+        return RKASK(e->info_);
+    }
+    return Exp2AnyReg(e);
+}
+
+void FuncState::StoreVar(ExpDesc *var, ExpDesc *ex) {
+    switch (var->k_) {
+        case VLOCAL:
+            FreeExp(ex);
+            Exp2Reg(ex, var->info_);
+            return;
+        case VUPVAL: {
+            int e = Exp2AnyReg(ex);
+            CodeABC(OP_SETUPVAL, e, var->info_, 0);
+            break;
+        }
+        default: {  // VINDEXED
+            int op = var->ind_.vt_ == VLOCAL ? OP_SETTABLE : OP_SETTABUP;
+            int e = Exp2RK(ex);
+            CodeABC(op, var->ind_.t_, var->ind_.idx_, e);
+            break;
+        }
+    }
+    FreeExp(ex);
+}
+
+// e:key, the method and e go to two consecutive registers
+void FuncState::Self(ExpDesc *e, ExpDesc *key) {
+    Exp2AnyReg(e);
+    int ereg = e->info_;
+    FreeExp(e);
+    e->info_ = freereg_;
+    e->k_ = VNONRELOC;
+    ReserveRegs(2);
+    CodeABC(OP_SELF, e->info_, ereg, Exp2RK(key));
+    FreeExp(key);
+}
+
+void FuncState::NegateCondition(ExpDesc *e) {
+    uint32_t* pc = GetJumpControl(e->info_);
+    SETARG_A(*pc, !GETARG_A(*pc));
+}
+
+// a jump taken if e is cond
+int FuncState::JumpOnCond(ExpDesc *e, int cond) {
+    if (e->k_ == VRELOCABLE) {
+        uint32_t ie = Instr(e);
+        if (GET_OPCODE(ie) == OP_NOT) {
+            // test the operand of the NOT instead
+            f_->code_.pop_back();
+            lines_.pop_back();
+            pc_--;
+            return CondJump(OP_TEST, GETARG_B(ie), 0, !cond);
+        }
+    }
+    Discharge2AnyReg(e);
+    FreeExp(e);
+    return CondJump(OP_TESTSET, NO_REG, e->info_, cond);
+}
+
+// fall through if e is true, jump if it is false
+void FuncState::GoIfTrue(ExpDesc *e) {
+    int pc;
+    DischargeVars(e);
+    switch (e->k_) {
+        case VJMP:
+            NegateCondition(e);
+            pc = e->info_;
+            break;
+        case VK:
+        case VKFLT:
+        case VKINT:
+        case VTRUE:
+            pc = NO_JUMP;   // always true
+            break;
+        default:
+            pc = JumpOnCond(e, 0);
+            break;
+    }
+    Concat(&e->f_, pc);
+    PatchToHere(e->t_);
+    e->t_ = NO_JUMP;
+}
+
+// fall through if e is false, jump if it is true
+void FuncState::GoIfFalse(ExpDesc *e) {
+    int pc;
+    DischargeVars(e);
+    switch (e->k_) {
+        case VJMP:
+            pc = e->info_;
+            break;
+        case VNIL:
+        case VFALSE:
+            pc = NO_JUMP;   // always false
+            break;
+        default:
+            pc = JumpOnCond(e, 1);
+            break;
+    }
+    Concat(&e->t_, pc);
+    PatchToHere(e->f_);
+    e->f_ = NO_JUMP;
+}
+
+void FuncState::CodeNot(ExpDesc *e) {
+    DischargeVars(e);
+    switch (e->k_) {
+        case VNIL:
+        case VFALSE:
+            e->k_ = VTRUE;
+            break;
+        case VK:
+        case VKFLT:
+        case VKINT:
+        case VTRUE:
+            e->k_ = VFALSE;
+            break;
+        case VJMP:
+            NegateCondition(e);
+            break;
+        default:    // VRELOCABLE, VNONRELOC
+            Discharge2AnyReg(e);
+            FreeExp(e);
+            e->info_ = CodeABC(OP_NOT, 0, e->info_, 0);
+            e->k_ = VRELOCABLE;
+            break;
+    }
+    std::swap(e->f_, e->t_);
+    RemoveValues(e->f_);    // values are useless once negated
+    RemoveValues(e->t_);
+}
+
+// t[k], t must be in a register or an upvalue
+void FuncState::Indexed(ExpDesc *t, ExpDesc *k) {
+    t->ind_.t_ = byte_t(t->info_);
+    t->ind_.idx_ = short(Exp2RK(k));
+    t->ind_.vt_ = t->k_ == VUPVAL ? VUPVAL : VLOCAL;
+    t->k_ = VINDEXED;
+}
+
+/*
+ * Fold an operation on two numerals into e1, as lcode.c: only where it
+ * cannot raise an error, and never to NaN or a float zero (so -0.0
+ * keeps its sign).
+ */
+bool FuncState::ConstFolding(int op, ExpDesc *e1, const ExpDesc *e2) {
+    LuaValue v1, v2, res;
+    if (!ToNumeral(e1, &v1) || !ToNumeral(e2, &v2)) {
+        return false;
+    }
+    if ((op == OP_DIV || op == OP_IDIV || op == OP_MOD) && v2.AsNumber() == 0) {
+        return false;
+    }
+    if (!RawArith(op, v1, v2, &res)) {
+        return false;
+    }
+    if (res.IsInteger()) {
+        e1->k_ = VKINT;
+        e1->ival_ = res.i_;
+    } else {
+        LuaNumber n = res.n_;
+        if (std::isnan(n) || n == 0) {
+            return false;
+        }
+        e1->k_ = VKFLT;
+        e1->nval_ = n;
+    }
+    return true;
+}
+
+void FuncState::CodeUnExpVal(int op, ExpDesc *e, int line) {
+    int r = Exp2AnyReg(e);
+    FreeExp(e);
+    e->info_ = CodeABC(op, 0, r, 0);
+    e->k_ = VRELOCABLE;
+    FixLine(line);
+}
+
+void FuncState::CodeBinExpVal(int op, ExpDesc *e1, ExpDesc *e2, int line) {
+    int rk2 = Exp2RK(e2);
+    int rk1 = Exp2RK(e1);
+    FreeExps(e1, e2);
+    e1->info_ = CodeABC(op, 0, rk1, rk2);
+    e1->k_ = VRELOCABLE;
+    FixLine(line);
+}
+
+// e1 is already a constant or in a register, see Infix
+void FuncState::CodeComp(BinOpr opr, ExpDesc *e1, ExpDesc *e2) {
+    int rk1 = e1->k_ == VK ? RKASK(e1->info_) : e1->info_;
+    int rk2 = Exp2RK(e2);
+    FreeExps(e1, e2);
+    switch (opr) {
+        case OPR_NE:    // not (a == b)
+            e1->info_ = CondJump(OP_EQ, 0, rk1, rk2);
+            break;
+        case OPR_GT:    // b < a
+        case OPR_GE:    // b <= a
+            e1->info_ = CondJump(opr - OPR_NE + OP_EQ, 1, rk2, rk1);
+            break;
+        default:
+            e1->info_ = CondJump(opr - OPR_EQ + OP_EQ, 1, rk1, rk2);
+            break;
+    }
+    e1->k_ = VJMP;
+}
+
+void FuncState::Prefix(UnOpr op, ExpDesc *e, int line) {
+    static const ExpDesc zero = {VKINT, 0, 0, 0, {}, NO_JUMP, NO_JUMP};
+    switch (op) {
+        case OPR_MINUS:
+        case OPR_BNOT:
+            if (ConstFolding(op + OP_UNM, e, &zero)) {
+                break;
+            }
+            // fall through
+        case OPR_LEN:
+            CodeUnExpVal(op + OP_UNM, e, line);
+            break;
+        default:
+            CodeNot(e);
+            break;
+    }
+}
+
+// first operand of op, before the second one is read
+void FuncState::Infix(BinOpr op, ExpDesc *v) {
+    switch (op) {
+        case OPR_AND:
+            GoIfTrue(v);
+            break;
+        case OPR_OR:
+            GoIfFalse(v);
+            break;
+        case OPR_CONCAT:
+            Exp2NextReg(v);     // operands must be consecutive on the stack
+            break;
+        case OPR_ADD: case OPR_SUB: case OPR_MUL: case OPR_DIV: case OPR_IDIV:
+        case OPR_MOD: case OPR_POW: case OPR_BAND: case OPR_BOR: case OPR_BXOR:
+        case OPR_SHL: case OPR_SHR:
+            if (!ToNumeral(v, nullptr)) {
+                Exp2RK(v);
+            }
+            // else keep the numeral, it may be folded with the second operand
+            break;
+        default:
+            Exp2RK(v);
+            break;
+    }
+}
+
+void FuncState::Posfix(BinOpr op, ExpDesc *e1, ExpDesc *e2, int line) {
+    switch (op) {
+        case OPR_AND:
+            DischargeVars(e2);
+            Concat(&e2->f_, e1->f_);
+            *e1 = *e2;
+            break;
+        case OPR_OR:
+            DischargeVars(e2);
+            Concat(&e2->t_, e1->t_);
+            *e1 = *e2;
+            break;
+        case OPR_CONCAT:
+            Exp2Val(e2);
+            if (e2->k_ == VRELOCABLE && GET_OPCODE(Instr(e2)) == OP_CONCAT) {
+                // a .. b .. c is one CONCAT over the three registers
+                FreeExp(e1);
+                SETARG_B(Instr(e2), e1->info_);
+                e1->k_ = VRELOCABLE;
+                e1->info_ = e2->info_;
+            } else {
+                Exp2NextReg(e2);
+                CodeBinExpVal(OP_CONCAT, e1, e2, line);
+            }
+            break;
+        case OPR_ADD: case OPR_SUB: case OPR_MUL: case OPR_DIV: case OPR_IDIV:
+        case OPR_MOD: case OPR_POW: case OPR_BAND: case OPR_BOR: case OPR_BXOR:
+        case OPR_SHL: case OPR_SHR:
+            if (!ConstFolding(op + OP_ADD, e1, e2)) {
+                CodeBinExpVal(op + OP_ADD, e1, e2, line);
+            }
+            break;
+        default:
+            CodeComp(op, e1, e2);
+            break;
+    }
+}
+
+/*
+ * Store the tostore values above base into the table at base, nelems
+ * being the count of array items so far. tostore -1 stores up to the
+ * top.
+ */
+void FuncState::SetList(int base, int nelems, int tostore) {
+    int c = (nelems - 1) / LFIELDS_PER_FLUSH + 1;
+    int b = tostore == -1 ? 0 : tostore;
+    if (c <= MAXARG_C) {
+        CodeABC(OP_SETLIST, base, b, c);
+    } else if (c <= MAXARG_Ax) {
+        CodeABC(OP_SETLIST, base, b, 0);
+        CodeExtraArg(c);
+    } else {
+        parser_->lex_.SyntaxError("constructor too long");
+    }
+    freereg_ = base + 1;
+}
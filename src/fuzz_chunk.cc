@@ -0,0 +1,171 @@
+#include "chunk.h"
+#include "chunk_stream.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Fuzz target for ChunkReader, in the libFuzzer interface.
+ *
+ * Every input is loaded twice: from one buffer, and from a stream that
+ * hands out a few bytes at a time so that every refill path of the
+ * window is taken. Both must agree on accepting it, and accepted
+ * chunks also get their lazily loaded debug info decoded.
+ *
+ * Built with LUAVM_LIBFUZZER (clang) this is a plain libFuzzer target.
+ * Otherwise a small driver is linked in:
+ *
+ *   luavm_fuzz_chunk [-n mutations] [-s seed] <file>...
+ *
+ * which replays the files, e.g. the seed corpus in scripts/fuzz/chunk,
+ * then loads n random mutations of them.
+ */
+
+namespace {
+
+// at most step_ bytes per read, from a buffer
+class TrickleStream : public ChunkStream {
+public:
+    TrickleStream(const uint8_t* data, size_t size, size_t step)
+        : data_(data), size_(size), step_(step) {}
+    size_t Read(char* buf, size_t n) override {
+        n = std::min(std::min(n, step_), size_);
+        memcpy(buf, data_, n);
+        data_ += n;
+        size_ -= n;
+        return n;
+    }
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t step_;
+};
+
+void DecodeDebugInfo(Prototype* f) {
+    f->Lines();
+    f->LocVars();
+    f->UpvalueNames();
+    for (auto p:f->Protos()) {
+        DecodeDebugInfo(p);
+    }
+}
+
+// offset of the error, or SIZE_MAX if the chunk was accepted
+size_t LoadBuffer(const uint8_t* data, size_t size) {
+    try {
+        Chunk chunk(reinterpret_cast<const char*>(data), size, DebugInfo::Load);
+    } catch (const ChunkError& e) {
+        return e.offset_;
+    }
+    return SIZE_MAX;
+}
+
+size_t LoadStream(const uint8_t* data, size_t size) {
+    try {
+        TrickleStream stream(data, size, 1 + size % 13);
+        Chunk chunk(&stream, DebugInfo::Lazy);
+        DecodeDebugInfo(chunk.MainFunc());
+    } catch (const ChunkError& e) {
+        return e.offset_;
+    }
+    return SIZE_MAX;
+}
+
+// true if the chunk is accepted
+bool CheckOne(const uint8_t* data, size_t size) {
+    size_t buffered = LoadBuffer(data, size);
+    size_t streamed = LoadStream(data, size);
+    // a buffer reports a truncated array at its count, a stream only
+    // when it runs out, so only acceptance has to agree
+    if ((buffered == SIZE_MAX) != (streamed == SIZE_MAX)) {
+        fprintf(stderr, "buffer and stream disagree: %zu %zu\n", buffered, streamed);
+        abort();
+    }
+    return buffered == SIZE_MAX;
+}
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    CheckOne(data, size);
+    return 0;
+}
+
+#ifdef LUAVM_FUZZ_MAIN
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static std::string Mutate(std::string s, std::mt19937_64& rng) {
+    static const uint32_t interesting[] = {0, 1, 0x7f, 0xff, 0x100, 0xffff, 0x7fffffff, 0xffffffff};
+    int edits = 1 + int(rng() % 4);
+    for (int i = 0; i < edits && !s.empty(); ++i) {
+        size_t pos = rng() % s.size();
+        switch (rng() % 4) {
+            case 0:
+                s[pos] = char(s[pos] ^ (1 << (rng() % 8)));
+                break;
+            case 1:
+                s.resize(pos);
+                break;
+            case 2: {
+                uint32_t v = interesting[rng() % (sizeof(interesting) / sizeof(interesting[0]))];
+                s.replace(pos, std::min<size_t>(4, s.size() - pos), reinterpret_cast<const char*>(&v), 4);
+                break;
+            }
+            default:
+                s.insert(pos, 1 + rng() % 8, char(rng()));
+                break;
+        }
+    }
+    return s;
+}
+
+int main(int argc, char* argv[]) {
+    long mutations = 0;
+    unsigned long seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                mutations = strtol(optarg, nullptr, 10);
+                break;
+            case 's':
+                seed = strtoul(optarg, nullptr, 10);
+                break;
+            default:
+                printf("usage: %s [-n mutations] [-s seed] <file>...\n", argv[0]);
+                exit(-1);
+        }
+    }
+    std::vector<std::string> corpus;
+    for (int i = optind; i < argc; ++i) {
+        std::ifstream file(argv[i], std::ios::binary);
+        if (!file) {
+            printf("cannot open %s\n", argv[i]);
+            exit(-1);
+        }
+        std::stringstream buf;
+        buf << file.rdbuf();
+        corpus.push_back(buf.str());
+        const std::string& s = corpus.back();
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+    }
+    if (corpus.empty()) {
+        return 0;
+    }
+    std::mt19937_64 rng(seed);
+    long accepted = 0;
+    for (long i = 0; i < mutations; ++i) {
+        std::string s = Mutate(corpus[rng() % corpus.size()], rng);
+        accepted += CheckOne(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+    }
+    printf("%zu inputs replayed, %ld of %ld mutations accepted\n", corpus.size(), accepted, mutations);
+    return 0;
+}
+#endif
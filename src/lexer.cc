@@ -0,0 +1,458 @@
+#include "lexer.h"
+#include "state.h"
+#include "strscan.h"
+#include <climits>
+#include <stdexcept>
+
+static const char* const tokenNames[] = {
+        "and", "break", "do", "else", "elseif",
+        "end", "false", "for", "function", "goto", "if",
+        "in", "local", "nil", "not", "or", "repeat",
+        "return", "then", "true", "until", "while",
+        "//", "..", "...", "==", ">=", "<=", "~=",
+        "<<", ">>", "::", "<eof>",
+        "<number>", "<integer>", "<name>", "<string>"
+};
+
+// character classes of the C locale, as lctype.h
+static inline bool IsDigit(int c) { return c >= '0' && c <= '9'; }
+static inline bool IsAlpha(int c) { return (c | 0x20) >= 'a' && (c | 0x20) <= 'z'; }
+static inline bool IsLAlpha(int c) { return IsAlpha(c) || c == '_'; }
+static inline bool IsLAlnum(int c) { return IsLAlpha(c) || IsDigit(c); }
+static inline bool IsXDigit(int c) { return IsDigit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f'); }
+static inline bool IsSpace(int c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static inline bool IsPrint(int c) { return c >= 0x20 && c < 0x7f; }
+static inline bool IsNewline(int c) { return c == '\n' || c == '\r'; }
+
+static int HexValue(int c) {
+    return IsDigit(c) ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+Lexer::Lexer(const char *source, size_t n, const std::string &chunkName, Arena *arena)
+    : p_(source), end_(source + n), chunkId_(ChunkId(chunkName)), arena_(arena) {
+    for (int t = TK_AND; t <= TK_WHILE; ++t) {
+        const char* s = tokenNames[t - FIRST_RESERVED];
+        strings_.emplace(arena_->Copy(s, strlen(s)), t);
+    }
+    NextChar();
+}
+
+std::string_view Lexer::NewString(const char *s, size_t n) {
+    auto it = strings_.find(std::string_view(s, n));
+    if (it != strings_.end()) {
+        return it->first;
+    }
+    std::string_view v = arena_->Copy(s, n);
+    strings_.emplace(v, 0);
+    return v;
+}
+
+void Lexer::Next() {
+    lastLine_ = line_;
+    if (ahead_.type_ != TK_EOS) {
+        t_ = ahead_;
+        ahead_.type_ = TK_EOS;
+    } else {
+        t_.type_ = Lex(&t_);
+    }
+}
+
+int Lexer::Lookahead() {
+    ahead_.type_ = Lex(&ahead_);
+    return ahead_.type_;
+}
+
+std::string Lexer::TokenToString(int token) {
+    if (token < FIRST_RESERVED) {
+        if (IsPrint(token)) {
+            return std::string("'") + char(token) + "'";
+        }
+        return "'<\\" + std::to_string(token) + ">'";
+    }
+    const char* s = tokenNames[token - FIRST_RESERVED];
+    if (token < TK_EOS) {
+        return std::string("'") + s + "'";
+    }
+    return s;
+}
+
+std::string Lexer::TokenText(int token) const {
+    switch (token) {
+        case TK_NAME:
+        case TK_STRING:
+        case TK_FLT:
+        case TK_INT:
+            return "'" + buf_ + "'";
+        default:
+            return TokenToString(token);
+    }
+}
+
+void Lexer::Error(const std::string &msg, int token) {
+    std::string s = chunkId_ + ":" + std::to_string(line_) + ": " + msg;
+    if (token) {
+        s += " near " + TokenText(token);
+    }
+    throw std::runtime_error(s);
+}
+
+bool Lexer::CheckNext1(int c) {
+    if (current_ == c) {
+        NextChar();
+        return true;
+    }
+    return false;
+}
+
+// save and skip current_ if it is one of the two characters of set
+bool Lexer::CheckNext2(const char *set) {
+    if (current_ == set[0] || current_ == set[1]) {
+        SaveAndNext();
+        return true;
+    }
+    return false;
+}
+
+// skip \n, \r, \n\r or \r\n
+void Lexer::IncLine() {
+    int old = current_;
+    NextChar();
+    if (IsNewline(current_) && current_ != old) {
+        NextChar();
+    }
+    if (++line_ >= INT_MAX) {
+        Error("chunk has too many lines", 0);
+    }
+}
+
+/*
+ * Skip [=*[ or ]=*], returning the number of '=' if the bracket is
+ * complete, or -count - 1 if it is not
+ */
+int Lexer::SkipSep() {
+    int count = 0;
+    int s = current_;
+    SaveAndNext();
+    while (current_ == '=') {
+        SaveAndNext();
+        count++;
+    }
+    return current_ == s ? count : -count - 1;
+}
+
+// a long comment when tok is null, its text is not kept then
+void Lexer::ReadLongString(Token *tok, int sep) {
+    int line = line_;
+    SaveAndNext();  // second '['
+    if (IsNewline(current_)) {
+        IncLine();  // the first newline is not part of the string
+    }
+    for (;;) {
+        switch (current_) {
+            case EOZ:
+                Error(std::string("unfinished long ") + (tok ? "string" : "comment") +
+                      " (starting at line " + std::to_string(line) + ")", TK_EOS);
+            case ']':
+                if (SkipSep() == sep) {
+                    SaveAndNext();  // second ']'
+                    if (tok) {
+                        tok->s_ = NewString(buf_.data() + 2 + sep, buf_.size() - 2 * (2 + sep));
+                    }
+                    return;
+                }
+                break;
+            case '\n':
+            case '\r':
+                buf_.push_back('\n');
+                IncLine();
+                if (!tok) {
+                    buf_.clear();
+                }
+                break;
+            default: {
+                // the run up to the next character of interest at once
+                const char* from = Pos();
+                const char* to = strscan::FindAnyOf(from, end_ - from, "]\n\r", 3);
+                if (to == nullptr) {
+                    to = end_;
+                }
+                if (tok) {
+                    buf_.append(from, to);
+                }
+                SkipTo(to);
+            }
+        }
+    }
+}
+
+void Lexer::EscCheck(bool ok, const char *msg) {
+    if (!ok) {
+        if (current_ != EOZ) {
+            SaveAndNext();  // show the offending character
+        }
+        Error(msg, TK_STRING);
+    }
+}
+
+int Lexer::GetHexa() {
+    SaveAndNext();
+    EscCheck(IsXDigit(current_), "hexadecimal digit expected");
+    return HexValue(current_);
+}
+
+int Lexer::ReadHexaEsc() {
+    int r = GetHexa();
+    r = (r << 4) + GetHexa();
+    buf_.resize(buf_.size() - 2);
+    return r;
+}
+
+void Lexer::Utf8Esc() {
+    size_t saved = 4;   // '\', 'u', '{' and the first digit
+    SaveAndNext();      // 'u'
+    EscCheck(current_ == '{', "missing '{'");
+    unsigned long r = GetHexa();
+    while ((SaveAndNext(), IsXDigit(current_))) {
+        saved++;
+        r = (r << 4) + HexValue(current_);
+        EscCheck(r <= 0x10FFFF, "UTF-8 value too large");
+    }
+    EscCheck(current_ == '}', "missing '}'");
+    NextChar();
+    buf_.resize(buf_.size() - saved);
+    char utf8[8];
+    int n = 1;
+    if (r < 0x80) {
+        utf8[7] = char(r);
+    } else {
+        unsigned int mfb = 0x3f;    // maximum that fits in the first byte
+        do {
+            utf8[8 - n++] = char(0x80 | (r & 0x3f));
+            r >>= 6;
+            mfb >>= 1;
+        } while (r > mfb);
+        utf8[8 - n] = char((~mfb << 1) | r);
+    }
+    buf_.append(utf8 + 8 - n, n);
+}
+
+int Lexer::ReadDecEsc() {
+    int i, r = 0;
+    for (i = 0; i < 3 && IsDigit(current_); i++) {
+        r = 10 * r + current_ - '0';
+        SaveAndNext();
+    }
+    EscCheck(r <= UCHAR_MAX, "decimal escape too large");
+    buf_.resize(buf_.size() - i);
+    return r;
+}
+
+void Lexer::ReadString(int del, Token *tok) {
+    const char stops[] = {char(del), '\\', '\n', '\r'};
+    SaveAndNext();  // delimiters are kept for messages
+    while (current_ != del) {
+        switch (current_) {
+            case EOZ:
+                Error("unfinished string", TK_EOS);
+            case '\n':
+            case '\r':
+                Error("unfinished string", TK_STRING);
+            case '\\': {
+                int c;
+                SaveAndNext();  // '\\' is kept for messages until the escape is done
+                switch (current_) {
+                    case 'a': c = '\a'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'n': c = '\n'; break;
+                    case 'r': c = '\r'; break;
+                    case 't': c = '\t'; break;
+                    case 'v': c = '\v'; break;
+                    case 'x': c = ReadHexaEsc(); break;
+                    case '\\':
+                    case '"':
+                    case '\'':
+                        c = current_;
+                        break;
+                    case 'u':
+                        Utf8Esc();
+                        continue;
+                    case '\n':
+                    case '\r':
+                        IncLine();
+                        buf_.back() = '\n';
+                        continue;
+                    case EOZ:
+                        continue;   // reported by the loop
+                    case 'z':
+                        buf_.pop_back();
+                        NextChar();
+                        while (IsSpace(current_)) {
+                            if (IsNewline(current_)) {
+                                IncLine();
+                            } else {
+                                NextChar();
+                            }
+                        }
+                        continue;
+                    default:
+                        EscCheck(IsDigit(current_), "invalid escape sequence");
+                        c = ReadDecEsc();
+                        buf_.back() = char(c);
+                        continue;
+                }
+                NextChar();
+                buf_.back() = char(c);
+                break;
+            }
+            default: {
+                const char* from = Pos();
+                const char* to = strscan::FindAnyOf(from, end_ - from, stops, sizeof(stops));
+                if (to == nullptr) {
+                    to = end_;
+                }
+                buf_.append(from, to);
+                SkipTo(to);
+            }
+        }
+    }
+    SaveAndNext();
+    tok->s_ = NewString(buf_.data() + 1, buf_.size() - 2);
+}
+
+int Lexer::ReadNumeral(Token *tok) {
+    const char* expo = "Ee";
+    int first = current_;
+    SaveAndNext();
+    if (first == '0' && CheckNext2("xX")) {
+        expo = "Pp";
+    }
+    for (;;) {
+        if (CheckNext2(expo)) {
+            CheckNext2("-+");
+        }
+        if (IsXDigit(current_) || current_ == '.') {
+            SaveAndNext();
+        } else {
+            break;
+        }
+    }
+    LuaValue v;
+    if (!StringToNumber(buf_.data(), buf_.size(), &v)) {
+        Error("malformed number", TK_FLT);
+    }
+    if (v.IsInteger()) {
+        tok->i_ = v.i_;
+        return TK_INT;
+    }
+    tok->n_ = v.n_;
+    return TK_FLT;
+}
+
+int Lexer::Lex(Token *tok) {
+    buf_.clear();
+    for (;;) {
+        switch (current_) {
+            case '\n':
+            case '\r':
+                IncLine();
+                break;
+            case ' ':
+            case '\f':
+            case '\t':
+            case '\v':
+                NextChar();
+                break;
+            case '-': {
+                NextChar();
+                if (current_ != '-') {
+                    return '-';
+                }
+                NextChar();
+                if (current_ == '[') {
+                    int sep = SkipSep();
+                    buf_.clear();
+                    if (sep >= 0) {
+                        ReadLongString(nullptr, sep);
+                        buf_.clear();
+                        break;
+                    }
+                }
+                const char* from = Pos();
+                const char* to = strscan::FindAnyOf(from, end_ - from, "\n\r", 2);
+                SkipTo(to ? to : end_);
+                break;
+            }
+            case '[': {
+                int sep = SkipSep();
+                if (sep >= 0) {
+                    ReadLongString(tok, sep);
+                    return TK_STRING;
+                } else if (sep != -1) {
+                    Error("invalid long string delimiter", TK_STRING);
+                }
+                return '[';
+            }
+            case '=':
+                NextChar();
+                return CheckNext1('=') ? static_cast<int>(TK_EQ) : '=';
+            case '<':
+                NextChar();
+                if (CheckNext1('=')) {
+                    return TK_LE;
+                }
+                return CheckNext1('<') ? static_cast<int>(TK_SHL) : '<';
+            case '>':
+                NextChar();
+                if (CheckNext1('=')) {
+                    return TK_GE;
+                }
+                return CheckNext1('>') ? static_cast<int>(TK_SHR) : '>';
+            case '/':
+                NextChar();
+                return CheckNext1('/') ? static_cast<int>(TK_IDIV) : '/';
+            case '~':
+                NextChar();
+                return CheckNext1('=') ? static_cast<int>(TK_NE) : '~';
+            case ':':
+                NextChar();
+                return CheckNext1(':') ? static_cast<int>(TK_DBCOLON) : ':';
+            case '"':
+            case '\'':
+                ReadString(current_, tok);
+                return TK_STRING;
+            case '.':
+                SaveAndNext();
+                if (CheckNext1('.')) {
+                    return CheckNext1('.') ? TK_DOTS : TK_CONCAT;
+                } else if (!IsDigit(current_)) {
+                    return '.';
+                }
+                return ReadNumeral(tok);
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+                return ReadNumeral(tok);
+            case EOZ:
+                return TK_EOS;
+            default: {
+                if (IsLAlpha(current_)) {
+                    const char* from = Pos();
+                    do {
+                        NextChar();
+                    } while (IsLAlnum(current_));
+                    buf_.assign(from, Pos());
+                    auto it = strings_.find(std::string_view(from, Pos() - from));
+                    if (it == strings_.end()) {
+                        tok->s_ = NewString(from, Pos() - from);
+                        return TK_NAME;
+                    }
+                    tok->s_ = it->first;
+                    return it->second ? it->second : TK_NAME;
+                }
+                int c = current_;
+                NextChar();
+                return c;
+            }
+        }
+    }
+}
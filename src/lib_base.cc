@@ -0,0 +1,456 @@
+#include "lualib.h"
+#include "chunk.h"
+#include "parser.h"
+#include <cctype>
+#include <cstdio>
+
+StringObject* ToString(LuaState* L, const LuaValue& v) {
+    LuaTable* mt = L->GetMetatable(v);
+    if (mt) {
+        LuaValue tm = *mt->GetStr(L->NewString("__tostring"));
+        if (!tm.IsNil()) {
+            L->CheckStack(2);
+            L->Push(tm);
+            L->Push(v);
+            L->Call(1, 1);
+            LuaValue r = *L->Index(-1);
+            L->Pop(1);
+            if (!r.IsString()) {
+                L->Error("'__tostring' must return a string");
+            }
+            return r.str_;
+        }
+    }
+    switch (v.type_) {
+        case ValueType::Nil:
+            return L->NewString("nil");
+        case ValueType::Boolean:
+            return L->NewString(v.b_ ? "true" : "false");
+        case ValueType::Integer:
+        case ValueType::Number:
+        case ValueType::String:
+            return L->ToStringObject(v);
+        default: {
+            char buf[64];
+            int n = snprintf(buf, sizeof(buf), "%s: %p", v.TypeName(), static_cast<void*>(v.gc_));
+            return L->NewString(buf, size_t(n));
+        }
+    }
+}
+
+static int Print(LuaState* L) {
+    int n = L->GetTop();
+    for (int i = 1; i <= n; ++i) {
+        StringObject* s = ToString(L, *L->Index(i));
+        if (i > 1) {
+            fputc('\t', stdout);
+        }
+        fwrite(s->data(), 1, s->size(), stdout);
+    }
+    fputc('\n', stdout);
+    return 0;
+}
+
+static int Type(LuaState* L) {
+    L->CheckAny(1);
+    L->PushString(L->Index(1)->TypeName());
+    return 1;
+}
+
+static int Tostring(LuaState* L) {
+    L->CheckAny(1);
+    L->Push(LuaValue::Object(ToString(L, *L->Index(1))));
+    return 1;
+}
+
+static int Tonumber(LuaState* L) {
+    if (L->Index(2)->IsNil()) {
+        L->CheckAny(1);
+        LuaValue n;
+        if (LuaState::ToNumber(*L->Index(1), &n)) {
+            L->Push(n);
+        } else {
+            L->PushNil();
+        }
+        return 1;
+    }
+    LuaInteger base = L->CheckInteger(2);
+    if (!L->Index(1)->IsString()) {
+        L->TypeError(1, "string");
+    }
+    if (base < 2 || base > 36) {
+        L->ArgError(2, "base out of range");
+    }
+    StringObject* s = L->Index(1)->str_;
+    const char* p = s->data();
+    const char* end = p + s->size();
+    while (p < end && isspace(static_cast<unsigned char>(*p))) {
+        ++p;
+    }
+    while (end > p && isspace(static_cast<unsigned char>(end[-1]))) {
+        --end;
+    }
+    bool neg = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+    if (p == end) {
+        L->PushNil();
+        return 1;
+    }
+    uint64_t n = 0;
+    for (; p < end; ++p) {
+        int c = static_cast<unsigned char>(*p);
+        int d = isdigit(c) ? c - '0' : isalpha(c) ? (tolower(c) - 'a') + 10 : 36;
+        if (d >= base) {
+            L->PushNil();
+            return 1;
+        }
+        n = n * uint64_t(base) + uint64_t(d);
+    }
+    L->PushInteger(LuaInteger(neg ? 0 - n : n));
+    return 1;
+}
+
+static int Next(LuaState* L) {
+    LuaTable* t = L->CheckTable(1);
+    LuaValue key = *L->Index(2);
+    LuaValue val;
+    if (t->Next(&key, &val)) {
+        L->Push(key);
+        L->Push(val);
+        return 2;
+    }
+    if (!key.IsNil()) {
+        L->Error("invalid key to 'next'");
+    }
+    L->PushNil();
+    return 1;
+}
+
+static int Pairs(LuaState* L) {
+    L->CheckAny(1);
+    LuaValue t = *L->Index(1);
+    LuaTable* mt = L->GetMetatable(t);
+    LuaValue tm = mt ? *mt->GetStr(L->NewString("__pairs")) : LuaValue();
+    if (!tm.IsNil()) {
+        L->Push(tm);
+        L->Push(t);
+        L->Call(1, 3);
+        return 3;
+    }
+    L->Push(L->CurrentNative()->upvals_[0]);    // next
+    L->Push(t);
+    L->PushNil();
+    return 3;
+}
+
+static int IpairsAux(LuaState* L) {
+    LuaInteger i = L->CheckInteger(2) + 1;
+    LuaValue v = L->GetTable(*L->Index(1), LuaValue::Integer(i));
+    if (v.IsNil()) {
+        L->PushNil();
+        return 1;
+    }
+    L->PushInteger(i);
+    L->Push(v);
+    return 2;
+}
+
+static int Ipairs(LuaState* L) {
+    L->CheckAny(1);
+    LuaValue t = *L->Index(1);
+    L->Push(L->CurrentNative()->upvals_[0]);    // ipairs iterator
+    L->Push(t);
+    L->PushInteger(0);
+    return 3;
+}
+
+static int Select(LuaState* L) {
+    int n = L->GetTop();
+    LuaValue* v = L->Index(1);
+    if (v->IsString() && v->str_->size() == 1 && v->str_->data()[0] == '#') {
+        L->PushInteger(n - 1);
+        return 1;
+    }
+    LuaInteger i = L->CheckInteger(1);
+    if (i < 0) {
+        i = n + i;
+    } else if (i > n) {
+        i = n;
+    }
+    if (i < 1) {
+        L->ArgError(1, "index out of range");
+    }
+    return n - int(i);
+}
+
+static int Error(LuaState* L) {
+    LuaInteger level = L->OptInteger(2, 1);
+    L->SetTop(1);
+    LuaValue msg = *L->Index(1);
+    if (msg.IsString() && level > 0) {
+        std::string where = L->Where(int(level));
+        if (!where.empty()) {
+            where.append(msg.str_->data(), msg.str_->size());
+            msg = LuaValue::Object(L->NewString(where.data(), where.size()));
+        }
+    }
+    L->Throw(msg);
+}
+
+static int Assert(LuaState* L) {
+    if (!L->Index(1)->IsFalsy()) {
+        return L->GetTop();
+    }
+    L->CheckAny(1);
+    if (L->GetTop() >= 2) {
+        L->Throw(*L->Index(2));
+    }
+    L->Throw(LuaValue::Object(L->NewString("assertion failed!")));
+}
+
+// move the top value down to index 1
+static void InsertFirst(LuaState* L) {
+    int n = L->GetTop();
+    LuaValue v = *L->Index(n);
+    for (int i = n; i > 1; --i) {
+        *L->Index(i) = *L->Index(i - 1);
+    }
+    *L->Index(1) = v;
+}
+
+static int Pcall(LuaState* L) {
+    L->CheckAny(1);
+    bool ok = L->PCall(L->GetTop() - 1, LUA_MULTRET);
+    L->CheckStack(1);
+    L->PushBoolean(ok);
+    InsertFirst(L);
+    return L->GetTop();
+}
+
+/*
+ * The handler runs after the stack is unwound, so it sees the error
+ * value but not the frames that raised it.
+ */
+static int Xpcall(LuaState* L) {
+    int n = L->GetTop();
+    if (n < 2) {
+        L->TypeError(2, "function");
+    }
+    LuaValue handler = *L->Index(2);
+    for (int i = 2; i < n; ++i) {
+        *L->Index(i) = *L->Index(i + 1);
+    }
+    L->Pop(1);
+    bool ok = L->PCall(n - 2, LUA_MULTRET);
+    if (!ok) {
+        LuaValue err = *L->Index(-1);
+        L->Pop(1);
+        L->CheckStack(2);
+        L->Push(handler);
+        L->Push(err);
+        L->Call(1, 1);
+    }
+    L->CheckStack(1);
+    L->PushBoolean(ok);
+    InsertFirst(L);
+    return L->GetTop();
+}
+
+static int Rawget(LuaState* L) {
+    LuaTable* t = L->CheckTable(1);
+    L->CheckAny(2);
+    L->Push(*t->Get(*L->Index(2)));
+    return 1;
+}
+
+static int Rawset(LuaState* L) {
+    LuaTable* t = L->CheckTable(1);
+    L->CheckAny(2);
+    L->CheckAny(3);
+    L->RawSet(t, *L->Index(2), *L->Index(3));
+    L->SetTop(1);
+    return 1;
+}
+
+static int Rawequal(LuaState* L) {
+    L->CheckAny(1);
+    L->CheckAny(2);
+    LuaValue a = *L->Index(1), b = *L->Index(2);
+    // numbers have no metamethods, Equals() compares 1 and 1.0 by value
+    L->PushBoolean(a.IsNumber() && b.IsNumber() ? L->Equals(a, b) : a.RawEquals(b));
+    return 1;
+}
+
+static int Rawlen(LuaState* L) {
+    LuaValue* v = L->Index(1);
+    if (v->IsTable()) {
+        L->PushInteger(LuaInteger(v->table_->Length()));
+    } else if (v->IsString()) {
+        L->PushInteger(LuaInteger(v->str_->size()));
+    } else {
+        L->ArgError(1, "table or string expected");
+    }
+    return 1;
+}
+
+static int Setmetatable(LuaState* L) {
+    LuaTable* t = L->CheckTable(1);
+    LuaValue* mt = L->Index(2);
+    if (!mt->IsNil() && !mt->IsTable()) {
+        L->TypeError(2, "nil or table");
+    }
+    if (t->metatable_ && !t->metatable_->GetStr(L->NewString("__metatable"))->IsNil()) {
+        L->Error("cannot change a protected metatable");
+    }
+    t->metatable_ = mt->IsNil() ? nullptr : mt->table_;
+    L->SetTop(1);
+    return 1;
+}
+
+static int Getmetatable(LuaState* L) {
+    L->CheckAny(1);
+    LuaTable* mt = L->GetMetatable(*L->Index(1));
+    if (mt == nullptr) {
+        L->PushNil();
+        return 1;
+    }
+    const LuaValue* protect = mt->GetStr(L->NewString("__metatable"));
+    L->Push(protect->IsNil() ? LuaValue::Object(mt) : *protect);
+    return 1;
+}
+
+/*
+ * Concatenate the pieces returned by the reader function at 1 until it
+ * returns nil or an empty string. On an error of the reader, or a piece
+ * that is not a string, the message is left on top and false returned.
+ */
+static bool ReadPieces(LuaState* L, std::string* out) {
+    while (true) {
+        L->CheckStack(1);
+        L->Push(*L->Index(1));
+        if (!L->PCall(0, 1)) {
+            return false;
+        }
+        const LuaValue* piece = L->Index(-1);
+        if (piece->IsNil() || (piece->IsString() && piece->str_->size() == 0)) {
+            L->Pop(1);
+            return true;
+        }
+        if (!piece->IsString()) {
+            L->Pop(1);
+            L->PushString("reader function must return a string");
+            return false;
+        }
+        out->append(piece->str_->data(), piece->str_->size());
+        L->Pop(1);
+    }
+}
+
+/*
+ * load(chunk [, chunkname [, mode [, env]]]), the chunk is a string, or a
+ * function returning its pieces, with either Lua source or a precompiled
+ * chunk, as mode ("b", "t" or "bt") allows. Sources are named after
+ * chunkname, or the text itself ("=(load)" for a function).
+ */
+static int Load(LuaState* L) {
+    std::string pieces;
+    const char* data;
+    size_t size;
+    bool reader = L->Index(1)->IsFunction();
+    if (reader) {
+        if (!ReadPieces(L, &pieces)) {
+            LuaValue err = *L->Index(-1);
+            L->Pop(1);
+            L->PushNil();
+            L->Push(err);
+            return 2;
+        }
+        data = pieces.data();
+        size = pieces.size();
+    } else {
+        StringObject* s = L->CheckString(1);
+        data = s->data();
+        size = s->size();
+    }
+    // the reader may have moved the stack
+    const LuaValue* name = L->Index(2);
+    const LuaValue* mode = L->Index(3);
+    bool binary = size > 0 && data[0] == LUA_SIGNATURE[0];
+    try {
+        if (mode->IsString()) {
+            std::string m(mode->str_->data(), mode->str_->size());
+            if (m.find(binary ? 'b' : 't') == std::string::npos) {
+                throw std::runtime_error(std::string("attempt to load a ") + (binary ? "binary" : "text") +
+                                         " chunk (mode is '" + m + "')");
+            }
+        }
+        if (binary) {
+            L->Load(new Chunk(data, size));
+        } else {
+            std::string chunkName = name->IsString() ? std::string(name->str_->data(), name->str_->size())
+                                  : reader ? "=(load)" : std::string(data, size);
+            L->Load(new Chunk(Parser::Compile(data, size, chunkName)));
+        }
+    } catch (const std::runtime_error& e) {
+        L->PushNil();
+        L->PushString(e.what());
+        return 2;
+    }
+    LuaValue* env = L->Index(4);
+    if (L->GetTop() >= 5 && !env->IsNil()) {
+        LuaClosure* cl = L->Index(-1)->lcl_;
+        if (cl->nupvals_ > 0) {
+            cl->upvals_[0]->closed_ = *env;
+        }
+    }
+    return 1;
+}
+
+// objects are only released with the state, so there is nothing to collect
+static int Collectgarbage(LuaState* L) {
+    L->PushInteger(0);
+    return 1;
+}
+
+static const std::pair<const char*, NativeFunction> baseFuncs[] = {
+        {"print",          Print},
+        {"type",           Type},
+        {"tostring",       Tostring},
+        {"tonumber",       Tonumber},
+        {"next",           Next},
+        {"select",         Select},
+        {"error",          Error},
+        {"assert",         Assert},
+        {"pcall",          Pcall},
+        {"xpcall",         Xpcall},
+        {"rawget",         Rawget},
+        {"rawset",         Rawset},
+        {"rawequal",       Rawequal},
+        {"rawlen",         Rawlen},
+        {"setmetatable",   Setmetatable},
+        {"getmetatable",   Getmetatable},
+        {"load",           Load},
+        {"collectgarbage", Collectgarbage},
+        {nullptr,          nullptr},
+};
+
+void OpenBase(LuaState* L) {
+    LuaTable* g = L->Globals();
+    L->SetFuncs(g, baseFuncs);
+    // pairs and ipairs hand out their iterator without allocating
+    NativeClosure* pairs = L->NewNative(Pairs, "pairs", 1);
+    pairs->upvals_[0] = L->GetGlobal("next");
+    L->SetGlobal("pairs", LuaValue::Object(pairs));
+    NativeClosure* ipairs = L->NewNative(Ipairs, "ipairs", 1);
+    ipairs->upvals_[0] = LuaValue::Object(L->NewNative(IpairsAux, "ipairs"));
+    L->SetGlobal("ipairs", LuaValue::Object(ipairs));
+    L->SetGlobal("_G", LuaValue::Object(g));
+    L->SetGlobal("_VERSION", LuaValue::Object(L->NewString("Lua 5.3")));
+}
+
+void OpenLibs(LuaState* L) {
+    OpenBase(L);
+    OpenString(L);
+}
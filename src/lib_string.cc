@@ -0,0 +1,961 @@
+#include "lualib.h"
+#include "strscan.h"
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <cstdio>
+#include <string>
+
+#define L_ESC           '%'
+#define SPECIALS        "^$*+?.([%-"
+#define MAXCAPTURES     32
+#define MAXMATCHDEPTH   200
+#define CAP_UNFINISHED  (-1)
+#define CAP_POSITION    (-2)
+#define MAXSTRSIZE      size_t(INT_MAX)     // largest string built by rep
+
+// string position from a Lua index, negative counts from the end
+static size_t PosRelat(LuaInteger pos, size_t len) {
+    if (pos >= 0) {
+        return size_t(pos);
+    }
+    if (0u - size_t(pos) > len) {
+        return 0;
+    }
+    return len + size_t(pos) + 1;
+}
+
+static int Len(LuaState* L) {
+    L->PushInteger(LuaInteger(L->CheckString(1)->size()));
+    return 1;
+}
+
+static int Sub(LuaState* L) {
+    StringObject* s = L->CheckString(1);
+    size_t l = s->size();
+    size_t start = PosRelat(L->CheckInteger(2), l);
+    size_t end = PosRelat(L->OptInteger(3, -1), l);
+    if (start < 1) {
+        start = 1;
+    }
+    if (end > l) {
+        end = l;
+    }
+    if (start <= end) {
+        L->PushString(s->data() + start - 1, end - start + 1);
+    } else {
+        L->PushString("", 0);
+    }
+    return 1;
+}
+
+static int Reverse(LuaState* L) {
+    StringObject* s = L->CheckString(1);
+    std::string r(s->data(), s->size());
+    std::reverse(r.begin(), r.end());
+    L->PushString(r);
+    return 1;
+}
+
+static int Lower(LuaState* L) {
+    StringObject* s = L->CheckString(1);
+    std::string r(s->data(), s->size());
+    for (auto& c:r) {
+        c = char(tolower(static_cast<unsigned char>(c)));
+    }
+    L->PushString(r);
+    return 1;
+}
+
+static int Upper(LuaState* L) {
+    StringObject* s = L->CheckString(1);
+    std::string r(s->data(), s->size());
+    for (auto& c:r) {
+        c = char(toupper(static_cast<unsigned char>(c)));
+    }
+    L->PushString(r);
+    return 1;
+}
+
+/*
+ * The first copy of s..sep is written once, then the filled prefix is
+ * copied onto the rest, doubling each time: log2(n) memcpy calls.
+ */
+static int Rep(LuaState* L) {
+    StringObject* s = L->CheckString(1);
+    LuaInteger n = L->CheckInteger(2);
+    StringObject* sep = L->Index(3)->IsNil() ? nullptr : L->CheckString(3);
+    size_t l = s->size();
+    size_t lsep = sep ? sep->size() : 0;
+    if (n <= 0) {
+        L->PushString("", 0);
+        return 1;
+    }
+    if (l + lsep < l || l + lsep > MAXSTRSIZE / size_t(n)) {
+        L->Error("resulting string too large");
+    }
+    size_t total = size_t(n) * l + size_t(n - 1) * lsep;
+    std::string r(total, '\0');
+    char* p = &r[0];
+    memcpy(p, s->data(), l);
+    size_t filled = l;
+    if (n > 1 && lsep > 0) {
+        memcpy(p + filled, sep->data(), lsep);
+        filled += lsep;
+    }
+    while (filled < total) {
+        size_t chunk = filled < total - filled ? filled : total - filled;
+        memcpy(p + filled, p, chunk);
+        filled += chunk;
+    }
+    L->PushString(r);
+    return 1;
+}
+
+static int Byte(LuaState* L) {
+    StringObject* s = L->CheckString(1);
+    size_t l = s->size();
+    LuaInteger pi = L->OptInteger(2, 1);
+    size_t posi = PosRelat(pi, l);
+    size_t pose = PosRelat(L->OptInteger(3, LuaInteger(posi)), l);
+    if (posi < 1) {
+        posi = 1;
+    }
+    if (pose > l) {
+        pose = l;
+    }
+    if (posi > pose) {
+        return 0;
+    }
+    if (pose - posi >= size_t(INT_MAX)) {
+        L->Error("string slice too long");
+    }
+    int n = int(pose - posi) + 1;
+    L->CheckStack(n);
+    auto p = reinterpret_cast<const unsigned char*>(s->data()) + posi - 1;
+    for (int i = 0; i < n; ++i) {
+        L->PushInteger(p[i]);
+    }
+    return n;
+}
+
+static int Char(LuaState* L) {
+    int n = L->GetTop();
+    std::string r(size_t(n), '\0');
+    for (int i = 1; i <= n; ++i) {
+        LuaInteger c = L->CheckInteger(i);
+        if (uint64_t(c) > UCHAR_MAX) {
+            L->ArgError(i, "value out of range");
+        }
+        r[size_t(i - 1)] = char(c);
+    }
+    L->PushString(r);
+    return 1;
+}
+
+/*
+ * Lua patterns, a backtracking matcher as in the reference
+ * implementation. Patterns and subjects are interned strings and so are
+ * terminated by '\0', which the matcher relies on to peek one byte past
+ * the end.
+ */
+class MatchState {
+public:
+    MatchState(LuaState* L, const char* s, size_t ls, const char* p, size_t lp)
+        : L_(L), srcInit_(s), srcEnd_(s + ls), pEnd_(p + lp), level_(0), matchDepth_(MAXMATCHDEPTH) {}
+
+    void Reset() {
+        level_ = 0;
+        matchDepth_ = MAXMATCHDEPTH;
+    }
+
+    const char* Match(const char* s, const char* p);
+    int PushCaptures(const char* s, const char* e, bool wholeIfNone = true);
+    void PushOneCapture(int i, const char* s, const char* e);
+    void AddValue(std::string& b, const char* s, const char* e, const LuaValue& repl);
+
+    LuaState* L_;
+    const char* srcInit_;
+    const char* srcEnd_;
+    const char* pEnd_;
+    int level_;
+    int matchDepth_;
+    struct {
+        const char* init_;
+        ptrdiff_t len_;
+    } capture_[MAXCAPTURES];
+
+private:
+    const char* ClassEnd(const char* p);
+    bool SingleMatch(const char* s, const char* p, const char* ep);
+    const char* MatchBalance(const char* s, const char* p);
+    const char* MaxExpand(const char* s, const char* p, const char* ep);
+    const char* MinExpand(const char* s, const char* p, const char* ep);
+    const char* StartCapture(const char* s, const char* p, int what);
+    const char* EndCapture(const char* s, const char* p);
+    const char* MatchCapture(const char* s, int l);
+    int CheckCapture(int l);
+    int CaptureToClose();
+    void AddString(std::string& b, const char* s, const char* e);
+};
+
+static bool MatchClass(int c, int cl) {
+    bool res;
+    switch (tolower(cl)) {
+        case 'a': res = isalpha(c); break;
+        case 'c': res = iscntrl(c); break;
+        case 'd': res = isdigit(c); break;
+        case 'g': res = isgraph(c); break;
+        case 'l': res = islower(c); break;
+        case 'p': res = ispunct(c); break;
+        case 's': res = isspace(c); break;
+        case 'u': res = isupper(c); break;
+        case 'w': res = isalnum(c); break;
+        case 'x': res = isxdigit(c); break;
+        case 'z': res = (c == 0); break;
+        default: return cl == c;
+    }
+    return isupper(cl) ? !res : res;
+}
+
+// p points at '[', ec at the closing ']'
+static bool MatchBracketClass(int c, const char* p, const char* ec) {
+    bool sig = true;
+    if (*(p + 1) == '^') {
+        sig = false;
+        ++p;
+    }
+    while (++p < ec) {
+        if (*p == L_ESC) {
+            ++p;
+            if (MatchClass(c, static_cast<unsigned char>(*p))) {
+                return sig;
+            }
+        } else if (*(p + 1) == '-' && p + 2 < ec) {
+            p += 2;
+            if (static_cast<unsigned char>(*(p - 2)) <= c && c <= static_cast<unsigned char>(*p)) {
+                return sig;
+            }
+        } else if (static_cast<unsigned char>(*p) == c) {
+            return sig;
+        }
+    }
+    return !sig;
+}
+
+const char* MatchState::ClassEnd(const char* p) {
+    switch (*p++) {
+        case L_ESC:
+            if (p == pEnd_) {
+                L_->Error("malformed pattern (ends with '%%')");
+            }
+            return p + 1;
+        case '[':
+            if (*p == '^') {
+                ++p;
+            }
+            do {
+                if (p == pEnd_) {
+                    L_->Error("malformed pattern (missing ']')");
+                }
+                if (*(p++) == L_ESC && p < pEnd_) {
+                    ++p;
+                }
+            } while (*p != ']');
+            return p + 1;
+        default:
+            return p;
+    }
+}
+
+bool MatchState::SingleMatch(const char* s, const char* p, const char* ep) {
+    if (s >= srcEnd_) {
+        return false;
+    }
+    int c = static_cast<unsigned char>(*s);
+    switch (*p) {
+        case '.':
+            return true;
+        case L_ESC:
+            return MatchClass(c, static_cast<unsigned char>(*(p + 1)));
+        case '[':
+            return MatchBracketClass(c, p, ep - 1);
+        default:
+            return static_cast<unsigned char>(*p) == c;
+    }
+}
+
+const char* MatchState::MatchBalance(const char* s, const char* p) {
+    if (p >= pEnd_ - 1) {
+        L_->Error("malformed pattern (missing arguments to '%%b')");
+    }
+    if (s >= srcEnd_ || *s != *p) {
+        return nullptr;
+    }
+    char b = *p, e = *(p + 1);
+    int cont = 1;
+    while (++s < srcEnd_) {
+        if (*s == e) {
+            if (--cont == 0) {
+                return s + 1;
+            }
+        } else if (*s == b) {
+            ++cont;
+        }
+    }
+    return nullptr;
+}
+
+const char* MatchState::MaxExpand(const char* s, const char* p, const char* ep) {
+    ptrdiff_t i = 0;
+    while (SingleMatch(s + i, p, ep)) {
+        ++i;
+    }
+    // try with the maximum repetitions, then less and less
+    for (; i >= 0; --i) {
+        const char* res = Match(s + i, ep + 1);
+        if (res) {
+            return res;
+        }
+    }
+    return nullptr;
+}
+
+const char* MatchState::MinExpand(const char* s, const char* p, const char* ep) {
+    for (;;) {
+        const char* res = Match(s, ep + 1);
+        if (res) {
+            return res;
+        }
+        if (!SingleMatch(s, p, ep)) {
+            return nullptr;
+        }
+        ++s;
+    }
+}
+
+const char* MatchState::StartCapture(const char* s, const char* p, int what) {
+    if (level_ >= MAXCAPTURES) {
+        L_->Error("too many captures");
+    }
+    capture_[level_].init_ = s;
+    capture_[level_].len_ = what;
+    ++level_;
+    const char* res = Match(s, p);
+    if (res == nullptr) {
+        --level_;
+    }
+    return res;
+}
+
+int MatchState::CaptureToClose() {
+    int level = level_;
+    for (--level; level >= 0; --level) {
+        if (capture_[level].len_ == CAP_UNFINISHED) {
+            return level;
+        }
+    }
+    L_->Error("invalid pattern capture");
+}
+
+const char* MatchState::EndCapture(const char* s, const char* p) {
+    int l = CaptureToClose();
+    capture_[l].len_ = s - capture_[l].init_;
+    const char* res = Match(s, p);
+    if (res == nullptr) {
+        capture_[l].len_ = CAP_UNFINISHED;
+    }
+    return res;
+}
+
+int MatchState::CheckCapture(int l) {
+    l -= '1';
+    if (l < 0 || l >= level_ || capture_[l].len_ == CAP_UNFINISHED) {
+        L_->Error("invalid capture index %%%d", l + 1);
+    }
+    return l;
+}
+
+const char* MatchState::MatchCapture(const char* s, int l) {
+    l = CheckCapture(l);
+    size_t len = size_t(capture_[l].len_);
+    if (size_t(srcEnd_ - s) >= len && memcmp(capture_[l].init_, s, len) == 0) {
+        return s + len;
+    }
+    return nullptr;
+}
+
+const char* MatchState::Match(const char* s, const char* p) {
+    if (matchDepth_-- == 0) {
+        L_->Error("pattern too complex");
+    }
+    for (;;) {
+        if (p == pEnd_) {
+            break;
+        }
+        const char* ep;
+        switch (*p) {
+            case '(':
+                if (*(p + 1) == ')') {
+                    s = StartCapture(s, p + 2, CAP_POSITION);
+                } else {
+                    s = StartCapture(s, p + 1, CAP_UNFINISHED);
+                }
+                break;
+            case ')':
+                s = EndCapture(s, p + 1);
+                break;
+            case '$':
+                if (p + 1 != pEnd_) {
+                    goto dflt;
+                }
+                s = (s == srcEnd_) ? s : nullptr;
+                break;
+            case L_ESC:
+                switch (*(p + 1)) {
+                    case 'b':
+                        s = MatchBalance(s, p + 2);
+                        if (s != nullptr) {
+                            p += 4;
+                            continue;
+                        }
+                        break;
+                    case 'f': {
+                        p += 2;
+                        if (*p != '[') {
+                            L_->Error("missing '[' after '%%f' in pattern");
+                        }
+                        ep = ClassEnd(p);
+                        int prev = (s == srcInit_) ? '\0' : static_cast<unsigned char>(*(s - 1));
+                        int cur = (s < srcEnd_) ? static_cast<unsigned char>(*s) : '\0';
+                        if (!MatchBracketClass(prev, p, ep - 1) && MatchBracketClass(cur, p, ep - 1)) {
+                            p = ep;
+                            continue;
+                        }
+                        s = nullptr;
+                        break;
+                    }
+                    case '0': case '1': case '2': case '3': case '4':
+                    case '5': case '6': case '7': case '8': case '9':
+                        s = MatchCapture(s, static_cast<unsigned char>(*(p + 1)));
+                        if (s != nullptr) {
+                            p += 2;
+                            continue;
+                        }
+                        break;
+                    default:
+                        goto dflt;
+                }
+                break;
+            default:
+            dflt:
+                ep = ClassEnd(p);
+                if (!SingleMatch(s, p, ep)) {
+                    if (*ep == '*' || *ep == '?' || *ep == '-') {
+                        // accept empty
+                        p = ep + 1;
+                        continue;
+                    }
+                    s = nullptr;
+                } else {
+                    switch (*ep) {
+                        case '?': {
+                            const char* res = Match(s + 1, ep + 1);
+                            if (res != nullptr) {
+                                s = res;
+                            } else {
+                                p = ep + 1;
+                                continue;
+                            }
+                            break;
+                        }
+                        case '+':
+                            s = MaxExpand(s + 1, p, ep);
+                            break;
+                        case '*':
+                            s = MaxExpand(s, p, ep);
+                            break;
+                        case '-':
+                            s = MinExpand(s, p, ep);
+                            break;
+                        default:
+                            ++s;
+                            p = ep;
+                            continue;
+                    }
+                }
+                break;
+        }
+        break;
+    }
+    ++matchDepth_;
+    return s;
+}
+
+void MatchState::PushOneCapture(int i, const char* s, const char* e) {
+    if (i >= level_) {
+        if (i != 0) {
+            L_->Error("invalid capture index %%%d", i + 1);
+        }
+        L_->PushString(s, size_t(e - s));   // whole match
+        return;
+    }
+    ptrdiff_t l = capture_[i].len_;
+    if (l == CAP_UNFINISHED) {
+        L_->Error("unfinished capture");
+    }
+    if (l == CAP_POSITION) {
+        L_->PushInteger(LuaInteger(capture_[i].init_ - srcInit_) + 1);
+    } else {
+        L_->PushString(capture_[i].init_, size_t(l));
+    }
+}
+
+int MatchState::PushCaptures(const char* s, const char* e, bool wholeIfNone) {
+    int n = (level_ == 0 && wholeIfNone) ? 1 : level_;
+    L_->CheckStack(n);
+    for (int i = 0; i < n; ++i) {
+        PushOneCapture(i, s, e);
+    }
+    return n;
+}
+
+void MatchState::AddString(std::string& b, const char* s, const char* e) {
+    const LuaValue* v = L_->Index(3);
+    const char* news = v->str_->data();
+    size_t l = v->str_->size();
+    for (size_t i = 0; i < l; ++i) {
+        if (news[i] != L_ESC) {
+            b.push_back(news[i]);
+            continue;
+        }
+        ++i;
+        if (news[i] == L_ESC) {
+            b.push_back(L_ESC);
+        } else if (isdigit(static_cast<unsigned char>(news[i]))) {
+            if (news[i] == '0') {
+                b.append(s, size_t(e - s));
+            } else {
+                PushOneCapture(news[i] - '1', s, e);
+                StringObject* c = ToString(L_, *L_->Index(-1));
+                b.append(c->data(), c->size());
+                L_->Pop(1);
+            }
+        } else {
+            L_->Error("invalid use of '%c' in replacement string", L_ESC);
+        }
+    }
+}
+
+void MatchState::AddValue(std::string& b, const char* s, const char* e, const LuaValue& repl) {
+    LuaValue r;
+    switch (repl.type_) {
+        case ValueType::Integer:
+        case ValueType::Number:
+        case ValueType::String:
+            AddString(b, s, e);
+            return;
+        case ValueType::Table:
+            PushOneCapture(0, s, e);
+            r = L_->GetTable(repl, *L_->Index(-1));
+            L_->Pop(1);
+            break;
+        default: {
+            L_->CheckStack(1);
+            L_->Push(repl);
+            int n = PushCaptures(s, e);
+            L_->Call(n, 1);
+            r = *L_->Index(-1);
+            L_->Pop(1);
+            break;
+        }
+    }
+    if (r.IsFalsy()) {
+        b.append(s, size_t(e - s));     // keep the original text
+    } else if (!r.IsString() && !r.IsNumber()) {
+        L_->Error("invalid replacement value (a %s)", r.TypeName());
+    } else {
+        StringObject* str = L_->ToStringObject(r);
+        b.append(str->data(), str->size());
+    }
+}
+
+static bool NoSpecials(const char* p, size_t lp) {
+    return strscan::FindAnyOf(p, lp, SPECIALS, sizeof(SPECIALS) - 1) == nullptr;
+}
+
+/*
+ * If every match has to start with one given byte, return it in c, so
+ * that candidate positions can be found with a vectorized byte search
+ * instead of running the matcher at every position.
+ */
+static bool FirstLiteral(const char* p, size_t lp, char* c) {
+    size_t item;
+    if (lp >= 1 && *p != ')' && strchr(SPECIALS, *p) == nullptr) {
+        *c = *p;
+        item = 1;
+    } else if (lp >= 2 && *p == L_ESC && ispunct(static_cast<unsigned char>(p[1]))) {
+        *c = p[1];
+        item = 2;
+    } else {
+        return false;
+    }
+    return lp == item || strchr("*?-", p[item]) == nullptr;
+}
+
+static int FindAux(LuaState* L, bool find) {
+    StringObject* str = L->CheckString(1);
+    StringObject* pat = L->CheckString(2);
+    const char* s = str->data();
+    const char* p = pat->data();
+    size_t ls = str->size(), lp = pat->size();
+    size_t init = PosRelat(L->OptInteger(3, 1), ls);
+    if (init < 1) {
+        init = 1;
+    }
+    if (init > ls + 1) {
+        L->PushNil();
+        return 1;
+    }
+    if (find && (!L->Index(4)->IsFalsy() || NoSpecials(p, lp))) {
+        const char* s2 = strscan::Find(s + init - 1, ls - init + 1, p, lp);
+        if (s2) {
+            L->PushInteger(LuaInteger(s2 - s) + 1);
+            L->PushInteger(LuaInteger(s2 - s + lp));
+            return 2;
+        }
+        L->PushNil();
+        return 1;
+    }
+    bool anchor = *p == '^';
+    if (anchor) {
+        ++p;
+        --lp;
+    }
+    MatchState ms(L, s, ls, p, lp);
+    char first;
+    bool skip = !anchor && FirstLiteral(p, lp, &first);
+    const char* s1 = s + init - 1;
+    for (;;) {
+        if (skip) {
+            s1 = strscan::FindByte(s1, size_t(ms.srcEnd_ - s1), first);
+            if (s1 == nullptr) {
+                break;
+            }
+        }
+        ms.Reset();
+        const char* e = ms.Match(s1, p);
+        if (e) {
+            if (find) {
+                L->PushInteger(LuaInteger(s1 - s) + 1);
+                L->PushInteger(LuaInteger(e - s));
+                return ms.PushCaptures(nullptr, nullptr, false) + 2;
+            }
+            return ms.PushCaptures(s1, e);
+        }
+        if (anchor || s1 >= ms.srcEnd_) {
+            break;
+        }
+        ++s1;
+    }
+    L->PushNil();
+    return 1;
+}
+
+static int Find(LuaState* L) {
+    return FindAux(L, true);
+}
+
+static int MatchFn(LuaState* L) {
+    return FindAux(L, false);
+}
+
+// upvalues: subject, pattern, next start offset, end offset of the last match
+static int GmatchAux(LuaState* L) {
+    auto& up = L->CurrentNative()->upvals_;
+    StringObject* str = up[0].str_;
+    StringObject* pat = up[1].str_;
+    MatchState ms(L, str->data(), str->size(), pat->data(), pat->size());
+    char first;
+    bool skip = FirstLiteral(pat->data(), pat->size(), &first);
+    const char* lastMatch = up[3].i_ < 0 ? nullptr : str->data() + up[3].i_;
+    for (const char* src = str->data() + up[2].i_; src <= ms.srcEnd_; ++src) {
+        if (skip) {
+            src = strscan::FindByte(src, size_t(ms.srcEnd_ - src), first);
+            if (src == nullptr) {
+                break;
+            }
+        }
+        ms.Reset();
+        const char* e = ms.Match(src, pat->data());
+        if (e != nullptr && e != lastMatch) {
+            up[2].i_ = up[3].i_ = e - str->data();
+            return ms.PushCaptures(src, e);
+        }
+    }
+    up[2].i_ = LuaInteger(str->size()) + 1;     // exhausted
+    return 0;
+}
+
+static int Gmatch(LuaState* L) {
+    StringObject* s = L->CheckString(1);
+    StringObject* p = L->CheckString(2);
+    NativeClosure* f = L->NewNative(GmatchAux, "gmatch_aux", 4);
+    f->upvals_[0] = LuaValue::Object(s);
+    f->upvals_[1] = LuaValue::Object(p);
+    f->upvals_[2] = LuaValue::Integer(0);
+    f->upvals_[3] = LuaValue::Integer(-1);
+    L->Push(LuaValue::Object(f));
+    return 1;
+}
+
+/*
+ * A pattern without special characters is searched with strscan::Find,
+ * the replacement is then applied exactly as for a real match.
+ */
+static int Gsub(LuaState* L) {
+    StringObject* str = L->CheckString(1);
+    StringObject* pat = L->CheckString(2);
+    const char* src = str->data();
+    const char* p = pat->data();
+    size_t srcl = str->size(), lp = pat->size();
+    LuaValue* r = L->Index(3);
+    if (!r->IsNumber() && !r->IsString() && !r->IsTable() && !r->IsFunction()) {
+        L->TypeError(3, "string/function/table");
+    }
+    if (r->IsNumber()) {
+        L->CheckString(3);
+    }
+    LuaValue repl = *r;
+    LuaInteger maxS = L->OptInteger(4, LuaInteger(srcl) + 1);
+    bool anchor = *p == '^';
+    if (anchor) {
+        ++p;
+        --lp;
+    }
+    MatchState ms(L, src, srcl, p, lp);
+    const char* end = ms.srcEnd_;
+    std::string b;
+    LuaInteger n = 0;
+    if (!anchor && lp > 0 && NoSpecials(p, lp)) {
+        while (n < maxS) {
+            const char* e = strscan::Find(src, size_t(end - src), p, lp);
+            if (e == nullptr) {
+                break;
+            }
+            b.append(src, size_t(e - src));
+            ms.Reset();
+            ms.AddValue(b, e, e + lp, repl);
+            src = e + lp;
+            ++n;
+        }
+    } else {
+        char first;
+        bool skip = !anchor && FirstLiteral(p, lp, &first);
+        const char* lastMatch = nullptr;
+        while (n < maxS) {
+            if (skip) {
+                const char* q = strscan::FindByte(src, size_t(end - src), first);
+                if (q == nullptr) {
+                    break;
+                }
+                b.append(src, size_t(q - src));
+                src = q;
+            }
+            ms.Reset();
+            const char* e = ms.Match(src, p);
+            if (e != nullptr && e != lastMatch) {
+                ++n;
+                ms.AddValue(b, src, e, repl);
+                src = lastMatch = e;
+            } else if (src < end) {
+                b.push_back(*src++);
+            } else {
+                break;
+            }
+            if (anchor) {
+                break;
+            }
+        }
+    }
+    b.append(src, size_t(end - src));
+    L->PushString(b);
+    L->PushInteger(n);
+    return 2;
+}
+
+#define FMT_FLAGS   "-+ #0"
+#define MAX_FORMAT  32
+#define MAX_ITEM    (120 + 308)     // large enough for '%99.99f' of -DBL_MAX
+
+static const char* ScanFormat(LuaState* L, const char* strfrmt, char* form) {
+    const char* p = strfrmt;
+    while (*p != '\0' && strchr(FMT_FLAGS, *p) != nullptr) {
+        ++p;
+    }
+    if (size_t(p - strfrmt) >= sizeof(FMT_FLAGS)) {
+        L->Error("invalid format (repeated flags)");
+    }
+    for (int i = 0; i < 2 && isdigit(static_cast<unsigned char>(*p)); ++i) {
+        ++p;    // width, 2 digits at most
+    }
+    if (*p == '.') {
+        ++p;
+        for (int i = 0; i < 2 && isdigit(static_cast<unsigned char>(*p)); ++i) {
+            ++p;    // precision, 2 digits at most
+        }
+    }
+    if (isdigit(static_cast<unsigned char>(*p))) {
+        L->Error("invalid format (width or precision too long)");
+    }
+    *(form++) = '%';
+    memcpy(form, strfrmt, size_t(p - strfrmt + 1));
+    form += p - strfrmt + 1;
+    *form = '\0';
+    return p;
+}
+
+// insert a length modifier before the conversion at the end of form
+static void AddLenModifier(char* form, const char* mod) {
+    size_t l = strlen(form);
+    size_t lm = strlen(mod);
+    char spec = form[l - 1];
+    memcpy(form + l - 1, mod, lm);
+    form[l + lm - 1] = spec;
+    form[l + lm] = '\0';
+}
+
+static void AddQuoted(LuaState* L, std::string& b, int arg) {
+    LuaValue* v = L->Index(arg);
+    char buf[MAX_ITEM];
+    switch (v->type_) {
+        case ValueType::String: {
+            const char* s = v->str_->data();
+            size_t len = v->str_->size();
+            b.push_back('"');
+            for (size_t i = 0; i < len; ++i) {
+                unsigned char c = static_cast<unsigned char>(s[i]);
+                if (c == '"' || c == '\\' || c == '\n') {
+                    b.push_back('\\');
+                    b.push_back(char(c));
+                } else if (c == '\0' || iscntrl(c)) {
+                    bool digitNext = i + 1 < len && isdigit(static_cast<unsigned char>(s[i + 1]));
+                    snprintf(buf, sizeof(buf), digitNext ? "\\%03d" : "\\%d", int(c));
+                    b.append(buf);
+                } else {
+                    b.push_back(char(c));
+                }
+            }
+            b.push_back('"');
+            break;
+        }
+        case ValueType::Number:
+            snprintf(buf, sizeof(buf), "%a", v->n_);    // hexadecimal, keeps every bit
+            b.append(buf);
+            break;
+        case ValueType::Integer:
+            snprintf(buf, sizeof(buf), v->i_ == LLONG_MIN ? "0x%llx" : "%lld", (long long)v->i_);
+            b.append(buf);
+            break;
+        case ValueType::Nil:
+        case ValueType::Boolean: {
+            StringObject* s = ToString(L, *v);
+            b.append(s->data(), s->size());
+            break;
+        }
+        default:
+            L->ArgError(arg, "value has no literal form");
+    }
+}
+
+static int Format(LuaState* L) {
+    int top = L->GetTop();
+    int arg = 1;
+    StringObject* fmt = L->CheckString(arg);
+    const char* strfrmt = fmt->data();
+    const char* strfrmtEnd = strfrmt + fmt->size();
+    std::string b;
+    char form[MAX_FORMAT];
+    char buf[MAX_ITEM];
+    while (strfrmt < strfrmtEnd) {
+        if (*strfrmt != L_ESC) {
+            b.push_back(*strfrmt++);
+            continue;
+        }
+        if (*++strfrmt == L_ESC) {
+            b.push_back(*strfrmt++);
+            continue;
+        }
+        if (++arg > top) {
+            L->ArgError(arg, "no value");
+        }
+        strfrmt = ScanFormat(L, strfrmt, form);
+        int n = 0;
+        switch (*strfrmt++) {
+            case 'c':
+                n = snprintf(buf, sizeof(buf), form, int(L->CheckInteger(arg)));
+                break;
+            case 'd': case 'i':
+            case 'o': case 'u': case 'x': case 'X':
+                AddLenModifier(form, "ll");
+                n = snprintf(buf, sizeof(buf), form, (long long)L->CheckInteger(arg));
+                break;
+            case 'a': case 'A':
+            case 'e': case 'E': case 'f': case 'F':
+            case 'g': case 'G':
+                n = snprintf(buf, sizeof(buf), form, double(L->CheckNumber(arg)));
+                break;
+            case 'q':
+                AddQuoted(L, b, arg);
+                break;
+            case 's': {
+                StringObject* s = ToString(L, *L->Index(arg));
+                if (form[2] == '\0') {
+                    b.append(s->data(), s->size());     // no modifiers, keep the whole string
+                } else {
+                    if (s->size() != strlen(s->data())) {
+                        L->ArgError(arg, "string contains zeros");
+                    }
+                    if (strchr(form, '.') == nullptr && s->size() >= 100) {
+                        b.append(s->data(), s->size());     // no precision and too long to format
+                    } else {
+                        n = snprintf(buf, sizeof(buf), form, s->data());
+                    }
+                }
+                break;
+            }
+            default:
+                L->Error("invalid option '%%%c' to 'format'", *(strfrmt - 1));
+        }
+        b.append(buf, size_t(n));
+    }
+    L->PushString(b);
+    return 1;
+}
+
+static const std::pair<const char*, NativeFunction> stringFuncs[] = {
+        {"len",     Len},
+        {"sub",     Sub},
+        {"reverse", Reverse},
+        {"lower",   Lower},
+        {"upper",   Upper},
+        {"rep",     Rep},
+        {"byte",    Byte},
+        {"char",    Char},
+        {"format",  Format},
+        {"find",    Find},
+        {"match",   MatchFn},
+        {"gmatch",  Gmatch},
+        {"gsub",    Gsub},
+        {nullptr,   nullptr},
+};
+
+void OpenString(LuaState* L) {
+    LuaTable* string = L->NewTable();
+    L->SetFuncs(string, stringFuncs);
+    L->SetGlobal("string", LuaValue::Object(string));
+    LuaTable* meta = L->NewTable();
+    meta->Set(LuaValue::Object(L->NewString("__index")), LuaValue::Object(string));
+    L->SetStringMetatable(meta);
+}
@@ -0,0 +1,84 @@
+#include "chunk.h"
+#include "chunk_stream.h"
+#include "lualib.h"
+#include "parser.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+/*
+ * usage: lua <file>|- [args...]
+ *
+ * Runs a Lua source or a precompiled chunk with the standard libraries
+ * opened. The script arguments are passed as '...' and in the global
+ * table 'arg'. Debug info of precompiled chunks is only decoded for
+ * functions that raise an error. A first line starting with '#' is
+ * ignored in sources.
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("usage: %s <file>|- [args...]\n", argv[0]);
+        exit(-1);
+    }
+    const char* path = argv[1];
+    int fd = STDIN_FILENO;
+    if (strcmp(path, "-") != 0) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            printf("failed to open %s : %s\n", path, strerror(errno));
+            exit(-1);
+        }
+    }
+    Chunk* chunk;
+    try {
+        FdChunkStream file(fd);
+        char first;
+        if (fd != STDIN_FILENO && pread(fd, &first, 1, 0) == 1 && first == LUA_SIGNATURE[0]) {
+            chunk = new Chunk(&file, DebugInfo::Lazy);
+        } else {
+            // sources, and anything on stdin, are read whole
+            std::string text;
+            char buf[16 * 1024];
+            size_t n;
+            while ((n = file.Read(buf, sizeof(buf))) > 0) {
+                text.append(buf, n);
+            }
+            if (!text.empty() && text[0] == LUA_SIGNATURE[0]) {
+                chunk = new Chunk(text.data(), text.size(), DebugInfo::Lazy);
+            } else {
+                if (!text.empty() && text[0] == '#') {
+                    text.erase(0, std::min(text.find('\n'), text.size()));
+                }
+                std::string name = fd == STDIN_FILENO ? "=stdin" : std::string("@") + path;
+                chunk = new Chunk(Parser::Compile(text.data(), text.size(), name));
+            }
+        }
+    } catch (const std::exception& e) {
+        printf("failed to load %s : %s\n", path, e.what());
+        exit(-1);
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+
+    LuaState L;
+    OpenLibs(&L);
+    LuaTable* arg = L.NewTable();
+    for (int i = 0; i < argc; ++i) {
+        arg->SetInt(i - 1, LuaValue::Object(L.NewString(argv[i])));
+    }
+    L.SetGlobal("arg", LuaValue::Object(arg));
+    L.Load(chunk);
+    L.CheckStack(argc);
+    for (int i = 2; i < argc; ++i) {
+        L.PushString(argv[i]);
+    }
+    if (!L.PCall(argc - 2, 0)) {
+        StringObject* msg = ToString(&L, *L.Index(-1));
+        fprintf(stderr, "lua: %.*s\n", int(msg->size()), msg->data());
+        return 1;
+    }
+    return 0;
+}
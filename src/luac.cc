@@ -2,31 +2,155 @@
 // Created by 于承业 on 2023/10/23.
 //
 #include "chunk.h"
+#include "chunk_stream.h"
+#include "memstat.h"
+#include "parser.h"
 #include "unistd.h"
 #include "fcntl.h"
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <chrono>
+#include <stdexcept>
 
+/*
+ * Hands out the first byte of another stream, read ahead of time to
+ * tell a precompiled chunk from a source, then the rest of it.
+ */
+class PeekedChunkStream : public ChunkStream {
+public:
+    explicit PeekedChunkStream(ChunkStream* source): source_(source) {
+        peeked_ = source_->Read(&first_, 1) == 1;
+    }
+    // the first byte, or EOF for an empty stream
+    int First() const { return peeked_ ? (unsigned char)first_ : EOF; }
+    size_t Read(char* buf, size_t n) override {
+        if (!peeked_ || n == 0) {
+            return source_->Read(buf, n);
+        }
+        peeked_ = false;
+        buf[0] = first_;
+        return 1;
+    }
+    void Cancel() override {
+        source_->Cancel();
+    }
+    void Resume() override {
+        source_->Resume();
+    }
+private:
+    ChunkStream* source_;
+    char first_ = 0;
+    bool peeked_;
+};
+
+/*
+ * usage: luac [-l] [-m] [-d load|lazy|strip] [-o out] <file>|-
+ *   -l  print the listing (default)
+ *   -m  print the memory footprint and load time of the chunk
+ *   -d  how to load debug info, see DebugInfo
+ *   -o  write the chunk to out in the luac 5.3 format
+ *
+ * A precompiled chunk is parsed while it is being read, "-" reads from
+ * stdin so that bytecode or source can be piped in. Anything not
+ * starting with the chunk signature is compiled as Lua source, the load
+ * time then includes the compilation.
+ */
 int main(int argc, char *argv[]) {
-    if (argc > 1) {
-        int fd = open(argv[1], O_RDONLY);
-        if (fd < 0) {
-            printf("failed to open %s : %s\n", argv[1], strerror(errno));
-            exit(-1);
+    bool listing = false;
+    bool memory = false;
+    DebugInfo debug = DebugInfo::Load;
+    const char* output = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "lmd:o:")) != -1) {
+        switch (opt) {
+            case 'l':
+                listing = true;
+                break;
+            case 'm':
+                memory = true;
+                break;
+            case 'd':
+                if (strcmp(optarg, "lazy") == 0) {
+                    debug = DebugInfo::Lazy;
+                } else if (strcmp(optarg, "strip") == 0) {
+                    debug = DebugInfo::Strip;
+                } else if (strcmp(optarg, "load") != 0) {
+                    printf("unknown debug info mode %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                printf("usage: %s [-l] [-m] [-d load|lazy|strip] [-o out] <file>|-\n", argv[0]);
+                exit(-1);
         }
-        struct stat st;
-        if (fstat(fd, &st) == -1) {
-            printf("failed to get file stat\n");
-            exit(-1);
+    }
+    if (!listing && !memory && !output) {
+        listing = true;
+    }
+    if (optind < argc) {
+        const char* path = argv[optind];
+        int fd = STDIN_FILENO;
+        if (strcmp(path, "-") != 0) {
+            fd = open(path, O_RDONLY);
+            if (fd < 0) {
+                printf("failed to open %s : %s\n", path, strerror(errno));
+                exit(-1);
+            }
         }
-        char *buf = new char[st.st_size];
-        size_t n = read(fd, buf, st.st_size);
-        if (n != st.st_size) {
-            printf("failed to read (%zu vs %lld)\n", n, st.st_size);
+        std::unique_ptr<Chunk> chunk;
+        size_t heapBefore = memstat::LiveBytes();
+        size_t blocksBefore = memstat::LiveBlocks();
+        auto start = std::chrono::steady_clock::now();
+        try {
+            FdChunkStream file(fd);
+            // stdin cannot be pread, its first byte is kept by the stream
+            PeekedChunkStream peeked(&file);
+            if (peeked.First() == (unsigned char)LUA_SIGNATURE[0]) {
+                PrefetchChunkStream stream(&peeked);
+                chunk.reset(new Chunk(&stream, debug));
+            } else {
+                std::string text;
+                char buf[16 * 1024];
+                size_t n;
+                while ((n = peeked.Read(buf, sizeof(buf))) > 0) {
+                    text.append(buf, n);
+                }
+                std::string name = fd == STDIN_FILENO ? "=stdin" : std::string("@") + path;
+                chunk.reset(new Chunk(Parser::Compile(text.data(), text.size(), name)));
+            }
+        } catch (const std::exception& e) {
+            printf("failed to load %s : %s\n", path, e.what());
             exit(-1);
         }
-        close(fd);
-        Chunk chunk(buf, st.st_size);
+        std::chrono::duration<double, std::micro> loadTime = std::chrono::steady_clock::now() - start;
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+        if (output) {
+            std::string out;
+            ChunkWriter(&out).WriteChunk(chunk->MainFunc());
+            FILE* f = fopen(output, "wb");
+            if (f == nullptr || fwrite(out.data(), 1, out.size(), f) != out.size()) {
+                printf("failed to write %s : %s\n", output, strerror(errno));
+                exit(-1);
+            }
+            fclose(f);
+        }
+        if (listing) {
+            chunk->Print();
+        }
+        if (memory) {
+            chunk->PrintMemory();
+            printf("load time: %.1f us\n", loadTime.count());
+            if (memstat::HookInstalled()) {
+                printf("heap allocated by load: %zu bytes in %zu blocks\n",
+                       memstat::LiveBytes() - heapBefore,
+                       memstat::LiveBlocks() - blocksBefore);
+            }
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,36 @@
+#include "memstat.h"
+#include <atomic>
+
+namespace memstat {
+
+static std::atomic<size_t> liveBytes{0};
+static std::atomic<size_t> liveBlocks{0};
+static bool hookInstalled = false;
+
+void RecordAlloc(size_t n) {
+    liveBytes.fetch_add(n, std::memory_order_relaxed);
+    liveBlocks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RecordFree(size_t n) {
+    liveBytes.fetch_sub(n, std::memory_order_relaxed);
+    liveBlocks.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void SetHookInstalled() {
+    hookInstalled = true;
+}
+
+bool HookInstalled() {
+    return hookInstalled;
+}
+
+size_t LiveBytes() {
+    return liveBytes.load(std::memory_order_relaxed);
+}
+
+size_t LiveBlocks() {
+    return liveBlocks.load(std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,1277 @@
+#include "parser.h"
+#include <climits>
+#include <cstring>
+#include <memory>
+
+#define MAXVARS         200     // locals per function
+#define MAXUPVAL        255
+#define MAXCCALLS       200     // nesting of statements and expressions
+#define UNARY_PRIORITY  12
+
+#define hasmultret(k)   ((k) == VCALL || (k) == VVARARG)
+#define vkisvar(k)      (VLOCAL <= (k) && (k) <= VINDEXED)
+
+Prototype *Parser::Compile(const char *source, size_t n, const std::string &chunkName) {
+    Parser parser(source, n, chunkName);
+    std::unique_ptr<Prototype> main(new Prototype());
+    FuncState fs;
+    fs.f_ = main.get();
+    parser.MainFunc(&fs);
+    return main.release();
+}
+
+Parser::Parser(const char *source, size_t n, const std::string &chunkName)
+    : lex_(source, n, chunkName, &arena_), source_(chunkName) {
+    envName_ = lex_.NewString("_ENV", 4);
+    breakName_ = lex_.NewString("break", 5);
+}
+
+void Parser::ErrorExpected(int token) {
+    lex_.SyntaxError(Lexer::TokenToString(token) + " expected");
+}
+
+void Parser::ErrorLimit(FuncState *fs, int limit, const char *what) {
+    int line = int(fs->f_->lineDefined_);
+    std::string where = line == 0 ? "main function" : "function at line " + std::to_string(line);
+    lex_.SyntaxError(std::string("too many ") + what + " (limit is " + std::to_string(limit) + ") in " + where);
+}
+
+bool Parser::TestNext(int c) {
+    if (lex_.Type() == c) {
+        lex_.Next();
+        return true;
+    }
+    return false;
+}
+
+void Parser::Check(int c) {
+    if (lex_.Type() != c) {
+        ErrorExpected(c);
+    }
+}
+
+void Parser::CheckNext(int c) {
+    Check(c);
+    lex_.Next();
+}
+
+// what closes who opened at line where
+void Parser::CheckMatch(int what, int who, int where) {
+    if (!TestNext(what)) {
+        if (where == lex_.Line()) {
+            ErrorExpected(what);
+        }
+        lex_.SyntaxError(Lexer::TokenToString(what) + " expected (to close " +
+                         Lexer::TokenToString(who) + " at line " + std::to_string(where) + ")");
+    }
+}
+
+std::string_view Parser::StrCheckName() {
+    Check(TK_NAME);
+    std::string_view s = lex_.Current().s_;
+    lex_.Next();
+    return s;
+}
+
+void Parser::InitExp(ExpDesc *e, ExpKind k, int i) {
+    e->f_ = e->t_ = NO_JUMP;
+    e->k_ = k;
+    e->info_ = i;
+}
+
+void Parser::CodeString(ExpDesc *e, std::string_view s) {
+    InitExp(e, VK, fs_->StringK(s));
+}
+
+void Parser::CheckName(ExpDesc *e) {
+    CodeString(e, StrCheckName());
+}
+
+int Parser::RegisterLocalVar(std::string_view name) {
+    fs_->f_->locVars_.emplace_back(std::string(name), 0, 0);
+    return fs_->nlocvars_++;
+}
+
+void Parser::NewLocalVar(std::string_view name) {
+    int reg = RegisterLocalVar(name);
+    CheckLimit(fs_, int(actvar_.size()) + 1 - fs_->firstLocal_, MAXVARS, "local variables");
+    actvar_.push_back(short(reg));
+}
+
+// the i-th active local of fs
+LocalVar *Parser::GetLocVar(FuncState *fs, int i) {
+    return &fs->f_->locVars_[actvar_[fs->firstLocal_ + i]];
+}
+
+// the last nvars declared locals come into scope
+void Parser::AdjustLocalVars(int nvars) {
+    fs_->nactvar_ += nvars;
+    for (; nvars; nvars--) {
+        GetLocVar(fs_, fs_->nactvar_ - nvars)->startPC_ = fs_->pc_;
+    }
+}
+
+void Parser::RemoveVars(FuncState *fs, int toLevel) {
+    actvar_.resize(actvar_.size() - (fs->nactvar_ - toLevel));
+    while (fs->nactvar_ > toLevel) {
+        GetLocVar(fs, --fs->nactvar_)->endPC_ = fs->pc_;
+    }
+}
+
+int Parser::SearchUpvalue(FuncState *fs, std::string_view name) {
+    for (int i = 0; i < fs->nups_; i++) {
+        if (fs->upvalNames_[i].data() == name.data()) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int Parser::NewUpvalue(FuncState *fs, std::string_view name, ExpDesc *v) {
+    CheckLimit(fs, fs->nups_ + 1, MAXUPVAL, "upvalues");
+    fs->f_->upvalues_.emplace_back(v->k_ == VLOCAL, byte_t(v->info_));
+    fs->f_->upvalueNames_.emplace_back(name);
+    fs->upvalNames_.push_back(name);
+    return fs->nups_++;
+}
+
+// names are interned, so the locals are searched by address
+int Parser::SearchVar(FuncState *fs, std::string_view n) {
+    for (int i = fs->nactvar_ - 1; i >= 0; i--) {
+        const std::string& name = GetLocVar(fs, i)->varName_;
+        if (name.size() == n.size() && memcmp(name.data(), n.data(), n.size()) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// the block declaring local level has an upvalue to close
+void Parser::MarkUpval(FuncState *fs, int level) {
+    BlockCnt* bl = fs->bl_;
+    while (bl->nactvar_ > level) {
+        bl = bl->previous_;
+    }
+    bl->upval_ = true;
+}
+
+/*
+ * Find n as a local of fs, an upvalue of fs, or recursively in the
+ * enclosing functions, adding the upvalues on the way. VVOID if it is
+ * a global.
+ */
+void Parser::SingleVarAux(FuncState *fs, std::string_view n, ExpDesc *var, bool base) {
+    if (fs == nullptr) {
+        InitExp(var, VVOID, 0);
+        return;
+    }
+    int v = SearchVar(fs, n);
+    if (v >= 0) {
+        InitExp(var, VLOCAL, v);
+        if (!base) {
+            MarkUpval(fs, v);
+        }
+        return;
+    }
+    int idx = SearchUpvalue(fs, n);
+    if (idx < 0) {
+        SingleVarAux(fs->prev_, n, var, false);
+        if (var->k_ == VVOID) {
+            return;
+        }
+        idx = NewUpvalue(fs, n, var);
+    }
+    InitExp(var, VUPVAL, idx);
+}
+
+// a global name is _ENV[name]
+void Parser::SingleVar(ExpDesc *var) {
+    std::string_view name = StrCheckName();
+    SingleVarAux(fs_, name, var, true);
+    if (var->k_ == VVOID) {
+        ExpDesc key;
+        SingleVarAux(fs_, envName_, var, true);
+        CodeString(&key, name);
+        fs_->Indexed(var, &key);
+    }
+}
+
+// nexps values, the last one being e, are assigned to nvars variables
+void Parser::AdjustAssign(int nvars, int nexps, ExpDesc *e) {
+    int extra = nvars - nexps;
+    if (hasmultret(e->k_)) {
+        extra++;    // the call itself
+        if (extra < 0) {
+            extra = 0;
+        }
+        fs_->SetReturns(e, extra);
+        if (extra > 1) {
+            fs_->ReserveRegs(extra - 1);
+        }
+    } else {
+        if (e->k_ != VVOID) {
+            fs_->Exp2NextReg(e);
+        }
+        if (extra > 0) {
+            int reg = fs_->freereg_;
+            fs_->ReserveRegs(extra);
+            fs_->Nil(reg, extra);
+        }
+    }
+    if (nexps > nvars) {
+        fs_->freereg_ -= nexps - nvars;     // drop the extra values
+    }
+}
+
+void Parser::EnterLevel() {
+    ++level_;
+    CheckLimit(fs_, level_, MAXCCALLS, "C levels");
+}
+
+void Parser::CloseGoto(int g, LabelDesc *label) {
+    LabelDesc* gt = &gt_[g];
+    if (gt->nactvar_ < label->nactvar_) {
+        const std::string& name = GetLocVar(fs_, gt->nactvar_)->varName_;
+        SemError("<goto " + std::string(gt->name_) + "> at line " + std::to_string(gt->line_) +
+                 " jumps into the scope of local '" + name + "'");
+    }
+    fs_->PatchList(gt->pc_, label->pc_);
+    gt_.erase(gt_.begin() + g);
+}
+
+// close the pending goto g if its label is in the current block
+bool Parser::FindLabel(int g) {
+    BlockCnt* bl = fs_->bl_;
+    for (size_t i = bl->firstLabel_; i < label_.size(); i++) {
+        LabelDesc* lb = &label_[i];
+        if (lb->name_.data() == gt_[g].name_.data()) {
+            if (gt_[g].nactvar_ > lb->nactvar_ && (bl->upval_ || int(label_.size()) > bl->firstLabel_)) {
+                fs_->PatchClose(gt_[g].pc_, lb->nactvar_);
+            }
+            CloseGoto(g, lb);
+            return true;
+        }
+    }
+    return false;
+}
+
+int Parser::NewLabelEntry(std::vector<LabelDesc> *l, std::string_view name, int line, int pc) {
+    l->push_back({name, pc, line, byte_t(fs_->nactvar_)});
+    return int(l->size()) - 1;
+}
+
+// close the pending gotos of the current block to the new label lb
+void Parser::FindGotos(LabelDesc *lb) {
+    size_t i = fs_->bl_->firstGoto_;
+    while (i < gt_.size()) {
+        if (gt_[i].name_.data() == lb->name_.data()) {
+            CloseGoto(int(i), lb);
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+ * The pending gotos of a block being left now belong to the enclosing
+ * block, closing the upvalues of the block on the way if needed
+ */
+void Parser::MoveGotosOut(FuncState *fs, BlockCnt *bl) {
+    size_t i = bl->firstGoto_;
+    while (i < gt_.size()) {
+        LabelDesc* gt = &gt_[i];
+        if (gt->nactvar_ > bl->nactvar_) {
+            if (bl->upval_) {
+                fs->PatchClose(gt->pc_, bl->nactvar_);
+            }
+            gt->nactvar_ = bl->nactvar_;
+        }
+        if (!FindLabel(int(i))) {
+            i++;
+        }
+    }
+}
+
+void Parser::EnterBlock(FuncState *fs, BlockCnt *bl, bool isLoop) {
+    bl->isLoop_ = isLoop;
+    bl->nactvar_ = byte_t(fs->nactvar_);
+    bl->firstLabel_ = int(label_.size());
+    bl->firstGoto_ = int(gt_.size());
+    bl->upval_ = false;
+    bl->previous_ = fs->bl_;
+    fs->bl_ = bl;
+}
+
+// the "break" label at the end of a loop
+void Parser::BreakLabel() {
+    int l = NewLabelEntry(&label_, breakName_, 0, fs_->pc_);
+    FindGotos(&label_[l]);
+}
+
+void Parser::UndefGoto(LabelDesc *gt) {
+    if (gt->name_.data() == breakName_.data()) {
+        SemError("<break> at line " + std::to_string(gt->line_) + " not inside a loop");
+    }
+    SemError("no visible label '" + std::string(gt->name_) + "' for <goto> at line " + std::to_string(gt->line_));
+}
+
+void Parser::LeaveBlock(FuncState *fs) {
+    BlockCnt* bl = fs->bl_;
+    if (bl->previous_ && bl->upval_) {
+        // a jump to the next instruction that closes the upvalues
+        int j = fs->Jump();
+        fs->PatchClose(j, bl->nactvar_);
+        fs->PatchToHere(j);
+    }
+    if (bl->isLoop_) {
+        BreakLabel();
+    }
+    fs->bl_ = bl->previous_;
+    RemoveVars(fs, bl->nactvar_);
+    fs->freereg_ = fs->nactvar_;
+    label_.resize(bl->firstLabel_);
+    if (bl->previous_) {
+        MoveGotosOut(fs, bl);
+    } else if (bl->firstGoto_ < int(gt_.size())) {
+        UndefGoto(&gt_[bl->firstGoto_]);
+    }
+}
+
+// a new function nested in the current one, owned by it from now on
+Prototype *Parser::AddPrototype() {
+    Prototype* p = new Prototype();
+    fs_->f_->protos_.push_back(p);
+    fs_->np_++;
+    return p;
+}
+
+void Parser::CodeClosure(ExpDesc *v) {
+    FuncState* fs = fs_->prev_;
+    InitExp(v, VRELOCABLE, fs->CodeABx(OP_CLOSURE, 0, fs->np_ - 1));
+    fs->Exp2NextReg(v);
+}
+
+void Parser::OpenFunc(FuncState *fs, BlockCnt *bl) {
+    fs->prev_ = fs_;
+    fs->parser_ = this;
+    fs_ = fs;
+    fs->firstLocal_ = int(actvar_.size());
+    Prototype* f = fs->f_;
+    f->lastLineDefined_ = 0;
+    f->numParams_ = 0;
+    f->isVarArg_ = 0;
+    f->maxStackSize_ = 2;   // registers 0/1 are always valid
+    f->source_ = source_;
+    EnterBlock(fs, bl, false);
+}
+
+void Parser::CloseFunc() {
+    FuncState* fs = fs_;
+    Prototype* f = fs->f_;
+    fs->Ret(0, 0);
+    LeaveBlock(fs);
+    f->lineInfo_ = LineInfo(f->lineDefined_);
+    f->lineInfo_.Reserve(fs->lines_.size());
+    for (int line : fs->lines_) {
+        f->lineInfo_.Append(uint32_t(line));
+    }
+    f->code_.shrink_to_fit();
+    f->constants_.shrink_to_fit();
+    f->upvalues_.shrink_to_fit();
+    f->protos_.shrink_to_fit();
+    f->locVars_.shrink_to_fit();
+    f->upvalueNames_.shrink_to_fit();
+    fs_ = fs->prev_;
+}
+
+bool Parser::BlockFollow(bool withUntil) {
+    switch (lex_.Type()) {
+        case TK_ELSE:
+        case TK_ELSEIF:
+        case TK_END:
+        case TK_EOS:
+            return true;
+        case TK_UNTIL:
+            return withUntil;
+        default:
+            return false;
+    }
+}
+
+// statlist -> { stat [';'] }
+void Parser::StatList() {
+    while (!BlockFollow(true)) {
+        if (lex_.Type() == TK_RETURN) {
+            Statement();
+            return;     // 'return' must be the last statement
+        }
+        Statement();
+    }
+}
+
+// fieldsel -> ['.' | ':'] NAME
+void Parser::FieldSel(ExpDesc *v) {
+    ExpDesc key;
+    fs_->Exp2AnyRegUp(v);
+    lex_.Next();
+    CheckName(&key);
+    fs_->Indexed(v, &key);
+}
+
+// index -> '[' expr ']'
+void Parser::YIndex(ExpDesc *v) {
+    lex_.Next();
+    Expr(v);
+    fs_->Exp2Val(v);
+    CheckNext(']');
+}
+
+// recfield -> (NAME | '['exp1']') = exp1
+void Parser::RecField(ConsControl *cc) {
+    int reg = fs_->freereg_;
+    ExpDesc key, val;
+    if (lex_.Type() == TK_NAME) {
+        CheckLimit(fs_, cc->nh_, INT_MAX, "items in a constructor");
+        CheckName(&key);
+    } else {
+        YIndex(&key);
+    }
+    cc->nh_++;
+    CheckNext('=');
+    int rkkey = fs_->Exp2RK(&key);
+    Expr(&val);
+    fs_->CodeABC(OP_SETTABLE, cc->t_->info_, rkkey, fs_->Exp2RK(&val));
+    fs_->freereg_ = reg;
+}
+
+void Parser::CloseListField(FuncState *fs, ConsControl *cc) {
+    if (cc->v_.k_ == VVOID) {
+        return;
+    }
+    fs->Exp2NextReg(&cc->v_);
+    cc->v_.k_ = VVOID;
+    if (cc->tostore_ == LFIELDS_PER_FLUSH) {
+        fs->SetList(cc->t_->info_, cc->na_, cc->tostore_);
+        cc->tostore_ = 0;
+    }
+}
+
+void Parser::LastListField(FuncState *fs, ConsControl *cc) {
+    if (cc->tostore_ == 0) {
+        return;
+    }
+    if (hasmultret(cc->v_.k_)) {
+        fs->SetMultRet(&cc->v_);
+        fs->SetList(cc->t_->info_, cc->na_, -1);
+        cc->na_--;  // the count of the open call is not known
+    } else {
+        if (cc->v_.k_ != VVOID) {
+            fs->Exp2NextReg(&cc->v_);
+        }
+        fs->SetList(cc->t_->info_, cc->na_, cc->tostore_);
+    }
+}
+
+// listfield -> exp
+void Parser::ListField(ConsControl *cc) {
+    Expr(&cc->v_);
+    CheckLimit(fs_, cc->na_, INT_MAX, "items in a constructor");
+    cc->na_++;
+    cc->tostore_++;
+}
+
+// field -> listfield | recfield
+void Parser::Field(ConsControl *cc) {
+    switch (lex_.Type()) {
+        case TK_NAME:
+            if (lex_.Lookahead() != '=') {
+                ListField(cc);
+            } else {
+                RecField(cc);
+            }
+            break;
+        case '[':
+            RecField(cc);
+            break;
+        default:
+            ListField(cc);
+            break;
+    }
+}
+
+// size hint of NEWTABLE as a "floating point byte" eeeeexxx
+static int IntToFb(unsigned int x) {
+    int e = 0;
+    if (x < 8) {
+        return int(x);
+    }
+    while (x >= (8 << 4)) {
+        x = (x + 0xf) >> 4;
+        e += 4;
+    }
+    while (x >= (8 << 1)) {
+        x = (x + 1) >> 1;
+        e++;
+    }
+    return ((e + 1) << 3) | (int(x) - 8);
+}
+
+// constructor -> '{' [ field { sep field } [sep] ] '}', sep -> ',' | ';'
+void Parser::Constructor(ExpDesc *t) {
+    FuncState* fs = fs_;
+    int line = lex_.Line();
+    int pc = fs->CodeABC(OP_NEWTABLE, 0, 0, 0);
+    ConsControl cc;
+    cc.na_ = cc.nh_ = cc.tostore_ = 0;
+    cc.t_ = t;
+    InitExp(t, VRELOCABLE, pc);
+    InitExp(&cc.v_, VVOID, 0);
+    fs->Exp2NextReg(t);
+    CheckNext('{');
+    do {
+        if (lex_.Type() == '}') {
+            break;
+        }
+        CloseListField(fs, &cc);
+        Field(&cc);
+    } while (TestNext(',') || TestNext(';'));
+    CheckMatch('}', '{', line);
+    LastListField(fs, &cc);
+    SETARG_B(fs->f_->code_[pc], IntToFb(cc.na_));
+    SETARG_C(fs->f_->code_[pc], IntToFb(cc.nh_));
+}
+
+// parlist -> [ param { ',' param } ]
+void Parser::ParList() {
+    FuncState* fs = fs_;
+    Prototype* f = fs->f_;
+    int nparams = 0;
+    f->isVarArg_ = 0;
+    if (lex_.Type() != ')') {
+        do {
+            switch (lex_.Type()) {
+                case TK_NAME:
+                    NewLocalVar(StrCheckName());
+                    nparams++;
+                    break;
+                case TK_DOTS:
+                    lex_.Next();
+                    f->isVarArg_ = 1;
+                    break;
+                default:
+                    lex_.SyntaxError("<name> or '...' expected");
+            }
+        } while (!f->isVarArg_ && TestNext(','));
+    }
+    AdjustLocalVars(nparams);
+    f->numParams_ = byte_t(fs->nactvar_);
+    fs->ReserveRegs(fs->nactvar_);
+}
+
+// body -> '(' parlist ')' block END
+void Parser::Body(ExpDesc *e, bool isMethod, int line) {
+    FuncState fs;
+    BlockCnt bl;
+    fs.f_ = AddPrototype();
+    fs.f_->lineDefined_ = line;
+    OpenFunc(&fs, &bl);
+    CheckNext('(');
+    if (isMethod) {
+        NewLocalVarLiteral("self");
+        AdjustLocalVars(1);
+    }
+    ParList();
+    CheckNext(')');
+    StatList();
+    fs.f_->lastLineDefined_ = lex_.Line();
+    CheckMatch(TK_END, TK_FUNCTION, line);
+    CodeClosure(e);
+    CloseFunc();
+}
+
+// explist -> expr { ',' expr }
+int Parser::ExpList(ExpDesc *v) {
+    int n = 1;
+    Expr(v);
+    while (TestNext(',')) {
+        fs_->Exp2NextReg(v);
+        Expr(v);
+        n++;
+    }
+    return n;
+}
+
+void Parser::FuncArgs(ExpDesc *f, int line) {
+    FuncState* fs = fs_;
+    ExpDesc args;
+    switch (lex_.Type()) {
+        case '(':   // funcargs -> '(' [ explist ] ')'
+            lex_.Next();
+            if (lex_.Type() == ')') {
+                args.k_ = VVOID;
+            } else {
+                ExpList(&args);
+                fs->SetMultRet(&args);
+            }
+            CheckMatch(')', '(', line);
+            break;
+        case '{':   // funcargs -> constructor
+            Constructor(&args);
+            break;
+        case TK_STRING:
+            CodeString(&args, lex_.Current().s_);
+            lex_.Next();
+            break;
+        default:
+            lex_.SyntaxError("function arguments expected");
+    }
+    int base = f->info_;    // the function is in a register
+    int nparams;
+    if (hasmultret(args.k_)) {
+        nparams = -1;
+    } else {
+        if (args.k_ != VVOID) {
+            fs->Exp2NextReg(&args);
+        }
+        nparams = fs->freereg_ - (base + 1);
+    }
+    InitExp(f, VCALL, fs->CodeABC(OP_CALL, base, nparams + 1, 2));
+    fs->FixLine(line);
+    fs->freereg_ = base + 1;    // the call leaves one result unless changed later
+}
+
+// primaryexp -> NAME | '(' expr ')'
+void Parser::PrimaryExp(ExpDesc *v) {
+    switch (lex_.Type()) {
+        case '(': {
+            int line = lex_.Line();
+            lex_.Next();
+            Expr(v);
+            CheckMatch(')', '(', line);
+            fs_->DischargeVars(v);
+            return;
+        }
+        case TK_NAME:
+            SingleVar(v);
+            return;
+        default:
+            lex_.SyntaxError("unexpected symbol");
+    }
+}
+
+// suffixedexp -> primaryexp { '.' NAME | '[' exp ']' | ':' NAME funcargs | funcargs }
+void Parser::SuffixedExp(ExpDesc *v) {
+    FuncState* fs = fs_;
+    int line = lex_.Line();
+    PrimaryExp(v);
+    for (;;) {
+        switch (lex_.Type()) {
+            case '.':
+                FieldSel(v);
+                break;
+            case '[': {
+                ExpDesc key;
+                fs->Exp2AnyRegUp(v);
+                YIndex(&key);
+                fs->Indexed(v, &key);
+                break;
+            }
+            case ':': {
+                ExpDesc key;
+                lex_.Next();
+                CheckName(&key);
+                fs->Self(v, &key);
+                FuncArgs(v, line);
+                break;
+            }
+            case '(':
+            case TK_STRING:
+            case '{':
+                fs->Exp2NextReg(v);
+                FuncArgs(v, line);
+                break;
+            default:
+                return;
+        }
+    }
+}
+
+// simpleexp -> FLT | INT | STRING | NIL | TRUE | FALSE | ... | constructor | FUNCTION body | suffixedexp
+void Parser::SimpleExp(ExpDesc *v) {
+    switch (lex_.Type()) {
+        case TK_FLT:
+            InitExp(v, VKFLT, 0);
+            v->nval_ = lex_.Current().n_;
+            break;
+        case TK_INT:
+            InitExp(v, VKINT, 0);
+            v->ival_ = lex_.Current().i_;
+            break;
+        case TK_STRING:
+            CodeString(v, lex_.Current().s_);
+            break;
+        case TK_NIL:
+            InitExp(v, VNIL, 0);
+            break;
+        case TK_TRUE:
+            InitExp(v, VTRUE, 0);
+            break;
+        case TK_FALSE:
+            InitExp(v, VFALSE, 0);
+            break;
+        case TK_DOTS:
+            CheckCondition(fs_->f_->isVarArg_, "cannot use '...' outside a vararg function");
+            InitExp(v, VVARARG, fs_->CodeABC(OP_VARARG, 0, 1, 0));
+            break;
+        case '{':
+            Constructor(v);
+            return;
+        case TK_FUNCTION:
+            lex_.Next();
+            Body(v, false, lex_.Line());
+            return;
+        default:
+            SuffixedExp(v);
+            return;
+    }
+    lex_.Next();
+}
+
+static UnOpr GetUnOpr(int op) {
+    switch (op) {
+        case TK_NOT: return OPR_NOT;
+        case '-':    return OPR_MINUS;
+        case '~':    return OPR_BNOT;
+        case '#':    return OPR_LEN;
+        default:     return OPR_NOUNOPR;
+    }
+}
+
+static BinOpr GetBinOpr(int op) {
+    switch (op) {
+        case '+':       return OPR_ADD;
+        case '-':       return OPR_SUB;
+        case '*':       return OPR_MUL;
+        case '%':       return OPR_MOD;
+        case '^':       return OPR_POW;
+        case '/':       return OPR_DIV;
+        case TK_IDIV:   return OPR_IDIV;
+        case '&':       return OPR_BAND;
+        case '|':       return OPR_BOR;
+        case '~':       return OPR_BXOR;
+        case TK_SHL:    return OPR_SHL;
+        case TK_SHR:    return OPR_SHR;
+        case TK_CONCAT: return OPR_CONCAT;
+        case TK_NE:     return OPR_NE;
+        case TK_EQ:     return OPR_EQ;
+        case '<':       return OPR_LT;
+        case TK_LE:     return OPR_LE;
+        case '>':       return OPR_GT;
+        case TK_GE:     return OPR_GE;
+        case TK_AND:    return OPR_AND;
+        case TK_OR:     return OPR_OR;
+        default:        return OPR_NOBINOPR;
+    }
+}
+
+// left and right priority of each binary operator, in BinOpr order
+static const struct {
+    byte_t left_;
+    byte_t right_;
+} priority[] = {
+        {10, 10}, {10, 10},         // '+' '-'
+        {11, 11}, {11, 11},         // '*' '%'
+        {14, 13},                   // '^' (right associative)
+        {11, 11}, {11, 11},         // '/' '//'
+        {6, 6}, {4, 4}, {5, 5},     // '&' '|' '~'
+        {7, 7}, {7, 7},             // '<<' '>>'
+        {9, 8},                     // '..' (right associative)
+        {3, 3}, {3, 3}, {3, 3},     // ==, <, <=
+        {3, 3}, {3, 3}, {3, 3},     // ~=, >, >=
+        {2, 2}, {1, 1}              // and, or
+};
+
+/*
+ * subexpr -> (simpleexp | unop subexpr) { binop subexpr }, where binop
+ * is any binary operator with a priority higher than limit. Returns
+ * the first operator that was not handled.
+ */
+BinOpr Parser::SubExpr(ExpDesc *v, int limit) {
+    EnterLevel();
+    UnOpr uop = GetUnOpr(lex_.Type());
+    if (uop != OPR_NOUNOPR) {
+        int line = lex_.Line();
+        lex_.Next();
+        SubExpr(v, UNARY_PRIORITY);
+        fs_->Prefix(uop, v, line);
+    } else {
+        SimpleExp(v);
+    }
+    BinOpr op = GetBinOpr(lex_.Type());
+    while (op != OPR_NOBINOPR && priority[op].left_ > limit) {
+        ExpDesc v2;
+        int line = lex_.Line();
+        lex_.Next();
+        fs_->Infix(op, v);
+        BinOpr nextOp = SubExpr(&v2, priority[op].right_);
+        fs_->Posfix(op, v, &v2, line);
+        op = nextOp;
+    }
+    LeaveLevel();
+    return op;
+}
+
+void Parser::Block() {
+    BlockCnt bl;
+    EnterBlock(fs_, &bl, false);
+    StatList();
+    LeaveBlock(fs_);
+}
+
+/*
+ * In a multiple assignment, a table or index of a previous target that
+ * is the local (or upvalue) v being assigned now must keep its old
+ * value: copy it to a free register and use that one.
+ */
+void Parser::CheckConflict(LhsAssign *lh, ExpDesc *v) {
+    FuncState* fs = fs_;
+    int extra = fs->freereg_;
+    bool conflict = false;
+    for (; lh; lh = lh->prev_) {
+        if (lh->v_.k_ == VINDEXED) {
+            if (lh->v_.ind_.vt_ == v->k_ && lh->v_.ind_.t_ == v->info_) {
+                conflict = true;
+                lh->v_.ind_.vt_ = VLOCAL;
+                lh->v_.ind_.t_ = byte_t(extra);
+            }
+            if (v->k_ == VLOCAL && lh->v_.ind_.idx_ == v->info_) {
+                conflict = true;
+                lh->v_.ind_.idx_ = short(extra);
+            }
+        }
+    }
+    if (conflict) {
+        fs->CodeABC(v->k_ == VLOCAL ? OP_MOVE : OP_GETUPVAL, extra, v->info_, 0);
+        fs->ReserveRegs(1);
+    }
+}
+
+// assignment -> ',' suffixedexp assignment | '=' explist
+void Parser::Assignment(LhsAssign *lh, int nvars) {
+    ExpDesc e;
+    CheckCondition(vkisvar(lh->v_.k_), "syntax error");
+    if (TestNext(',')) {
+        LhsAssign nv;
+        nv.prev_ = lh;
+        SuffixedExp(&nv.v_);
+        if (nv.v_.k_ != VINDEXED) {
+            CheckConflict(lh, &nv.v_);
+        }
+        CheckLimit(fs_, nvars + level_, MAXCCALLS, "C levels");
+        Assignment(&nv, nvars + 1);
+    } else {
+        CheckNext('=');
+        int nexps = ExpList(&e);
+        if (nexps != nvars) {
+            AdjustAssign(nvars, nexps, &e);
+        } else {
+            fs_->SetOneRet(&e);
+            fs_->StoreVar(&lh->v_, &e);
+            return;
+        }
+    }
+    InitExp(&e, VNONRELOC, fs_->freereg_ - 1);  // default assignment
+    fs_->StoreVar(&lh->v_, &e);
+}
+
+// cond -> exp, returns the jumps taken when it is false
+int Parser::Cond() {
+    ExpDesc v;
+    Expr(&v);
+    if (v.k_ == VNIL) {
+        v.k_ = VFALSE;
+    }
+    fs_->GoIfTrue(&v);
+    return v.f_;
+}
+
+void Parser::GotoStat(int pc) {
+    int line = lex_.Line();
+    std::string_view label;
+    if (TestNext(TK_GOTO)) {
+        label = StrCheckName();
+    } else {
+        lex_.Next();    // break
+        label = breakName_;
+    }
+    int g = NewLabelEntry(&gt_, label, line, pc);
+    FindLabel(g);   // close it if the label is already visible
+}
+
+void Parser::CheckRepeated(FuncState *fs, std::string_view label) {
+    for (size_t i = fs->bl_->firstLabel_; i < label_.size(); i++) {
+        if (label_[i].name_.data() == label.data()) {
+            SemError("label '" + std::string(label) + "' already defined on line " +
+                     std::to_string(label_[i].line_));
+        }
+    }
+}
+
+void Parser::SkipNoopStat() {
+    while (lex_.Type() == ';' || lex_.Type() == TK_DBCOLON) {
+        Statement();
+    }
+}
+
+// label -> '::' NAME '::'
+void Parser::LabelStat(std::string_view label, int line) {
+    CheckRepeated(fs_, label);
+    CheckNext(TK_DBCOLON);
+    int l = NewLabelEntry(&label_, label, line, fs_->GetLabel());
+    SkipNoopStat();
+    if (BlockFollow(false)) {
+        // the last statement of the block: its locals are out of scope
+        label_[l].nactvar_ = fs_->bl_->nactvar_;
+    }
+    FindGotos(&label_[l]);
+}
+
+// whilestat -> WHILE cond DO block END
+void Parser::WhileStat(int line) {
+    FuncState* fs = fs_;
+    BlockCnt bl;
+    lex_.Next();
+    int whileInit = fs->GetLabel();
+    int condExit = Cond();
+    EnterBlock(fs, &bl, true);
+    CheckNext(TK_DO);
+    Block();
+    fs->PatchList(fs->Jump(), whileInit);
+    CheckMatch(TK_END, TK_WHILE, line);
+    LeaveBlock(fs);
+    fs->PatchToHere(condExit);
+}
+
+// repeatstat -> REPEAT block UNTIL cond
+void Parser::RepeatStat(int line) {
+    FuncState* fs = fs_;
+    int repeatInit = fs->GetLabel();
+    BlockCnt bl1, bl2;
+    EnterBlock(fs, &bl1, true);     // loop block
+    EnterBlock(fs, &bl2, false);    // scope block
+    lex_.Next();
+    StatList();
+    CheckMatch(TK_UNTIL, TK_REPEAT, line);
+    int condExit = Cond();  // the condition sees the locals of the body
+    if (bl2.upval_) {
+        fs->PatchClose(condExit, bl2.nactvar_);
+    }
+    LeaveBlock(fs);
+    fs->PatchList(condExit, repeatInit);
+    LeaveBlock(fs);
+}
+
+int Parser::Exp1() {
+    ExpDesc e;
+    Expr(&e);
+    fs_->Exp2NextReg(&e);
+    return e.info_;
+}
+
+// forbody -> DO block
+void Parser::ForBody(int base, int line, int nvars, bool isNum) {
+    BlockCnt bl;
+    FuncState* fs = fs_;
+    AdjustLocalVars(3);     // control variables
+    CheckNext(TK_DO);
+    int prep = isNum ? fs->CodeAsBx(OP_FORPREP, base, NO_JUMP) : fs->Jump();
+    EnterBlock(fs, &bl, false);     // scope of the declared variables
+    AdjustLocalVars(nvars);
+    fs->ReserveRegs(nvars);
+    Block();
+    LeaveBlock(fs);
+    fs->PatchToHere(prep);
+    int endFor;
+    if (isNum) {
+        endFor = fs->CodeAsBx(OP_FORLOOP, base, NO_JUMP);
+    } else {
+        fs->CodeABC(OP_TFORCALL, base, 0, nvars);
+        fs->FixLine(line);
+        endFor = fs->CodeAsBx(OP_TFORLOOP, base + 2, NO_JUMP);
+    }
+    fs->PatchList(endFor, prep + 1);
+    fs->FixLine(line);
+}
+
+// fornum -> NAME = exp1,exp1[,exp1] forbody
+void Parser::ForNum(std::string_view varName, int line) {
+    FuncState* fs = fs_;
+    int base = fs->freereg_;
+    NewLocalVarLiteral("(for index)");
+    NewLocalVarLiteral("(for limit)");
+    NewLocalVarLiteral("(for step)");
+    NewLocalVar(varName);
+    CheckNext('=');
+    Exp1();     // initial value
+    CheckNext(',');
+    Exp1();     // limit
+    if (TestNext(',')) {
+        Exp1();
+    } else {
+        fs->CodeK(fs->freereg_, fs->IntK(1));
+        fs->ReserveRegs(1);
+    }
+    ForBody(base, line, 1, true);
+}
+
+// forlist -> NAME {,NAME} IN explist forbody
+void Parser::ForList(std::string_view indexName) {
+    FuncState* fs = fs_;
+    ExpDesc e;
+    int nvars = 4;  // generator, state, control and at least one variable
+    int base = fs->freereg_;
+    NewLocalVarLiteral("(for generator)");
+    NewLocalVarLiteral("(for state)");
+    NewLocalVarLiteral("(for control)");
+    NewLocalVar(indexName);
+    while (TestNext(',')) {
+        NewLocalVar(StrCheckName());
+        nvars++;
+    }
+    CheckNext(TK_IN);
+    int line = lex_.Line();
+    AdjustAssign(3, ExpList(&e), &e);
+    fs->CheckStack(3);  // room to call the generator
+    ForBody(base, line, nvars - 3, false);
+}
+
+// forstat -> FOR (fornum | forlist) END
+void Parser::ForStat(int line) {
+    FuncState* fs = fs_;
+    BlockCnt bl;
+    EnterBlock(fs, &bl, true);  // scope of the loop and its control variables
+    lex_.Next();
+    std::string_view varName = StrCheckName();
+    switch (lex_.Type()) {
+        case '=':
+            ForNum(varName, line);
+            break;
+        case ',':
+        case TK_IN:
+            ForList(varName);
+            break;
+        default:
+            lex_.SyntaxError("'=' or 'in' expected");
+    }
+    CheckMatch(TK_END, TK_FOR, line);
+    LeaveBlock(fs);
+}
+
+// test_then_block -> [IF | ELSEIF] cond THEN block
+void Parser::TestThenBlock(int *escapeList) {
+    BlockCnt bl;
+    FuncState* fs = fs_;
+    ExpDesc v;
+    int jf;     // jumps over the 'then' part when the condition is false
+    lex_.Next();
+    Expr(&v);
+    CheckNext(TK_THEN);
+    if (lex_.Type() == TK_GOTO || lex_.Type() == TK_BREAK) {
+        fs->GoIfFalse(&v);  // jumps to the label if the condition is true
+        EnterBlock(fs, &bl, false);
+        GotoStat(v.t_);
+        while (TestNext(';')) {}
+        if (BlockFollow(false)) {
+            LeaveBlock(fs);
+            return;     // the goto is the whole block
+        }
+        jf = fs->Jump();
+    } else {
+        fs->GoIfTrue(&v);
+        EnterBlock(fs, &bl, false);
+        jf = v.f_;
+    }
+    StatList();
+    LeaveBlock(fs);
+    if (lex_.Type() == TK_ELSE || lex_.Type() == TK_ELSEIF) {
+        fs->Concat(escapeList, fs->Jump());
+    }
+    fs->PatchToHere(jf);
+}
+
+// ifstat -> IF cond THEN block {ELSEIF cond THEN block} [ELSE block] END
+void Parser::IfStat(int line) {
+    int escapeList = NO_JUMP;
+    TestThenBlock(&escapeList);
+    while (lex_.Type() == TK_ELSEIF) {
+        TestThenBlock(&escapeList);
+    }
+    if (TestNext(TK_ELSE)) {
+        Block();
+    }
+    CheckMatch(TK_END, TK_IF, line);
+    fs_->PatchToHere(escapeList);
+}
+
+void Parser::LocalFunc() {
+    ExpDesc b;
+    FuncState* fs = fs_;
+    NewLocalVar(StrCheckName());
+    AdjustLocalVars(1);     // the function can refer to itself
+    Body(&b, false, lex_.Line());
+    // the debug info only sees the variable from here
+    GetLocVar(fs, b.info_)->startPC_ = fs->pc_;
+}
+
+// stat -> LOCAL NAME {',' NAME} ['=' explist]
+void Parser::LocalStat() {
+    int nvars = 0;
+    int nexps;
+    ExpDesc e;
+    do {
+        NewLocalVar(StrCheckName());
+        nvars++;
+    } while (TestNext(','));
+    if (TestNext('=')) {
+        nexps = ExpList(&e);
+    } else {
+        e.k_ = VVOID;
+        nexps = 0;
+    }
+    AdjustAssign(nvars, nexps, &e);
+    AdjustLocalVars(nvars);
+}
+
+// funcname -> NAME {fieldsel} [':' NAME]
+bool Parser::FuncName(ExpDesc *v) {
+    bool isMethod = false;
+    SingleVar(v);
+    while (lex_.Type() == '.') {
+        FieldSel(v);
+    }
+    if (lex_.Type() == ':') {
+        isMethod = true;
+        FieldSel(v);
+    }
+    return isMethod;
+}
+
+// funcstat -> FUNCTION funcname body
+void Parser::FuncStat(int line) {
+    ExpDesc v, b;
+    lex_.Next();
+    bool isMethod = FuncName(&v);
+    Body(&b, isMethod, line);
+    fs_->StoreVar(&v, &b);
+    fs_->FixLine(line);     // the definition happens on the first line
+}
+
+// stat -> func | assignment
+void Parser::ExprStat() {
+    LhsAssign v;
+    SuffixedExp(&v.v_);
+    if (lex_.Type() == '=' || lex_.Type() == ',') {
+        v.prev_ = nullptr;
+        Assignment(&v, 1);
+    } else {
+        CheckCondition(v.v_.k_ == VCALL, "syntax error");
+        SETARG_C(fs_->Instr(&v.v_), 1);    // the call statement uses no results
+    }
+}
+
+// stat -> RETURN [explist] [';']
+void Parser::RetStat() {
+    FuncState* fs = fs_;
+    ExpDesc e;
+    int first, nret;
+    if (BlockFollow(true) || lex_.Type() == ';') {
+        first = nret = 0;
+    } else {
+        nret = ExpList(&e);
+        if (hasmultret(e.k_)) {
+            fs->SetMultRet(&e);
+            if (e.k_ == VCALL && nret == 1) {
+                SET_OPCODE(fs->Instr(&e), OP_TAILCALL);
+            }
+            first = fs->nactvar_;
+            nret = -1;
+        } else if (nret == 1) {
+            first = fs->Exp2AnyReg(&e);
+        } else {
+            fs->Exp2NextReg(&e);    // the values must be on the stack
+            first = fs->nactvar_;
+        }
+    }
+    fs->Ret(first, nret);
+    TestNext(';');
+}
+
+void Parser::Statement() {
+    int line = lex_.Line();
+    EnterLevel();
+    switch (lex_.Type()) {
+        case ';':
+            lex_.Next();
+            break;
+        case TK_IF:
+            IfStat(line);
+            break;
+        case TK_WHILE:
+            WhileStat(line);
+            break;
+        case TK_DO:
+            lex_.Next();
+            Block();
+            CheckMatch(TK_END, TK_DO, line);
+            break;
+        case TK_FOR:
+            ForStat(line);
+            break;
+        case TK_REPEAT:
+            RepeatStat(line);
+            break;
+        case TK_FUNCTION:
+            FuncStat(line);
+            break;
+        case TK_LOCAL:
+            lex_.Next();
+            if (TestNext(TK_FUNCTION)) {
+                LocalFunc();
+            } else {
+                LocalStat();
+            }
+            break;
+        case TK_DBCOLON:
+            lex_.Next();
+            LabelStat(StrCheckName(), line);
+            break;
+        case TK_RETURN:
+            lex_.Next();
+            RetStat();
+            break;
+        case TK_BREAK:
+        case TK_GOTO:
+            GotoStat(fs_->Jump());
+            break;
+        default:
+            ExprStat();
+            break;
+    }
+    fs_->freereg_ = fs_->nactvar_;  // free the registers of temporaries
+    LeaveLevel();
+}
+
+// the main function is vararg and has _ENV as its only upvalue
+void Parser::MainFunc(FuncState *fs) {
+    BlockCnt bl;
+    ExpDesc v;
+    fs->f_->lineDefined_ = 0;
+    OpenFunc(fs, &bl);
+    fs->f_->isVarArg_ = 1;
+    InitExp(&v, VLOCAL, 0);
+    NewUpvalue(fs, envName_, &v);
+    lex_.Next();
+    StatList();
+    Check(TK_EOS);
+    CloseFunc();
+}
@@ -0,0 +1,589 @@
+#include "snapshot.h"
+#include "chunk.h"
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <unordered_map>
+
+MappedFile::MappedFile(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("cannot open ") + path + ": " + strerror(errno));
+    }
+    struct stat st{};
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        throw std::runtime_error(std::string("cannot map ") + path);
+    }
+    size_ = size_t(st.st_size);
+    void* p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        throw std::runtime_error(std::string("cannot map ") + path + ": " + strerror(errno));
+    }
+    data_ = static_cast<char*>(p);
+}
+
+MappedFile::~MappedFile() {
+    munmap(data_, size_);
+}
+
+/*
+ * Image layout, every record 8 byte aligned:
+ *
+ *      ImageHeader | chunks (luac format) | objects | chunk table | object offsets
+ *
+ * A value referring to an object holds its index in the object offsets.
+ */
+namespace {
+
+constexpr char kMagic[8] = {'L', 'U', 'A', 'V', 'M', 'I', 'M', 'G'};
+constexpr uint32_t kVersion = 2;
+constexpr uint32_t kNone = UINT32_MAX;
+
+struct ImageHeader {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t nchunks_;
+    uint32_t nobjects_;
+    uint32_t globals_;      // object index of the globals table
+    uint32_t stringMeta_;   // object index, or kNone
+    uint32_t nstrings_;
+    uint64_t code_;         // fingerprint of the code natives are relative to
+    uint64_t chunks_;       // offset of ImageChunk[nchunks_]
+    uint64_t objects_;      // offset of uint64_t[nobjects_]
+    uint64_t size_;
+};
+
+struct ImageChunk {
+    uint64_t offset_;
+    uint64_t size_;
+};
+
+struct ImageValue {
+    uint64_t type_;
+    uint64_t payload_;      // bits of the value, or an object index
+};
+
+struct ImageObject {
+    uint32_t type_;
+    uint32_t count_;        // entries following the record
+};
+
+// followed by len_ + 1 bytes
+struct ImageString {
+    ImageObject head_;
+    uint64_t len_;
+};
+
+// followed by count_ key/value pairs
+struct ImageTable {
+    ImageObject head_;
+    uint32_t metatable_;
+    uint32_t narray_;
+};
+
+// followed by count_ UpVal indices
+struct ImageLuaClosure {
+    ImageObject head_;
+    uint32_t chunk_;
+    uint32_t proto_;        // preorder index in the chunk
+};
+
+struct ImageUpVal {
+    ImageObject head_;
+    ImageValue value_;
+};
+
+// followed by count_ upvalues, then nameLen_ + 1 bytes
+struct ImageNative {
+    ImageObject head_;
+    uint32_t nameLen_;
+    uint32_t hasTarget_;
+    int64_t fn_;
+    int64_t target_;
+};
+
+// native functions are stored as their distance to this one
+void Anchor() {}
+
+/*
+ * The executable segment holding Anchor, i.e. the code of the program
+ * this library is linked into. It is identified by the build-id of the
+ * program, or by a hash of the segment if it was linked without one.
+ */
+struct CodeSegment {
+    uintptr_t begin_ = 0;
+    uintptr_t end_ = 0;
+    uint64_t fingerprint_ = 0;
+
+    template<typename F>
+    bool Contains(F* f) const {
+        auto p = reinterpret_cast<uintptr_t>(f);
+        return begin_ <= p && p < end_;
+    }
+};
+
+uint64_t Fnv1a(const void* data, size_t n) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ static_cast<const unsigned char*>(data)[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+bool BuildId(const dl_phdr_info* info, uint64_t* id) {
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+        if (ph.p_type != PT_NOTE) {
+            continue;
+        }
+        const char* p = reinterpret_cast<const char*>(info->dlpi_addr + ph.p_vaddr);
+        const char* end = p + ph.p_memsz;
+        while (p + sizeof(ElfW(Nhdr)) <= end) {
+            const auto* note = reinterpret_cast<const ElfW(Nhdr)*>(p);
+            const char* name = p + sizeof(ElfW(Nhdr));
+            const char* desc = name + ((note->n_namesz + 3) & ~3u);
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0) {
+                *id = Fnv1a(desc, note->n_descsz);
+                return true;
+            }
+            p = desc + ((note->n_descsz + 3) & ~3u);
+        }
+    }
+    return false;
+}
+
+int FindCode(dl_phdr_info* info, size_t, void* data) {
+    auto code = static_cast<CodeSegment*>(data);
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+        uintptr_t begin = info->dlpi_addr + ph.p_vaddr;
+        if (ph.p_type != PT_LOAD || !(ph.p_flags & PF_X)) {
+            continue;
+        }
+        code->begin_ = begin;
+        code->end_ = begin + ph.p_memsz;
+        if (!code->Contains(&Anchor)) {
+            continue;
+        }
+        if (!BuildId(info, &code->fingerprint_)) {
+            code->fingerprint_ = Fnv1a(reinterpret_cast<const void*>(begin), ph.p_filesz);
+        }
+        return 1;
+    }
+    code->begin_ = code->end_ = 0;
+    return 0;
+}
+
+const CodeSegment& Code() {
+    static const CodeSegment code = [] {
+        CodeSegment c;
+        if (dl_iterate_phdr(FindCode, &c) == 0) {
+            throw std::runtime_error("cannot locate the code of the executable");
+        }
+        return c;
+    }();
+    return code;
+}
+
+template<typename F>
+int64_t CodeOffset(F* f) {
+    return int64_t(reinterpret_cast<intptr_t>(f) - reinterpret_cast<intptr_t>(&Anchor));
+}
+
+template<typename F>
+F* CodeAt(int64_t offset) {
+    return reinterpret_cast<F*>(reinterpret_cast<intptr_t>(&Anchor) + intptr_t(offset));
+}
+
+template<typename T>
+void Append(std::string* out, const T& v) {
+    out->append(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+void Align(std::string* out) {
+    out->resize((out->size() + 7) & ~size_t(7), '\0');
+}
+
+void NumberProtos(Prototype* p, uint32_t chunk,
+                  std::unordered_map<Prototype*, std::pair<uint32_t, uint32_t>>* index,
+                  std::vector<Prototype*>* preorder) {
+    (*index)[p] = {chunk, uint32_t(preorder->size())};
+    preorder->push_back(p);
+    for (auto sub:p->Protos()) {
+        NumberProtos(sub, chunk, index, preorder);
+    }
+}
+
+/*
+ * Objects in the order they are written, each one is numbered the first
+ * time a reference to it is seen.
+ */
+class ObjectList {
+public:
+    uint32_t Index(GCObject* o) {
+        auto it = index_.find(o);
+        if (it != index_.end()) {
+            return it->second;
+        }
+        auto i = uint32_t(order_.size());
+        index_.emplace(o, i);
+        order_.push_back(o);
+        return i;
+    }
+    ImageValue Value(const LuaValue& v) {
+        ImageValue iv{uint64_t(v.type_), 0};
+        if (v.IsCollectable()) {
+            iv.payload_ = Index(v.gc_);
+        } else if (v.type_ == ValueType::Boolean) {
+            iv.payload_ = v.b_ ? 1 : 0;
+        } else {
+            memcpy(&iv.payload_, &v.i_, sizeof(iv.payload_));
+        }
+        return iv;
+    }
+    std::vector<GCObject*> order_;
+private:
+    std::unordered_map<GCObject*, uint32_t> index_;
+};
+
+/*
+ * Bounds checked view of a mapped image
+ */
+class Image {
+public:
+    Image(const char* data, size_t size): data_(data), size_(size) {}
+    template<typename T>
+    const T* At(uint64_t offset, uint64_t count = 1) const {
+        if (offset % alignof(T) != 0 || offset > size_ || count > (size_ - offset) / sizeof(T)) {
+            throw std::runtime_error("corrupt snapshot");
+        }
+        return reinterpret_cast<const T*>(data_ + offset);
+    }
+    const char* Bytes(uint64_t offset, uint64_t n) const {
+        if (offset > size_ || n > size_ - offset) {
+            throw std::runtime_error("corrupt snapshot");
+        }
+        return data_ + offset;
+    }
+    // n bytes followed by a NUL
+    const char* String(uint64_t offset, uint64_t n) const {
+        if (n >= size_) {
+            throw std::runtime_error("corrupt snapshot");
+        }
+        const char* s = Bytes(offset, n + 1);
+        if (s[n] != '\0') {
+            throw std::runtime_error("corrupt snapshot");
+        }
+        return s;
+    }
+private:
+    const char* data_;
+    size_t size_;
+};
+
+class ObjectTable {
+public:
+    GCObject* Get(uint32_t i, ValueType type) const {
+        if (i >= objects_.size() || objects_[i]->type_ != type) {
+            throw std::runtime_error("corrupt snapshot");
+        }
+        return objects_[i];
+    }
+    LuaValue Value(const ImageValue& iv) const {
+        auto type = ValueType(iv.type_);
+        switch (type) {
+            case ValueType::Nil:
+                return {};
+            case ValueType::Boolean:
+                return LuaValue::Boolean(iv.payload_ != 0);
+            case ValueType::Integer:
+            case ValueType::Number: {
+                LuaValue v;
+                v.type_ = type;
+                memcpy(&v.i_, &iv.payload_, sizeof(v.i_));
+                return v;
+            }
+            case ValueType::String:
+            case ValueType::Table:
+            case ValueType::LuaFunction:
+            case ValueType::NativeFunction:
+                return LuaValue::Object(Get(uint32_t(iv.payload_), type));
+            default:
+                throw std::runtime_error("corrupt snapshot");
+        }
+    }
+    std::vector<GCObject*> objects_;
+};
+
+}
+
+void Snapshot::Save(LuaState *L, const char *path) {
+    if (L->ci_ != L->cis_.get() || L->openUpval_) {
+        throw std::runtime_error("cannot snapshot a running state");
+    }
+    std::string out(sizeof(ImageHeader), '\0');
+
+    std::vector<ImageChunk> chunks;
+    std::unordered_map<Prototype*, std::pair<uint32_t, uint32_t>> protos;
+    for (size_t i = 0; i < L->chunks_.size(); ++i) {
+        std::vector<Prototype*> preorder;
+        NumberProtos(L->chunks_[i]->MainFunc(), uint32_t(i), &protos, &preorder);
+        Align(&out);
+        ImageChunk c{out.size(), 0};
+        ChunkWriter(&out).WriteChunk(L->chunks_[i]->MainFunc());
+        c.size_ = out.size() - c.offset_;
+        chunks.push_back(c);
+    }
+
+    ObjectList objs;
+    uint32_t globals = objs.Index(L->globals_);
+    uint32_t stringMeta = L->stringMeta_ ? objs.Index(L->stringMeta_) : kNone;
+    std::vector<uint64_t> offsets;
+    std::vector<std::pair<ImageValue, ImageValue>> pairs;
+    // order_ grows while the references of each object are numbered
+    for (size_t i = 0; i < objs.order_.size(); ++i) {
+        GCObject* o = objs.order_[i];
+        Align(&out);
+        offsets.push_back(out.size());
+        switch (o->type_) {
+            case ValueType::String: {
+                auto s = static_cast<StringObject*>(o);
+                Append(&out, ImageString{{uint32_t(o->type_), 0}, s->size()});
+                out.append(s->data(), s->size());
+                out.push_back('\0');
+                break;
+            }
+            case ValueType::Table: {
+                auto t = static_cast<LuaTable*>(o);
+                pairs.clear();
+                LuaValue key, val;
+                while (t->Next(&key, &val)) {
+                    pairs.emplace_back(objs.Value(key), objs.Value(val));
+                }
+                uint32_t mt = t->metatable_ ? objs.Index(t->metatable_) : kNone;
+                Append(&out, ImageTable{{uint32_t(o->type_), uint32_t(pairs.size())},
+                                        mt, uint32_t(t->ArraySize())});
+                for (auto& kv:pairs) {
+                    Append(&out, kv.first);
+                    Append(&out, kv.second);
+                }
+                break;
+            }
+            case ValueType::LuaFunction: {
+                auto cl = static_cast<LuaClosure*>(o);
+                auto it = protos.find(cl->proto_);
+                if (it == protos.end()) {
+                    throw std::runtime_error("cannot snapshot a function of an unloaded chunk");
+                }
+                Append(&out, ImageLuaClosure{{uint32_t(o->type_), cl->nupvals_},
+                                             it->second.first, it->second.second});
+                for (uint32_t k = 0; k < cl->nupvals_; ++k) {
+                    Append(&out, cl->upvals_[k] ? objs.Index(cl->upvals_[k]) : kNone);
+                }
+                break;
+            }
+            case ValueType::UpVal: {
+                auto uv = static_cast<UpVal*>(o);
+                Append(&out, ImageUpVal{{uint32_t(o->type_), 0}, objs.Value(uv->closed_)});
+                break;
+            }
+            case ValueType::NativeFunction: {
+                auto f = static_cast<NativeClosure*>(o);
+                if (!Code().Contains(f->fn_) || (f->target_ && !Code().Contains(f->target_))) {
+                    throw std::runtime_error(std::string("cannot snapshot native function '") + f->name_ +
+                                             "' outside the executable");
+                }
+                Append(&out, ImageNative{{uint32_t(o->type_), uint32_t(f->upvals_.size())},
+                                         uint32_t(strlen(f->name_)), f->target_ != nullptr,
+                                         CodeOffset(f->fn_),
+                                         f->target_ ? CodeOffset(f->target_) : 0});
+                for (auto& v:f->upvals_) {
+                    Append(&out, objs.Value(v));
+                }
+                out.append(f->name_, strlen(f->name_) + 1);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    ImageHeader h{};
+    memcpy(h.magic_, kMagic, sizeof(kMagic));
+    h.version_ = kVersion;
+    h.nchunks_ = uint32_t(chunks.size());
+    h.nobjects_ = uint32_t(offsets.size());
+    h.globals_ = globals;
+    h.stringMeta_ = stringMeta;
+    h.nstrings_ = uint32_t(std::count_if(objs.order_.begin(), objs.order_.end(),
+                                         [](GCObject* o) { return o->type_ == ValueType::String; }));
+    h.code_ = Code().fingerprint_;
+    Align(&out);
+    h.chunks_ = out.size();
+    out.append(reinterpret_cast<const char*>(chunks.data()), chunks.size() * sizeof(ImageChunk));
+    h.objects_ = out.size();
+    out.append(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+    h.size_ = out.size();
+    memcpy(&out[0], &h, sizeof(h));
+
+    FILE* f = fopen(path, "wb");
+    if (f == nullptr) {
+        throw std::runtime_error(std::string("cannot open ") + path + ": " + strerror(errno));
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        throw std::runtime_error(std::string("cannot write ") + path);
+    }
+}
+
+/*
+ * Objects are created first and filled in a second pass, so that
+ * references can go in any direction.
+ */
+void Snapshot::Restore(LuaState *L, const char *path) {
+    std::unique_ptr<MappedFile> file(new MappedFile(path));
+    Image image(file->Data(), file->Size());
+    const auto* h = image.At<ImageHeader>(0);
+    if (memcmp(h->magic_, kMagic, sizeof(kMagic)) != 0 || h->version_ != kVersion
+        || h->size_ != file->Size()) {
+        throw std::runtime_error(std::string(path) + ": not a snapshot");
+    }
+    if (h->code_ != Code().fingerprint_) {
+        throw std::runtime_error(std::string(path) + ": snapshot of another executable");
+    }
+    // chunks and strings are used in place from here on
+    L->images_.push_back(std::move(file));
+
+    std::vector<std::vector<Prototype*>> protos(h->nchunks_);
+    const auto* chunks = image.At<ImageChunk>(h->chunks_, h->nchunks_);
+    for (uint32_t i = 0; i < h->nchunks_; ++i) {
+        auto chunk = new Chunk(image.Bytes(chunks[i].offset_, chunks[i].size_), chunks[i].size_,
+                               DebugInfo::Lazy);
+        L->chunks_.emplace_back(chunk);
+        L->BindProto(chunk->MainFunc());
+        std::unordered_map<Prototype*, std::pair<uint32_t, uint32_t>> unused;
+        NumberProtos(chunk->MainFunc(), i, &unused, &protos[i]);
+    }
+
+    // grow the intern table once instead of doubling it all along
+    size_t buckets = L->strings_.size();
+    while (buckets < L->nstrings_ + h->nstrings_) {
+        buckets *= 2;
+    }
+    if (buckets != L->strings_.size()) {
+        L->ResizeStrings(buckets);
+    }
+
+    const auto* offsets = image.At<uint64_t>(h->objects_, h->nobjects_);
+    ObjectTable objs;
+    objs.objects_.reserve(h->nobjects_);
+    for (uint32_t i = 0; i < h->nobjects_; ++i) {
+        const auto* o = image.At<ImageObject>(offsets[i]);
+        GCObject* obj;
+        switch (ValueType(o->type_)) {
+            case ValueType::String: {
+                const auto* s = image.At<ImageString>(offsets[i]);
+                const char* data = image.String(offsets[i] + sizeof(ImageString), s->len_);
+                obj = L->InternString(data, s->len_, true);
+                break;
+            }
+            case ValueType::Table: {
+                const auto* t = image.At<ImageTable>(offsets[i]);
+                // the sizes are only hints, bound them by the pairs in the image
+                image.At<ImageValue>(offsets[i] + sizeof(ImageTable), uint64_t(o->count_) * 2);
+                uint32_t narray = std::min(t->narray_, o->count_);
+                obj = L->NewTable(narray, o->count_ - narray);
+                break;
+            }
+            case ValueType::LuaFunction: {
+                const auto* cl = image.At<ImageLuaClosure>(offsets[i]);
+                if (cl->chunk_ >= protos.size() || cl->proto_ >= protos[cl->chunk_].size()) {
+                    throw std::runtime_error("corrupt snapshot");
+                }
+                obj = L->NewLuaClosure(protos[cl->chunk_][cl->proto_]);
+                break;
+            }
+            case ValueType::UpVal:
+                obj = new UpVal();
+                L->Link(obj);
+                break;
+            case ValueType::NativeFunction: {
+                const auto* f = image.At<ImageNative>(offsets[i]);
+                uint64_t nameOffset = offsets[i] + sizeof(ImageNative) + o->count_ * sizeof(ImageValue);
+                auto fn = CodeAt<int(LuaState*)>(f->fn_);
+                auto target = f->hasTarget_ ? CodeAt<void()>(f->target_) : nullptr;
+                if (!Code().Contains(fn) || (target && !Code().Contains(target))) {
+                    throw std::runtime_error("corrupt snapshot");
+                }
+                auto ncl = L->NewNative(fn, image.String(nameOffset, f->nameLen_), o->count_);
+                ncl->target_ = target;
+                obj = ncl;
+                break;
+            }
+            default:
+                throw std::runtime_error("corrupt snapshot");
+        }
+        objs.objects_.push_back(obj);
+    }
+
+    for (uint32_t i = 0; i < h->nobjects_; ++i) {
+        GCObject* obj = objs.objects_[i];
+        switch (obj->type_) {
+            case ValueType::Table: {
+                const auto* t = image.At<ImageTable>(offsets[i]);
+                auto table = static_cast<LuaTable*>(obj);
+                if (t->metatable_ != kNone) {
+                    table->metatable_ = static_cast<LuaTable*>(objs.Get(t->metatable_, ValueType::Table));
+                }
+                const auto* kv = image.At<ImageValue>(offsets[i] + sizeof(ImageTable),
+                                                      uint64_t(t->head_.count_) * 2);
+                for (uint32_t k = 0; k < t->head_.count_; ++k) {
+                    LuaValue key = objs.Value(kv[2 * k]);
+                    if (key.IsNil()) {
+                        throw std::runtime_error("corrupt snapshot");
+                    }
+                    table->Set(key, objs.Value(kv[2 * k + 1]));
+                }
+                break;
+            }
+            case ValueType::LuaFunction: {
+                const auto* cl = image.At<ImageLuaClosure>(offsets[i]);
+                auto closure = static_cast<LuaClosure*>(obj);
+                if (cl->head_.count_ != closure->nupvals_) {
+                    throw std::runtime_error("corrupt snapshot");
+                }
+                const auto* uvs = image.At<uint32_t>(offsets[i] + sizeof(ImageLuaClosure), cl->head_.count_);
+                for (uint32_t k = 0; k < cl->head_.count_; ++k) {
+                    closure->upvals_[k] = uvs[k] == kNone ? nullptr
+                            : static_cast<UpVal*>(objs.Get(uvs[k], ValueType::UpVal));
+                }
+                break;
+            }
+            case ValueType::UpVal:
+                static_cast<UpVal*>(obj)->closed_ = objs.Value(image.At<ImageUpVal>(offsets[i])->value_);
+                break;
+            case ValueType::NativeFunction: {
+                auto f = static_cast<NativeClosure*>(obj);
+                const auto* uvs = image.At<ImageValue>(offsets[i] + sizeof(ImageNative), f->upvals_.size());
+                for (size_t k = 0; k < f->upvals_.size(); ++k) {
+                    f->upvals_[k] = objs.Value(uvs[k]);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    L->globals_ = static_cast<LuaTable*>(objs.Get(h->globals_, ValueType::Table));
+    L->stringMeta_ = h->stringMeta_ == kNone ? nullptr
+            : static_cast<LuaTable*>(objs.Get(h->stringMeta_, ValueType::Table));
+}
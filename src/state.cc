@@ -0,0 +1,781 @@
+#include "state.h"
+#include "chunk.h"
+#include "snapshot.h"
+#include <cstdarg>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+static const char* const tmNames[TM_N] = {
+    "__index", "__newindex", "__len", "__eq",
+    "__add", "__sub", "__mul", "__mod", "__pow", "__div", "__idiv",
+    "__band", "__bor", "__bxor", "__shl", "__shr",
+    "__unm", "__bnot", "__lt", "__le", "__concat", "__call",
+};
+
+const char* LuaValue::TypeName() const {
+    switch (type_) {
+        case ValueType::Nil:
+            return "nil";
+        case ValueType::Boolean:
+            return "boolean";
+        case ValueType::Integer:
+        case ValueType::Number:
+            return "number";
+        case ValueType::String:
+            return "string";
+        case ValueType::Table:
+            return "table";
+        case ValueType::LuaFunction:
+        case ValueType::NativeFunction:
+            return "function";
+        default:
+            return "userdata";
+    }
+}
+
+LuaState::LuaState()
+    : stackSize_(BASIC_STACK_SIZE + EXTRA_STACK),
+      ciSize_(BASIC_CI_SIZE),
+      nCcalls_(0),
+      openUpval_(nullptr),
+      allgc_(nullptr),
+      strings_(128, nullptr),
+      nstrings_(0),
+      seed_(uint32_t(reinterpret_cast<uintptr_t>(this) >> 4)),
+      stringMeta_(nullptr) {
+    stack_ = new LuaValue[stackSize_];
+    stackLast_ = stack_ + BASIC_STACK_SIZE;
+    cis_.reset(new CallInfo[ciSize_]);
+    // base frame for natives called from the host, stack_[0] is its func
+    ci_ = cis_.get();
+    ci_->func_ = stack_;
+    ci_->base_ = stack_ + 1;
+    ci_->top_ = stack_ + 1 + LUA_MINSTACK;
+    ci_->savedpc_ = nullptr;
+    ci_->nresults_ = 0;
+    ci_->status_ = 0;
+    top_ = stack_ + 1;
+    globals_ = NewTable();
+    for (int i = 0; i < TM_N; ++i) {
+        tmNames_[i] = NewString(tmNames[i]);
+    }
+}
+
+LuaState::~LuaState() {
+    GCObject* o = allgc_;
+    while (o) {
+        GCObject* next = o->gcNext_;
+        switch (o->type_) {
+            case ValueType::String:
+                static_cast<StringObject*>(o)->~StringObject();
+                ::operator delete(o);
+                break;
+            case ValueType::Table:
+                delete static_cast<LuaTable*>(o);
+                break;
+            case ValueType::LuaFunction:
+                static_cast<LuaClosure*>(o)->~LuaClosure();
+                ::operator delete(o);
+                break;
+            case ValueType::NativeFunction:
+                delete static_cast<NativeClosure*>(o);
+                break;
+            case ValueType::UpVal:
+                delete static_cast<UpVal*>(o);
+                break;
+            default:
+                break;
+        }
+        o = next;
+    }
+    delete[] stack_;
+}
+
+/*
+ * Strings are interned: equal contents always give the same object, so
+ * string equality and table lookups compare pointers only.
+ */
+StringObject *LuaState::NewString(const char *s, size_t len) {
+    return InternString(s, len, false);
+}
+
+StringObject *LuaState::InternString(const char *s, size_t len, bool borrow) {
+    uint32_t h = StringObject::HashBytes(s, len, seed_);
+    auto& bucket = strings_[h & (strings_.size() - 1)];
+    for (StringObject* ts = bucket; ts; ts = ts->hnext_) {
+        if (ts->len_ == len && memcmp(ts->data_, s, len) == 0) {
+            return ts;
+        }
+    }
+    StringObject* ts;
+    if (borrow) {
+        ts = new (::operator new(sizeof(StringObject))) StringObject(s, len, h);
+    } else {
+        void* mem = ::operator new(sizeof(StringObject) + len + 1);
+        char* data = static_cast<char*>(mem) + sizeof(StringObject);
+        memcpy(data, s, len);
+        data[len] = '\0';
+        ts = new (mem) StringObject(data, len, h);
+    }
+    Link(ts);
+    ts->hnext_ = bucket;
+    bucket = ts;
+    if (++nstrings_ > strings_.size()) {
+        ResizeStrings(strings_.size() * 2);
+    }
+    return ts;
+}
+
+void LuaState::ResizeStrings(size_t n) {
+    std::vector<StringObject*> buckets(n, nullptr);
+    for (auto ts:strings_) {
+        while (ts) {
+            StringObject* next = ts->hnext_;
+            auto& b = buckets[ts->hash_ & (n - 1)];
+            ts->hnext_ = b;
+            b = ts;
+            ts = next;
+        }
+    }
+    strings_.swap(buckets);
+}
+
+LuaTable *LuaState::NewTable(size_t narray, size_t nhash) {
+    auto t = new LuaTable(narray, nhash);
+    Link(t);
+    return t;
+}
+
+NativeClosure *LuaState::NewNative(NativeFunction fn, const char* name, size_t nupvals) {
+    auto f = new NativeClosure(fn, name, nupvals);
+    Link(f);
+    return f;
+}
+
+LuaClosure *LuaState::NewLuaClosure(Prototype *p) {
+    auto n = uint32_t(p->upvalues_.size());
+    auto cl = new (::operator new(LuaClosure::SizeFor(n))) LuaClosure(p, n);
+    Link(cl);
+    return cl;
+}
+
+/*
+ * The last closure of p, if it captures the same variables that a new
+ * one made in the frame at base, inside a function with upvalues encup,
+ * would capture. A closure that captures nothing is always reused.
+ */
+LuaClosure *LuaState::CachedClosure(Prototype *p, UpVal *const *encup, LuaValue *base) {
+    LuaClosure* c = p->cache_;
+    if (c == nullptr) {
+        return nullptr;
+    }
+    const Upvalue* uv = p->upvalues_.data();
+    for (uint32_t i = 0; i < c->nupvals_; ++i) {
+        const LuaValue* v = uv[i].inStack_ ? base + uv[i].idx_ : encup[uv[i].idx_]->v_;
+        if (c->upvals_[i]->v_ != v) {
+            return nullptr;
+        }
+    }
+    return c;
+}
+
+void LuaState::SetGlobal(const char *name, const LuaValue &v) {
+    globals_->Set(LuaValue::Object(NewString(name)), v);
+}
+
+LuaValue LuaState::GetGlobal(const char *name) {
+    return *globals_->GetStr(NewString(name));
+}
+
+void LuaState::Register(const char *name, NativeFunction fn) {
+    SetGlobal(name, LuaValue::Object(NewNative(fn, name)));
+}
+
+void LuaState::SetFuncs(LuaTable *t, const std::pair<const char*, NativeFunction> *funcs) {
+    for (; funcs->first; ++funcs) {
+        t->Set(LuaValue::Object(NewString(funcs->first)),
+               LuaValue::Object(NewNative(funcs->second, funcs->first)));
+    }
+}
+
+void LuaState::BindProto(Prototype *p) {
+    p->k_.resize(p->constants_.size());
+    for (size_t i = 0; i < p->constants_.size(); ++i) {
+        const Constant& c = p->constants_[i];
+        LuaValue& v = p->k_[i];
+        switch (c.tag_) {
+            case ConstantTag::NIL:
+                break;
+            case ConstantTag::BOOLEAN:
+                v = LuaValue::Boolean(c.bool_);
+                break;
+            case ConstantTag::NUMBER:
+                v = LuaValue::Number(c.number_);
+                break;
+            case ConstantTag::INTEGER:
+                v = LuaValue::Integer(c.integer_);
+                break;
+            case ConstantTag::SSTRING:
+            case ConstantTag::STRING:
+                v = LuaValue::Object(NewString(c.string_.str_.data(), c.string_.str_.size()));
+                break;
+        }
+    }
+    for (auto sub:p->protos_) {
+        BindProto(sub);
+    }
+}
+
+void LuaState::Load(Chunk *chunk) {
+    chunks_.emplace_back(chunk);
+    Prototype* p = chunk->MainFunc();
+    BindProto(p);
+    LuaClosure* cl = NewLuaClosure(p);
+    for (uint32_t i = 0; i < cl->nupvals_; ++i) {
+        cl->upvals_[i] = new UpVal();
+        Link(cl->upvals_[i]);
+    }
+    if (cl->nupvals_ > 0) {
+        cl->upvals_[0]->closed_ = LuaValue::Object(globals_);   // _ENV
+    }
+    CheckStack(1);
+    Push(LuaValue::Object(cl));
+}
+
+/*
+ * Reallocate the stack and fix up every pointer into it: frames, open
+ * upvalues and top. Sizes double, so growth is amortized O(1) per slot.
+ */
+void LuaState::GrowStack(size_t n) {
+    size_t used = top_ - stack_;
+    size_t size = stackSize_ - EXTRA_STACK;
+    if (used + n > LUAI_MAXSTACK) {
+        Error("stack overflow");
+    }
+    size_t newSize = size * 2;
+    if (newSize < used + n) {
+        newSize = used + n;
+    }
+    if (newSize > LUAI_MAXSTACK) {
+        newSize = LUAI_MAXSTACK;
+    }
+    auto newStack = new LuaValue[newSize + EXTRA_STACK];
+    memcpy(static_cast<void*>(newStack), stack_, stackSize_ * sizeof(LuaValue));
+    LuaValue* old = stack_;
+    auto fix = [old, newStack](LuaValue* p) { return newStack + (p - old); };
+    for (CallInfo* ci = cis_.get(); ci <= ci_; ++ci) {
+        ci->func_ = fix(ci->func_);
+        ci->base_ = fix(ci->base_);
+        ci->top_ = fix(ci->top_);
+    }
+    for (UpVal* uv = openUpval_; uv; uv = uv->openNext_) {
+        uv->v_ = fix(uv->v_);
+    }
+    top_ = fix(top_);
+    delete[] old;
+    stack_ = newStack;
+    stackSize_ = newSize + EXTRA_STACK;
+    stackLast_ = stack_ + newSize;
+}
+
+void LuaState::CheckStack(int n) {
+    if (stackLast_ - top_ < n) {
+        GrowStack(size_t(n));
+    }
+    if (ci_->top_ < top_ + n) {
+        ci_->top_ = top_ + n;
+    }
+}
+
+void LuaState::GrowCI() {
+    size_t used = ci_ - cis_.get();
+    std::unique_ptr<CallInfo[]> cis(new CallInfo[ciSize_ * 2]);
+    memcpy(cis.get(), cis_.get(), ciSize_ * sizeof(CallInfo));
+    cis_ = std::move(cis);
+    ciSize_ *= 2;
+    ci_ = cis_.get() + used;
+}
+
+LuaValue *LuaState::Index(int idx) {
+    LuaValue* p = idx > 0 ? ci_->func_ + idx : top_ + idx;
+    if (p >= top_) {
+        static thread_local LuaValue none;
+        none = LuaValue();
+        return &none;
+    }
+    return p;
+}
+
+void LuaState::SetTop(int idx) {
+    if (idx >= 0) {
+        LuaValue* newTop = ci_->func_ + 1 + idx;
+        while (top_ < newTop) {
+            *top_++ = LuaValue();
+        }
+        top_ = newTop;
+    } else {
+        top_ += idx + 1;
+    }
+}
+
+/*
+ * Replace a non-function by its __call metamethod, the original value
+ * becomes the first argument. Returns func, which may have moved.
+ */
+LuaValue *LuaState::TryCallTM(LuaValue *func) {
+    const LuaValue* tm = GetTM(*func, TM_CALL);
+    if (tm == nullptr) {
+        Error("attempt to call a %s value", func->TypeName());
+    }
+    LuaValue f = *tm;
+    ptrdiff_t off = func - stack_;
+    CheckStack(1);
+    func = stack_ + off;
+    for (LuaValue* p = top_; p > func; --p) {
+        *p = *(p - 1);
+    }
+    ++top_;
+    *func = f;
+    return func;
+}
+
+/*
+ * Start a call of func with the arguments between func and top_. For a
+ * Lua function a new frame is pushed and true is returned, the caller
+ * must then run it. Native functions run to completion here.
+ */
+bool LuaState::PreCall(LuaValue *func, int nresults) {
+    switch (func->type_) {
+        case ValueType::LuaFunction: {
+            Prototype* p = func->lcl_->proto_;
+            int n = int(top_ - func) - 1;
+            int np = p->numParams_;
+            int fsize = p->maxStackSize_;
+            if (stackLast_ - top_ < fsize + np) {
+                ptrdiff_t off = func - stack_;
+                GrowStack(size_t(fsize + np));
+                func = stack_ + off;
+            }
+            for (; n < np; ++n) {
+                *top_++ = LuaValue();
+            }
+            LuaValue* base = func + 1;
+            if (p->isVarArg_) {
+                // slide the fixed parameters above the extra arguments
+                LuaValue* fixed = top_ - n;
+                base = top_;
+                for (int i = 0; i < np; ++i) {
+                    *top_++ = fixed[i];
+                    fixed[i] = LuaValue();
+                }
+            }
+            CallInfo* ci = NextCI();
+            ci->func_ = func;
+            ci->base_ = base;
+            ci->top_ = base + fsize;
+            ci->savedpc_ = p->code_.data();
+            ci->nresults_ = nresults;
+            ci->status_ = CIST_LUA;
+            top_ = ci->top_;
+            return true;
+        }
+        case ValueType::NativeFunction: {
+            if (stackLast_ - top_ < LUA_MINSTACK) {
+                ptrdiff_t off = func - stack_;
+                GrowStack(LUA_MINSTACK);
+                func = stack_ + off;
+            }
+            CallInfo* ci = NextCI();
+            ci->func_ = func;
+            ci->base_ = func + 1;
+            ci->top_ = top_ + LUA_MINSTACK;
+            ci->savedpc_ = nullptr;
+            ci->nresults_ = nresults;
+            ci->status_ = 0;
+            int n = func->ncl_->fn_(this);
+            PosCall(ci_, top_ - n, n);
+            return false;
+        }
+        default:
+            return PreCall(TryCallTM(func), nresults);
+    }
+}
+
+/*
+ * Pop frame ci and move its nres results, starting at firstResult, down
+ * to where the function was. Returns false if the caller wanted all of
+ * them, in which case top_ marks their end.
+ */
+bool LuaState::PosCall(CallInfo *ci, LuaValue *firstResult, int nres) {
+    LuaValue* res = ci->func_;
+    int wanted = ci->nresults_;
+    ci_ = ci - 1;
+    if (wanted == LUA_MULTRET) {
+        for (int i = 0; i < nres; ++i) {
+            res[i] = firstResult[i];
+        }
+        top_ = res + nres;
+        return false;
+    }
+    int i = 0;
+    for (; i < wanted && i < nres; ++i) {
+        res[i] = firstResult[i];
+    }
+    for (; i < wanted; ++i) {
+        res[i] = LuaValue();
+    }
+    top_ = res + wanted;
+    return true;
+}
+
+void LuaState::Call(int nargs, int nresults) {
+    LuaValue* func = top_ - (nargs + 1);
+    if (nCcalls_ >= LUAI_MAXCCALLS) {
+        Error("C stack overflow");
+    }
+    ++nCcalls_;
+    try {
+        if (PreCall(func, nresults)) {
+            ci_->status_ |= CIST_FRESH;
+            if (opcodeCounts_) {
+                Execute<true>();
+            } else {
+                Execute<false>();
+            }
+        }
+    } catch (...) {
+        --nCcalls_;
+        throw;
+    }
+    --nCcalls_;
+    if (nresults == LUA_MULTRET && ci_->top_ < top_) {
+        ci_->top_ = top_;
+    }
+}
+
+bool LuaState::PCall(int nargs, int nresults) {
+    ptrdiff_t funcOff = (top_ - (nargs + 1)) - stack_;
+    ptrdiff_t ciOff = ci_ - cis_.get();
+    try {
+        Call(nargs, nresults);
+        return true;
+    } catch (const LuaError& e) {
+        LuaValue* func = stack_ + funcOff;
+        CloseUpvals(func);
+        ci_ = cis_.get() + ciOff;
+        top_ = func;
+        *top_++ = e.value_;
+        return false;
+    }
+}
+
+/*
+ * The open upvalue of a stack slot, created if needed. The list is kept
+ * sorted by level, so the search stops at the first slot below level:
+ * usually right away, as captures come from the innermost frame.
+ */
+UpVal *LuaState::FindUpval(LuaValue *level) {
+    UpVal** p = &openUpval_;
+    UpVal* uv;
+    while ((uv = *p) != nullptr && uv->v_ >= level) {
+        if (uv->v_ == level) {
+            return uv;
+        }
+        p = &uv->openNext_;
+    }
+    uv = new UpVal();
+    Link(uv);
+    uv->v_ = level;
+    uv->openNext_ = *p;
+    *p = uv;
+    return uv;
+}
+
+// close the upvalues of level and above, a prefix of the sorted list
+void LuaState::CloseUpvals(LuaValue *level) {
+    UpVal* uv;
+    while ((uv = openUpval_) != nullptr && uv->v_ >= level) {
+        uv->closed_ = *uv->v_;
+        uv->v_ = &uv->closed_;
+        openUpval_ = uv->openNext_;
+        uv->openNext_ = nullptr;
+    }
+}
+
+int LuaState::CurrentLine(CallInfo *ci) const {
+    Prototype* p = ci->func_->lcl_->proto_;
+    size_t pc = ci->savedpc_ - p->code_.data();
+    if (pc == 0) {
+        return -1;
+    }
+    return p->Lines().GetLine(pc - 1);
+}
+
+std::string ChunkId(const std::string& source) {
+    if (!source.empty() && (source[0] == '@' || source[0] == '=')) {
+        return source.substr(1);
+    }
+    auto eol = source.find('\n');
+    return "[string \"" + source.substr(0, eol) + (eol == std::string::npos ? "\"]" : "...\"]");
+}
+
+std::string LuaState::Where(int level) {
+    if (level >= ci_ - cis_.get()) {
+        return "";
+    }
+    CallInfo* ci = ci_ - level;
+    if (!(ci->status_ & CIST_LUA)) {
+        return "";
+    }
+    const Prototype* p = ci->func_->lcl_->proto_;
+    return ChunkId(p->source_) + ":" + std::to_string(CurrentLine(ci)) + ": ";
+}
+
+void LuaState::Throw(const LuaValue &err) {
+    if (err.IsString()) {
+        throw LuaError(std::string(err.str_->data(), err.str_->size()), err);
+    }
+    throw LuaError(std::string("(error object is a ") + err.TypeName() + " value)", err);
+}
+
+void LuaState::Error(const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    // runtime errors point at the running Lua function, errors raised by
+    // a native function at the Lua code that called it
+    std::string msg = Where((ci_->status_ & CIST_LUA) ? 0 : 1) + buf;
+    Throw(LuaValue::Object(NewString(msg.data(), msg.size())));
+}
+
+void LuaState::PushFString(const char *fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        n = 0;
+    }
+    PushString(buf, size_t(n) < sizeof(buf) ? size_t(n) : sizeof(buf) - 1);
+}
+
+void LuaState::ArgError(int arg, const char *msg) {
+    const char* name = "?";
+    if (ci_->func_->type_ == ValueType::NativeFunction) {
+        name = ci_->func_->ncl_->name_;
+    }
+    Error("bad argument #%d to '%s' (%s)", arg, name, msg);
+}
+
+void LuaState::TypeError(int arg, const char *expected) {
+    const char* got = arg > GetTop() ? "no value" : Index(arg)->TypeName();
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%s expected, got %s", expected, got);
+    ArgError(arg, msg);
+}
+
+void LuaState::CheckAny(int arg) {
+    if (arg > GetTop()) {
+        ArgError(arg, "value expected");
+    }
+}
+
+LuaInteger LuaState::CheckInteger(int arg) {
+    LuaValue* v = Index(arg);
+    LuaInteger i;
+    if (v->IsInteger()) {
+        return v->i_;
+    }
+    if (ToInteger(*v, &i)) {
+        return i;
+    }
+    LuaValue n;
+    if (ToNumber(*v, &n)) {
+        ArgError(arg, "number has no integer representation");
+    }
+    TypeError(arg, "number");
+}
+
+LuaNumber LuaState::CheckNumber(int arg) {
+    LuaValue n;
+    if (!ToNumber(*Index(arg), &n)) {
+        TypeError(arg, "number");
+    }
+    return n.AsNumber();
+}
+
+StringObject *LuaState::CheckString(int arg) {
+    LuaValue* v = Index(arg);
+    if (v->IsString()) {
+        return v->str_;
+    }
+    if (!v->IsNumber()) {
+        TypeError(arg, "string");
+    }
+    // like lua_tolstring, the argument itself is converted
+    *v = LuaValue::Object(ToStringObject(*v));
+    return v->str_;
+}
+
+LuaTable *LuaState::CheckTable(int arg) {
+    LuaValue* v = Index(arg);
+    if (!v->IsTable()) {
+        TypeError(arg, "table");
+    }
+    return v->table_;
+}
+
+LuaInteger LuaState::OptInteger(int arg, LuaInteger def) {
+    return Index(arg)->IsNil() ? def : CheckInteger(arg);
+}
+
+LuaTable *LuaState::GetMetatable(const LuaValue &v) const {
+    switch (v.type_) {
+        case ValueType::Table:
+            return v.table_->metatable_;
+        case ValueType::String:
+            return stringMeta_;
+        default:
+            return nullptr;
+    }
+}
+
+const LuaValue *LuaState::GetTM(const LuaValue &v, TMS event) const {
+    LuaTable* mt = GetMetatable(v);
+    if (mt == nullptr) {
+        return nullptr;
+    }
+    const LuaValue* tm = mt->GetStr(tmNames_[event]);
+    return tm->IsNil() ? nullptr : tm;
+}
+
+StringObject *LuaState::ToStringObject(const LuaValue &v) {
+    if (v.IsString()) {
+        return v.str_;
+    }
+    if (v.IsNumber()) {
+        char buf[64];
+        size_t n = NumberToString(v, buf, sizeof(buf));
+        return NewString(buf, n);
+    }
+    return nullptr;
+}
+
+size_t NumberToString(const LuaValue &v, char *buf, size_t n) {
+    int len;
+    if (v.IsInteger()) {
+        len = snprintf(buf, n, "%lld", (long long)v.i_);
+    } else {
+        len = snprintf(buf, n, "%.14g", v.n_);
+        // keep floats recognizable: 1.0 rather than 1
+        if (buf[strspn(buf, "-0123456789")] == '\0') {
+            buf[len++] = '.';
+            buf[len++] = '0';
+            buf[len] = '\0';
+        }
+    }
+    return size_t(len);
+}
+
+static bool IsSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = char(c | 0x20);
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/*
+ * Integer syntax first (decimal that fits, or hexadecimal wrapping
+ * around), then floats through strtod. "inf" and "nan" are rejected.
+ */
+bool StringToNumber(const char *s, size_t len, LuaValue *out) {
+    const char* p = s;
+    const char* end = s + len;
+    while (p < end && IsSpace(*p)) {
+        ++p;
+    }
+    while (end > p && IsSpace(end[-1])) {
+        --end;
+    }
+    if (p == end) {
+        return false;
+    }
+    const char* q = p;
+    bool neg = false;
+    if (*q == '-' || *q == '+') {
+        neg = *q == '-';
+        ++q;
+    }
+    uint64_t a = 0;
+    bool empty = true, overflow = false;
+    if (end - q > 2 && q[0] == '0' && (q[1] == 'x' || q[1] == 'X')) {
+        q += 2;
+        for (; q < end && HexValue(*q) >= 0; ++q) {
+            a = a * 16 + uint64_t(HexValue(*q));
+            empty = false;
+        }
+    } else {
+        for (; q < end && *q >= '0' && *q <= '9'; ++q) {
+            int d = *q - '0';
+            if (a >= 922337203685477580ULL && (a > 922337203685477580ULL || d > 7 + neg)) {
+                overflow = true;
+            }
+            a = a * 10 + uint64_t(d);
+            empty = false;
+        }
+    }
+    if (q == end && !empty && !overflow) {
+        *out = LuaValue::Integer(LuaInteger(neg ? 0 - a : a));
+        return true;
+    }
+    for (const char* c = p; c < end; ++c) {
+        if (*c == 'n' || *c == 'N') {
+            return false;
+        }
+    }
+    std::string buf(p, end);
+    char* endptr;
+    double d = strtod(buf.c_str(), &endptr);
+    if (endptr == buf.c_str() || *endptr != '\0') {
+        return false;
+    }
+    *out = LuaValue::Number(d);
+    return true;
+}
+
+bool LuaState::ToNumber(const LuaValue &v, LuaValue *out) {
+    if (v.IsNumber()) {
+        *out = v;
+        return true;
+    }
+    if (v.IsString()) {
+        return StringToNumber(v.str_->data(), v.str_->size(), out);
+    }
+    return false;
+}
+
+bool LuaState::ToInteger(const LuaValue &v, LuaInteger *out) {
+    LuaValue n;
+    if (!ToNumber(v, &n)) {
+        return false;
+    }
+    if (n.IsInteger()) {
+        *out = n.i_;
+        return true;
+    }
+    if (n.n_ >= -9223372036854775808.0 && n.n_ < 9223372036854775808.0 &&
+        std::floor(n.n_) == n.n_) {
+        *out = LuaInteger(n.n_);
+        return true;
+    }
+    return false;
+}
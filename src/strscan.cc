@@ -0,0 +1,226 @@
+#include "strscan.h"
+#include <cstring>
+
+#if !defined(LUAVM_NO_SIMD) && defined(__x86_64__) && defined(__GNUC__)
+#define STRSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const char* ScalarFindByte(const char* s, size_t n, char c) {
+    return static_cast<const char*>(memchr(s, c, n));
+}
+
+const char* ScalarFindAnyOf(const char* s, size_t n, const char* set, size_t nset) {
+    bool member[256] = {};
+    for (size_t i = 0; i < nset; ++i) {
+        member[static_cast<unsigned char>(set[i])] = true;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (member[static_cast<unsigned char>(s[i])]) {
+            return s + i;
+        }
+    }
+    return nullptr;
+}
+
+const char* ScalarFind(const char* s, size_t n, const char* needle, size_t m) {
+    if (m == 0) {
+        return s;
+    }
+    const char* end = s + n;
+    while (size_t(end - s) >= m) {
+        s = static_cast<const char*>(memchr(s, needle[0], size_t(end - s) - m + 1));
+        if (s == nullptr) {
+            return nullptr;
+        }
+        if (memcmp(s + 1, needle + 1, m - 1) == 0) {
+            return s;
+        }
+        ++s;
+    }
+    return nullptr;
+}
+
+#ifdef STRSCAN_X86
+
+/*
+ * Substring search compares the first and the last byte of the needle
+ * against a whole block at once, only the positions where both match
+ * are verified with memcmp. Blocks stop where a load would run past the
+ * end, the rest is left to the scalar version.
+ */
+
+const char* Sse2FindByte(const char* s, size_t n, char c) {
+    const __m128i vc = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        unsigned mask = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)));
+        if (mask) {
+            return s + i + __builtin_ctz(mask);
+        }
+    }
+    return ScalarFindByte(s + i, n - i, c);
+}
+
+const char* Sse2FindAnyOf(const char* s, size_t n, const char* set, size_t nset) {
+    if (nset > 16) {
+        return ScalarFindAnyOf(s, n, set, nset);
+    }
+    __m128i vset[16];
+    for (size_t k = 0; k < nset; ++k) {
+        vset[k] = _mm_set1_epi8(set[k]);
+    }
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i eq = _mm_setzero_si128();
+        for (size_t k = 0; k < nset; ++k) {
+            eq = _mm_or_si128(eq, _mm_cmpeq_epi8(v, vset[k]));
+        }
+        unsigned mask = unsigned(_mm_movemask_epi8(eq));
+        if (mask) {
+            return s + i + __builtin_ctz(mask);
+        }
+    }
+    return ScalarFindAnyOf(s + i, n - i, set, nset);
+}
+
+const char* Sse2Find(const char* s, size_t n, const char* needle, size_t m) {
+    if (m <= 1) {
+        return m == 0 ? s : Sse2FindByte(s, n, needle[0]);
+    }
+    if (m > n) {
+        return nullptr;
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + m - 1));
+        unsigned mask = unsigned(_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last))));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(s + pos + 1, needle + 1, m - 2) == 0) {
+                return s + pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return ScalarFind(s + i, n - i, needle, m);
+}
+
+__attribute__((target("avx2")))
+const char* Avx2FindByte(const char* s, size_t n, char c) {
+    const __m256i vc = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vc)));
+        if (mask) {
+            return s + i + __builtin_ctz(mask);
+        }
+    }
+    return Sse2FindByte(s + i, n - i, c);
+}
+
+__attribute__((target("avx2")))
+const char* Avx2FindAnyOf(const char* s, size_t n, const char* set, size_t nset) {
+    if (nset > 16) {
+        return ScalarFindAnyOf(s, n, set, nset);
+    }
+    __m256i vset[16];
+    for (size_t k = 0; k < nset; ++k) {
+        vset[k] = _mm256_set1_epi8(set[k]);
+    }
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        __m256i eq = _mm256_setzero_si256();
+        for (size_t k = 0; k < nset; ++k) {
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(v, vset[k]));
+        }
+        unsigned mask = unsigned(_mm256_movemask_epi8(eq));
+        if (mask) {
+            return s + i + __builtin_ctz(mask);
+        }
+    }
+    return Sse2FindAnyOf(s + i, n - i, set, nset);
+}
+
+__attribute__((target("avx2")))
+const char* Avx2Find(const char* s, size_t n, const char* needle, size_t m) {
+    if (m <= 1) {
+        return m == 0 ? s : Avx2FindByte(s, n, needle[0]);
+    }
+    if (m > n) {
+        return nullptr;
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + m - 1));
+        unsigned mask = unsigned(_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last))));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(s + pos + 1, needle + 1, m - 2) == 0) {
+                return s + pos;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return Sse2Find(s + i, n - i, needle, m);
+}
+
+#endif
+
+class Impl {
+public:
+    const char* name_;
+    const char* (*findByte_)(const char*, size_t, char);
+    const char* (*findAnyOf_)(const char*, size_t, const char*, size_t);
+    const char* (*find_)(const char*, size_t, const char*, size_t);
+};
+
+const Impl& Selected() {
+    static const Impl impl = [] {
+#ifdef STRSCAN_X86
+        if (__builtin_cpu_supports("avx2")) {
+            return Impl{"avx2", Avx2FindByte, Avx2FindAnyOf, Avx2Find};
+        }
+        return Impl{"sse2", Sse2FindByte, Sse2FindAnyOf, Sse2Find};
+#else
+        return Impl{"scalar", ScalarFindByte, ScalarFindAnyOf, ScalarFind};
+#endif
+    }();
+    return impl;
+}
+
+}
+
+namespace strscan {
+
+const char* FindByte(const char* s, size_t n, char c) {
+    return Selected().findByte_(s, n, c);
+}
+
+const char* FindAnyOf(const char* s, size_t n, const char* set, size_t nset) {
+    return Selected().findAnyOf_(s, n, set, nset);
+}
+
+const char* Find(const char* s, size_t n, const char* needle, size_t m) {
+    return Selected().find_(s, n, needle, m);
+}
+
+const char* Implementation() {
+    return Selected().name_;
+}
+
+}
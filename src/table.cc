@@ -0,0 +1,318 @@
+#include "table.h"
+#include <cmath>
+
+static const LuaValue nilValue;
+
+// float keys with an integral value are stored as integers
+static bool FloatToIntKey(LuaNumber n, LuaInteger* i) {
+    if (n >= -9223372036854775808.0 && n < 9223372036854775808.0) {
+        auto k = LuaInteger(n);
+        if (LuaNumber(k) == n) {
+            *i = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+LuaTable::LuaTable(size_t narray, size_t nhash) : GCObject(ValueType::Table) {
+    array_.reserve(narray);
+    if (nhash > 0) {
+        ResizeHash(nhash);
+    }
+}
+
+LuaTable::~LuaTable() {
+    delete[] nodes_;
+}
+
+uint64_t LuaTable::HashKey(const LuaValue& key) {
+    uint64_t h;
+    switch (key.type_) {
+        case ValueType::String:
+            return key.str_->Hash();
+        case ValueType::Boolean:
+            return key.b_ ? 1 : 2;
+        case ValueType::Number:
+            memcpy(&h, &key.n_, sizeof(h));
+            break;
+        default:
+            h = uint64_t(key.i_);
+            break;
+    }
+    // mix the high bits down, integers and pointers are often sequential
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+const LuaTable::Node* LuaTable::FindNode(const LuaValue& key) const {
+    if (nodeCap_ == 0) {
+        return nullptr;
+    }
+    size_t mask = nodeCap_ - 1;
+    for (size_t i = HashKey(key) & mask;; i = (i + 1) & mask) {
+        const Node& n = nodes_[i];
+        if (n.key_.IsNil()) {
+            return nullptr;
+        }
+        if (n.key_.RawEquals(key)) {
+            return &n;
+        }
+    }
+}
+
+const LuaValue* LuaTable::GetInt(LuaInteger key) const {
+    if (uint64_t(key) - 1 < array_.size()) {
+        return &array_[key - 1];
+    }
+    const Node* n = FindNode(LuaValue::Integer(key));
+    return n ? &n->val_ : &nilValue;
+}
+
+const LuaValue* LuaTable::GetStr(const StringObject* key) const {
+    if (nodeCap_ == 0) {
+        return &nilValue;
+    }
+    size_t mask = nodeCap_ - 1;
+    for (size_t i = key->Hash() & mask;; i = (i + 1) & mask) {
+        const Node& n = nodes_[i];
+        if (n.key_.IsNil()) {
+            return &nilValue;
+        }
+        if (n.key_.str_ == key && n.key_.IsString()) {
+            return &n.val_;
+        }
+    }
+}
+
+const LuaValue* LuaTable::Get(const LuaValue& key) const {
+    switch (key.type_) {
+        case ValueType::Nil:
+            return &nilValue;
+        case ValueType::Integer:
+            return GetInt(key.i_);
+        case ValueType::String:
+            return GetStr(key.str_);
+        case ValueType::Number: {
+            LuaInteger k;
+            if (FloatToIntKey(key.n_, &k)) {
+                return GetInt(k);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    const Node* n = FindNode(key);
+    return n ? &n->val_ : &nilValue;
+}
+
+/*
+ * Slot for key in the hash part, inserting the key if it is absent
+ */
+LuaValue* LuaTable::HashSlotForSet(const LuaValue& key) {
+    if ((nodeUsed_ + 1) * 4 > nodeCap_ * 3) {
+        // count live entries only, dead keys are dropped by the rehash
+        size_t live = 0;
+        for (size_t i = 0; i < nodeCap_; ++i) {
+            live += !nodes_[i].key_.IsNil() && !nodes_[i].val_.IsNil();
+        }
+        ResizeHash(live + 1);
+    }
+    size_t mask = nodeCap_ - 1;
+    for (size_t i = HashKey(key) & mask;; i = (i + 1) & mask) {
+        Node& n = nodes_[i];
+        if (n.key_.IsNil()) {
+            n.key_ = key;
+            ++nodeUsed_;
+            return &n.val_;
+        }
+        if (n.key_.RawEquals(key)) {
+            return &n.val_;
+        }
+    }
+}
+
+void LuaTable::ResizeHash(size_t n) {
+    size_t cap = 4;
+    while (cap * 3 < n * 4) {
+        cap <<= 1;
+    }
+    Node* old = nodes_;
+    size_t oldCap = nodeCap_;
+    nodes_ = new Node[cap];
+    nodeCap_ = cap;
+    nodeUsed_ = 0;
+    size_t mask = cap - 1;
+    for (size_t j = 0; j < oldCap; ++j) {
+        const Node& o = old[j];
+        if (o.key_.IsNil() || o.val_.IsNil()) {
+            continue;
+        }
+        size_t i = HashKey(o.key_) & mask;
+        while (!nodes_[i].key_.IsNil()) {
+            i = (i + 1) & mask;
+        }
+        nodes_[i] = o;
+        ++nodeUsed_;
+    }
+    delete[] old;
+}
+
+/*
+ * Move keys n+1, n+2... from the hash part to the end of the array part
+ */
+void LuaTable::MigrateToArray() {
+    if (nodeUsed_ == 0) {
+        return;
+    }
+    while (true) {
+        auto key = LuaValue::Integer(LuaInteger(array_.size()) + 1);
+        auto n = const_cast<Node*>(FindNode(key));
+        if (n == nullptr || n->val_.IsNil()) {
+            return;
+        }
+        array_.push_back(n->val_);
+        n->val_ = LuaValue();
+    }
+}
+
+void LuaTable::SetInt(LuaInteger key, const LuaValue& val) {
+    if (uint64_t(key) - 1 < array_.size()) {
+        array_[key - 1] = val;
+        return;
+    }
+    if (uint64_t(key) == array_.size() + 1) {
+        if (val.IsNil()) {
+            // nothing stored there yet unless it sits in the hash part
+            const Node* n = FindNode(LuaValue::Integer(key));
+            if (n) {
+                const_cast<Node*>(n)->val_ = val;
+            }
+            return;
+        }
+        const Node* n = FindNode(LuaValue::Integer(key));
+        if (n) {
+            const_cast<Node*>(n)->val_ = LuaValue();
+        }
+        array_.push_back(val);
+        MigrateToArray();
+        return;
+    }
+    auto k = LuaValue::Integer(key);
+    if (val.IsNil()) {
+        const Node* n = FindNode(k);
+        if (n) {
+            const_cast<Node*>(n)->val_ = val;
+        }
+        return;
+    }
+    *HashSlotForSet(k) = val;
+}
+
+void LuaTable::Set(const LuaValue& key, const LuaValue& val) {
+    switch (key.type_) {
+        case ValueType::Integer:
+            SetInt(key.i_, val);
+            return;
+        case ValueType::Number: {
+            LuaInteger k;
+            if (FloatToIntKey(key.n_, &k)) {
+                SetInt(k, val);
+                return;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    if (val.IsNil()) {
+        const Node* n = FindNode(key);
+        if (n) {
+            const_cast<Node*>(n)->val_ = val;
+        }
+        return;
+    }
+    *HashSlotForSet(key) = val;
+}
+
+/*
+ * A border: t[n] ~= nil and t[n+1] == nil, or 0 if t[1] is nil
+ */
+LuaInteger LuaTable::Length() const {
+    size_t j = array_.size();
+    if (j > 0 && array_[j - 1].IsNil()) {
+        size_t i = 0;   // t[i] non nil (or i == 0), t[j] nil
+        while (j - i > 1) {
+            size_t m = (i + j) / 2;
+            if (array_[m - 1].IsNil()) {
+                j = m;
+            } else {
+                i = m;
+            }
+        }
+        return LuaInteger(i);
+    }
+    if (nodeUsed_ == 0) {
+        return LuaInteger(j);
+    }
+    // unbound search in the hash part
+    LuaInteger i = LuaInteger(j), k = i + 1;
+    while (!GetInt(k)->IsNil()) {
+        i = k;
+        if (k > INT64_MAX / 2) {
+            // overflow, fall back to a linear search
+            LuaInteger n = 1;
+            while (!GetInt(n)->IsNil()) {
+                ++n;
+            }
+            return n - 1;
+        }
+        k *= 2;
+    }
+    while (k - i > 1) {
+        LuaInteger m = i + (k - i) / 2;
+        if (GetInt(m)->IsNil()) {
+            k = m;
+        } else {
+            i = m;
+        }
+    }
+    return i;
+}
+
+bool LuaTable::Next(LuaValue* key, LuaValue* val) const {
+    size_t i = 0;   // array index to resume at
+    if (!key->IsNil()) {
+        LuaInteger k;
+        bool isInt = key->IsInteger() ? (k = key->i_, true)
+                                      : key->IsFloat() && FloatToIntKey(key->n_, &k);
+        if (isInt && uint64_t(k) - 1 < array_.size()) {
+            i = size_t(k);
+        } else {
+            const Node* n = FindNode(isInt ? LuaValue::Integer(k) : *key);
+            if (n == nullptr) {
+                return false;
+            }
+            i = array_.size() + size_t(n - nodes_) + 1;
+        }
+    }
+    for (; i < array_.size(); ++i) {
+        if (!array_[i].IsNil()) {
+            *key = LuaValue::Integer(LuaInteger(i) + 1);
+            *val = array_[i];
+            return true;
+        }
+    }
+    for (i -= array_.size(); i < nodeCap_; ++i) {
+        if (!nodes_[i].key_.IsNil() && !nodes_[i].val_.IsNil()) {
+            *key = nodes_[i].key_;
+            *val = nodes_[i].val_;
+            return true;
+        }
+    }
+    key->type_ = ValueType::Nil;
+    return false;
+}
@@ -0,0 +1,1097 @@
+#include "state.h"
+#include "chunk.h"
+#include "vm.h"
+#include <cmath>
+
+#define MAXTAGLOOP  2000    // limit of __index/__newindex chains
+
+/*
+ * Integer arithmetic wraps around, as in two's complement
+ */
+static inline LuaInteger IntAdd(LuaInteger a, LuaInteger b) {
+    return LuaInteger(uint64_t(a) + uint64_t(b));
+}
+
+static inline LuaInteger IntSub(LuaInteger a, LuaInteger b) {
+    return LuaInteger(uint64_t(a) - uint64_t(b));
+}
+
+static inline LuaInteger IntMul(LuaInteger a, LuaInteger b) {
+    return LuaInteger(uint64_t(a) * uint64_t(b));
+}
+
+// floor modulo, b != 0
+static inline LuaInteger IntMod(LuaInteger a, LuaInteger b) {
+    if (b == -1) {
+        return 0;   // avoids INT64_MIN % -1
+    }
+    LuaInteger m = a % b;
+    if (m != 0 && (m ^ b) < 0) {
+        m += b;
+    }
+    return m;
+}
+
+// floor division, b != 0
+static inline LuaInteger IntDiv(LuaInteger a, LuaInteger b) {
+    if (b == -1) {
+        return IntSub(0, a);
+    }
+    LuaInteger q = a / b;
+    if ((a % b != 0) && ((a ^ b) < 0)) {
+        q -= 1;
+    }
+    return q;
+}
+
+static inline LuaInteger ShiftLeft(LuaInteger a, LuaInteger b) {
+    if (b <= -64 || b >= 64) {
+        return 0;
+    }
+    if (b >= 0) {
+        return LuaInteger(uint64_t(a) << b);
+    }
+    return LuaInteger(uint64_t(a) >> -b);
+}
+
+static inline LuaNumber NumMod(LuaNumber a, LuaNumber b) {
+    LuaNumber m = std::fmod(a, b);
+    if ((m > 0) ? b < 0 : (m < 0 && b != m)) {
+        m += b;
+    }
+    return m;
+}
+
+static inline LuaNumber NumIDiv(LuaNumber a, LuaNumber b) {
+    return std::floor(a / b);
+}
+
+static inline LuaNumber NumPow(LuaNumber a, LuaNumber b) {
+    return b == 2 ? a * a : std::pow(a, b);
+}
+
+/*
+ * Float to integer with the given rounding, false if out of range
+ */
+enum F2Imod { F2Ieq, F2Ifloor, F2Iceil };
+
+static bool FloatToInteger(LuaNumber n, LuaInteger* p, F2Imod mode) {
+    LuaNumber f = std::floor(n);
+    if (n != f) {
+        if (mode == F2Ieq) {
+            return false;
+        } else if (mode == F2Iceil) {
+            f += 1;
+        }
+    }
+    if (f >= -9223372036854775808.0 && f < 9223372036854775808.0) {
+        *p = LuaInteger(f);
+        return true;
+    }
+    return false;
+}
+
+// exact int/float comparisons, even where the integer has no exact float
+static bool LTintfloat(LuaInteger i, LuaNumber f) {
+    if (i >= -(1LL << 53) && i <= (1LL << 53)) {
+        return LuaNumber(i) < f;
+    }
+    LuaInteger fi;
+    if (FloatToInteger(f, &fi, F2Iceil)) {
+        return i < fi;
+    }
+    return f > 0;
+}
+
+static bool LEintfloat(LuaInteger i, LuaNumber f) {
+    if (i >= -(1LL << 53) && i <= (1LL << 53)) {
+        return LuaNumber(i) <= f;
+    }
+    LuaInteger fi;
+    if (FloatToInteger(f, &fi, F2Ifloor)) {
+        return i <= fi;
+    }
+    return f > 0;
+}
+
+static bool LTfloatint(LuaNumber f, LuaInteger i) {
+    if (i >= -(1LL << 53) && i <= (1LL << 53)) {
+        return f < LuaNumber(i);
+    }
+    LuaInteger fi;
+    if (FloatToInteger(f, &fi, F2Ifloor)) {
+        return fi < i;
+    }
+    return f < 0;
+}
+
+static bool LEfloatint(LuaNumber f, LuaInteger i) {
+    if (i >= -(1LL << 53) && i <= (1LL << 53)) {
+        return f <= LuaNumber(i);
+    }
+    LuaInteger fi;
+    if (FloatToInteger(f, &fi, F2Iceil)) {
+        return fi <= i;
+    }
+    return f < 0;
+}
+
+static inline bool LTnum(const LuaValue& a, const LuaValue& b) {
+    if (a.IsInteger()) {
+        return b.IsInteger() ? a.i_ < b.i_ : LTintfloat(a.i_, b.n_);
+    }
+    return b.IsFloat() ? a.n_ < b.n_ : LTfloatint(a.n_, b.i_);
+}
+
+static inline bool LEnum(const LuaValue& a, const LuaValue& b) {
+    if (a.IsInteger()) {
+        return b.IsInteger() ? a.i_ <= b.i_ : LEintfloat(a.i_, b.n_);
+    }
+    return b.IsFloat() ? a.n_ <= b.n_ : LEfloatint(a.n_, b.i_);
+}
+
+static int StrCompare(const StringObject* a, const StringObject* b) {
+    size_t n = a->size() < b->size() ? a->size() : b->size();
+    int r = memcmp(a->data(), b->data(), n);
+    if (r != 0) {
+        return r;
+    }
+    return a->size() < b->size() ? -1 : (a->size() > b->size() ? 1 : 0);
+}
+
+// size hint of NEWTABLE, encoded as a "floating point byte" eeeeexxx
+static size_t FbToInt(int x) {
+    if (x < 8) {
+        return size_t(x);
+    }
+    return size_t((x & 7) + 8) << ((x >> 3) - 1);
+}
+
+/*
+ * Call metamethod f(a, b), or f(a, b, *c) discarding results if c is set
+ */
+LuaValue LuaState::CallTM(const LuaValue &f, const LuaValue &a, const LuaValue &b, const LuaValue* c) {
+    LuaValue args[4] = {f, a, b, c ? *c : LuaValue()};
+    int nargs = c ? 3 : 2;
+    CheckStack(nargs + 1);
+    for (int i = 0; i <= nargs; ++i) {
+        Push(args[i]);
+    }
+    if (c) {
+        Call(nargs, 0);
+        return LuaValue();
+    }
+    Call(nargs, 1);
+    return *--top_;
+}
+
+LuaValue LuaState::GetTable(LuaValue t, LuaValue key) {
+    for (int loop = 0; loop < MAXTAGLOOP; ++loop) {
+        const LuaValue* tm;
+        if (t.IsTable()) {
+            const LuaValue* v = t.table_->Get(key);
+            if (!v->IsNil()) {
+                return *v;
+            }
+            LuaTable* mt = t.table_->metatable_;
+            if (mt == nullptr || (tm = mt->GetStr(tmNames_[TM_INDEX]))->IsNil()) {
+                return LuaValue();
+            }
+        } else if ((tm = GetTM(t, TM_INDEX)) == nullptr) {
+            Error("attempt to index a %s value", t.TypeName());
+        }
+        if (tm->IsFunction()) {
+            return CallTM(*tm, t, key);
+        }
+        t = *tm;
+    }
+    Error("'__index' chain too long; possible loop");
+}
+
+void LuaState::RawSet(LuaTable *t, const LuaValue &key, const LuaValue &val) {
+    if (key.IsNil()) {
+        Error("table index is nil");
+    }
+    if (key.IsFloat() && std::isnan(key.n_)) {
+        Error("table index is NaN");
+    }
+    t->Set(key, val);
+}
+
+void LuaState::SetTable(LuaValue t, LuaValue key, LuaValue val) {
+    for (int loop = 0; loop < MAXTAGLOOP; ++loop) {
+        const LuaValue* tm;
+        if (t.IsTable()) {
+            LuaTable* mt = t.table_->metatable_;
+            if (mt == nullptr || !t.table_->Get(key)->IsNil() ||
+                (tm = mt->GetStr(tmNames_[TM_NEWINDEX]))->IsNil()) {
+                RawSet(t.table_, key, val);
+                return;
+            }
+        } else if ((tm = GetTM(t, TM_NEWINDEX)) == nullptr) {
+            Error("attempt to index a %s value", t.TypeName());
+        }
+        if (tm->IsFunction()) {
+            CallTM(*tm, t, key, &val);
+            return;
+        }
+        t = *tm;
+    }
+    Error("'__newindex' chain too long; possible loop");
+}
+
+bool LuaState::Equals(LuaValue a, LuaValue b) {
+    if (a.type_ != b.type_) {
+        if (a.IsNumber() && b.IsNumber()) {
+            LuaInteger i;
+            if (a.IsInteger()) {
+                return FloatToInteger(b.n_, &i, F2Ieq) && i == a.i_;
+            }
+            return FloatToInteger(a.n_, &i, F2Ieq) && i == b.i_;
+        }
+        return false;
+    }
+    if (!a.IsTable() || a.table_ == b.table_) {
+        return a.RawEquals(b);
+    }
+    const LuaValue* tm = GetTM(a, TM_EQ);
+    if (tm == nullptr) {
+        tm = GetTM(b, TM_EQ);
+    }
+    if (tm == nullptr) {
+        return false;
+    }
+    return !CallTM(*tm, a, b).IsFalsy();
+}
+
+bool LuaState::CallOrderTM(const LuaValue &a, const LuaValue &b, TMS event, bool* result) {
+    const LuaValue* tm = GetTM(a, event);
+    if (tm == nullptr) {
+        tm = GetTM(b, event);
+    }
+    if (tm == nullptr) {
+        return false;
+    }
+    *result = !CallTM(*tm, a, b).IsFalsy();
+    return true;
+}
+
+void LuaState::OrderError(const LuaValue &a, const LuaValue &b) {
+    const char* t1 = a.TypeName();
+    const char* t2 = b.TypeName();
+    if (strcmp(t1, t2) == 0) {
+        Error("attempt to compare two %s values", t1);
+    }
+    Error("attempt to compare %s with %s", t1, t2);
+}
+
+bool LuaState::LessThan(LuaValue a, LuaValue b) {
+    if (a.IsNumber() && b.IsNumber()) {
+        return LTnum(a, b);
+    }
+    if (a.IsString() && b.IsString()) {
+        return StrCompare(a.str_, b.str_) < 0;
+    }
+    bool res;
+    if (!CallOrderTM(a, b, TM_LT, &res)) {
+        OrderError(a, b);
+    }
+    return res;
+}
+
+bool LuaState::LessEqual(LuaValue a, LuaValue b) {
+    if (a.IsNumber() && b.IsNumber()) {
+        return LEnum(a, b);
+    }
+    if (a.IsString() && b.IsString()) {
+        return StrCompare(a.str_, b.str_) <= 0;
+    }
+    bool res;
+    if (CallOrderTM(a, b, TM_LE, &res)) {
+        return res;
+    }
+    // a <= b as not (b < a)
+    if (!CallOrderTM(b, a, TM_LT, &res)) {
+        OrderError(a, b);
+    }
+    return !res;
+}
+
+/*
+ * Arithmetic with string coercion and metamethods, op is OP_ADD..OP_BNOT
+ */
+LuaValue LuaState::Arith(int op, LuaValue a, LuaValue b) {
+    LuaValue x, y;
+    if ((op >= OP_BAND && op <= OP_SHR) || op == OP_BNOT) {
+        LuaInteger i, j;
+        if (ToInteger(a, &i) && ToInteger(b, &j)) {
+            switch (op) {
+                case OP_BAND: return LuaValue::Integer(i & j);
+                case OP_BOR:  return LuaValue::Integer(i | j);
+                case OP_BXOR: return LuaValue::Integer(i ^ j);
+                case OP_SHL:  return LuaValue::Integer(ShiftLeft(i, j));
+                case OP_SHR:  return LuaValue::Integer(ShiftLeft(i, IntSub(0, j)));
+                default:      return LuaValue::Integer(~i);
+            }
+        }
+    } else if (ToNumber(a, &x) && ToNumber(b, &y)) {
+        // strings coerced to numbers always take the float path
+        if (a.IsInteger() && b.IsInteger() && op != OP_DIV && op != OP_POW) {
+            LuaInteger i = x.i_, j = y.i_;
+            switch (op) {
+                case OP_ADD: return LuaValue::Integer(IntAdd(i, j));
+                case OP_SUB: return LuaValue::Integer(IntSub(i, j));
+                case OP_MUL: return LuaValue::Integer(IntMul(i, j));
+                case OP_MOD:
+                    if (j == 0) {
+                        Error("attempt to perform 'n%%0'");
+                    }
+                    return LuaValue::Integer(IntMod(i, j));
+                case OP_IDIV:
+                    if (j == 0) {
+                        Error("attempt to divide by zero");
+                    }
+                    return LuaValue::Integer(IntDiv(i, j));
+                default:
+                    return LuaValue::Integer(IntSub(0, i));   // OP_UNM
+            }
+        }
+        LuaNumber m = x.AsNumber(), n = y.AsNumber();
+        switch (op) {
+            case OP_ADD:  return LuaValue::Number(m + n);
+            case OP_SUB:  return LuaValue::Number(m - n);
+            case OP_MUL:  return LuaValue::Number(m * n);
+            case OP_DIV:  return LuaValue::Number(m / n);
+            case OP_MOD:  return LuaValue::Number(NumMod(m, n));
+            case OP_POW:  return LuaValue::Number(NumPow(m, n));
+            case OP_IDIV: return LuaValue::Number(std::floor(m / n));
+            default:      return LuaValue::Number(-m);    // OP_UNM
+        }
+    }
+    TMS event = op == OP_UNM ? TM_UNM : (op == OP_BNOT ? TM_BNOT : TMS(TM_ADD + (op - OP_ADD)));
+    const LuaValue* tm = GetTM(a, event);
+    if (tm == nullptr) {
+        tm = GetTM(b, event);
+    }
+    if (tm != nullptr) {
+        return CallTM(*tm, a, b);
+    }
+    if ((event >= TM_BAND && event <= TM_SHR) || event == TM_BNOT) {
+        if (a.IsNumber() && b.IsNumber()) {
+            Error("number has no integer representation");
+        }
+        const LuaValue& bad = (a.IsNumber() || (a.IsString() && ToNumber(a, &x))) ? b : a;
+        Error("attempt to perform bitwise operation on a %s value", bad.TypeName());
+    }
+    const LuaValue& bad = ToNumber(a, &x) ? b : a;
+    Error("attempt to perform arithmetic on a %s value", bad.TypeName());
+}
+
+/*
+ * Arithmetic on two numbers without coercions or errors, as used to fold
+ * constants. False if the result is not defined (bitwise operation on a
+ * float with no integer value, integer division or modulo by zero).
+ */
+bool RawArith(int op, const LuaValue& a, const LuaValue& b, LuaValue* out) {
+    if ((op >= OP_BAND && op <= OP_SHR) || op == OP_BNOT) {
+        LuaInteger i, j;
+        if (!(a.IsInteger() ? (i = a.i_, true) : FloatToInteger(a.n_, &i, F2Ieq)) ||
+            !(b.IsInteger() ? (j = b.i_, true) : FloatToInteger(b.n_, &j, F2Ieq))) {
+            return false;
+        }
+        switch (op) {
+            case OP_BAND: *out = LuaValue::Integer(i & j); break;
+            case OP_BOR:  *out = LuaValue::Integer(i | j); break;
+            case OP_BXOR: *out = LuaValue::Integer(i ^ j); break;
+            case OP_SHL:  *out = LuaValue::Integer(ShiftLeft(i, j)); break;
+            case OP_SHR:  *out = LuaValue::Integer(ShiftLeft(i, IntSub(0, j))); break;
+            default:      *out = LuaValue::Integer(~i); break;
+        }
+        return true;
+    }
+    if (a.IsInteger() && b.IsInteger() && op != OP_DIV && op != OP_POW) {
+        LuaInteger i = a.i_, j = b.i_;
+        switch (op) {
+            case OP_ADD: *out = LuaValue::Integer(IntAdd(i, j)); break;
+            case OP_SUB: *out = LuaValue::Integer(IntSub(i, j)); break;
+            case OP_MUL: *out = LuaValue::Integer(IntMul(i, j)); break;
+            case OP_MOD:
+                if (j == 0) {
+                    return false;
+                }
+                *out = LuaValue::Integer(IntMod(i, j));
+                break;
+            case OP_IDIV:
+                if (j == 0) {
+                    return false;
+                }
+                *out = LuaValue::Integer(IntDiv(i, j));
+                break;
+            default:
+                *out = LuaValue::Integer(IntSub(0, i));   // OP_UNM
+                break;
+        }
+        return true;
+    }
+    LuaNumber m = a.AsNumber(), n = b.AsNumber();
+    switch (op) {
+        case OP_ADD:  *out = LuaValue::Number(m + n); break;
+        case OP_SUB:  *out = LuaValue::Number(m - n); break;
+        case OP_MUL:  *out = LuaValue::Number(m * n); break;
+        case OP_DIV:  *out = LuaValue::Number(m / n); break;
+        case OP_MOD:  *out = LuaValue::Number(NumMod(m, n)); break;
+        case OP_POW:  *out = LuaValue::Number(NumPow(m, n)); break;
+        case OP_IDIV: *out = LuaValue::Number(std::floor(m / n)); break;
+        default:      *out = LuaValue::Number(-m); break;   // OP_UNM
+    }
+    return true;
+}
+
+LuaValue LuaState::Length(LuaValue v) {
+    const LuaValue* tm;
+    if (v.IsTable()) {
+        tm = GetTM(v, TM_LEN);
+        if (tm == nullptr) {
+            return LuaValue::Integer(v.table_->Length());
+        }
+    } else if (v.IsString()) {
+        return LuaValue::Integer(LuaInteger(v.str_->size()));
+    } else if ((tm = GetTM(v, TM_LEN)) == nullptr) {
+        Error("attempt to get length of a %s value", v.TypeName());
+    }
+    return CallTM(*tm, v, v);
+}
+
+/*
+ * Concatenate the n values on the top of the stack into one, which is
+ * left at top_ - 1. Runs of strings and numbers are joined in one go.
+ */
+void LuaState::Concat(int n) {
+    while (n > 1) {
+        LuaValue* top = top_;
+        int total = 2;
+        if (!(top[-2].IsString() || top[-2].IsNumber()) ||
+            !(top[-1].IsString() || top[-1].IsNumber())) {
+            const LuaValue* tm = GetTM(top[-2], TM_CONCAT);
+            if (tm == nullptr) {
+                tm = GetTM(top[-1], TM_CONCAT);
+            }
+            if (tm == nullptr) {
+                const LuaValue& bad = (top[-2].IsString() || top[-2].IsNumber()) ? top[-1] : top[-2];
+                Error("attempt to concatenate a %s value", bad.TypeName());
+            }
+            LuaValue r = CallTM(*tm, top[-2], top[-1]);
+            top = top_;
+            top[-2] = r;
+        } else if (top[-1].IsString() && top[-1].str_->size() == 0) {
+            top[-2] = LuaValue::Object(ToStringObject(top[-2]));
+        } else if (top[-2].IsString() && top[-2].str_->size() == 0) {
+            top[-2] = LuaValue::Object(ToStringObject(top[-1]));
+        } else {
+            size_t len = 0;
+            for (total = 0; total < n; ++total) {
+                LuaValue& v = top[-1 - total];
+                if (!(v.IsString() || v.IsNumber())) {
+                    break;
+                }
+                v = LuaValue::Object(ToStringObject(v));
+                len += v.str_->size();
+            }
+            concatBuf_.resize(len);
+            char* p = &concatBuf_[0];
+            for (int i = total; i > 0; --i) {
+                const StringObject* s = top[-i].str_;
+                memcpy(p, s->data(), s->size());
+                p += s->size();
+            }
+            top[-total] = LuaValue::Object(NewString(concatBuf_.data(), len));
+        }
+        n -= total - 1;
+        top_ -= total - 1;
+    }
+}
+
+/*
+ * Convert the 'for' limit to an integer, clipping floats out of range.
+ * Sets *stop when the loop must not run at all.
+ */
+static bool ForLimit(const LuaValue& obj, LuaInteger* p, LuaInteger step, bool* stop) {
+    *stop = false;
+    LuaValue n;
+    if (!LuaState::ToNumber(obj, &n)) {
+        return false;
+    }
+    if (n.IsInteger()) {
+        *p = n.i_;
+        return true;
+    }
+    if (FloatToInteger(n.n_, p, step < 0 ? F2Iceil : F2Ifloor)) {
+        return true;
+    }
+    // as lvm.c, a NaN limit is not above 0
+    if (0 < n.n_) {
+        *p = INT64_MAX;
+        *stop = step < 0;
+    } else {
+        *p = INT64_MIN;
+        *stop = step >= 0;
+    }
+    return true;
+}
+
+#define RA(i)       (base + GETARG_A(i))
+#define RB(i)       (base + GETARG_B(i))
+#define RC(i)       (base + GETARG_C(i))
+#define RKB(i)      (ISK(GETARG_B(i)) ? k + INDEXK(GETARG_B(i)) : base + GETARG_B(i))
+#define RKC(i)      (ISK(GETARG_C(i)) ? k + INDEXK(GETARG_C(i)) : base + GETARG_C(i))
+
+// run code that may call back into Lua, raise an error or move the stack
+#define Protect(x)  { ci->savedpc_ = pc; x; ci = ci_; base = ci->base_; }
+
+#define DoJump(i)   { \
+        int a_ = GETARG_A(i); \
+        if (a_ != 0) { \
+            CloseUpvals(base + a_ - 1); \
+        } \
+        pc += GETARG_sBx(i); \
+    }
+
+#define DoNextJump()    { uint32_t ni = *pc; DoJump(ni); pc++; }
+
+#define ArithOp(iop, fop) { \
+        const LuaValue* rb = RKB(i); \
+        const LuaValue* rc = RKC(i); \
+        if (rb->IsInteger() && rc->IsInteger()) { \
+            *ra = LuaValue::Integer(iop(rb->i_, rc->i_)); \
+        } else if (rb->IsNumber() && rc->IsNumber()) { \
+            *ra = LuaValue::Number(fop(rb->AsNumber(), rc->AsNumber())); \
+        } else { \
+            LuaValue v; \
+            Protect(v = Arith(GET_OPCODE(i), *rb, *rc)); \
+            *RA(i) = v; \
+        } \
+    }
+
+// integer division by zero is left to Arith() to report
+#define DivOp(iop, fop) { \
+        const LuaValue* rb = RKB(i); \
+        const LuaValue* rc = RKC(i); \
+        if (rb->IsInteger() && rc->IsInteger() && rc->i_ != 0) { \
+            *ra = LuaValue::Integer(iop(rb->i_, rc->i_)); \
+        } else if (rb->IsNumber() && rc->IsNumber() && !(rb->IsInteger() && rc->IsInteger())) { \
+            *ra = LuaValue::Number(fop(rb->AsNumber(), rc->AsNumber())); \
+        } else { \
+            LuaValue v; \
+            Protect(v = Arith(GET_OPCODE(i), *rb, *rc)); \
+            *RA(i) = v; \
+        } \
+    }
+
+#define FloatOp(fop) { \
+        const LuaValue* rb = RKB(i); \
+        const LuaValue* rc = RKC(i); \
+        if (rb->IsNumber() && rc->IsNumber()) { \
+            *ra = LuaValue::Number(fop(rb->AsNumber(), rc->AsNumber())); \
+        } else { \
+            LuaValue v; \
+            Protect(v = Arith(GET_OPCODE(i), *rb, *rc)); \
+            *RA(i) = v; \
+        } \
+    }
+
+#define BitOp(iop) { \
+        const LuaValue* rb = RKB(i); \
+        const LuaValue* rc = RKC(i); \
+        if (rb->IsInteger() && rc->IsInteger()) { \
+            *ra = LuaValue::Integer(iop(rb->i_, rc->i_)); \
+        } else { \
+            LuaValue v; \
+            Protect(v = Arith(GET_OPCODE(i), *rb, *rc)); \
+            *RA(i) = v; \
+        } \
+    }
+
+#define ADD(a, b)   ((a) + (b))
+#define SUB(a, b)   ((a) - (b))
+#define MUL(a, b)   ((a) * (b))
+#define DIV(a, b)   ((a) / (b))
+#define BAND(a, b)  ((a) & (b))
+#define BOR(a, b)   ((a) | (b))
+#define BXOR(a, b)  ((a) ^ (b))
+#define SHL(a, b)   ShiftLeft(a, b)
+#define SHR(a, b)   ShiftLeft(a, IntSub(0, b))
+
+/*
+ * The interpreter loop. Runs the Lua frame ci_ until the frame marked
+ * CIST_FRESH returns; Lua to Lua calls and returns switch frames in place
+ * instead of recursing. Built twice, so that the opcode histogram costs
+ * nothing while SetOpcodeCounts is off.
+ */
+template<bool kCount>
+void LuaState::Execute() {
+    CallInfo* ci;
+    LuaClosure* cl;
+    const LuaValue* k;
+    LuaValue* base;
+    const uint32_t* pc;
+newframe:
+    ci = ci_;
+    cl = ci->func_->lcl_;
+    k = cl->proto_->k_.data();
+    base = ci->base_;
+    pc = ci->savedpc_;
+    for (;;) {
+        const uint32_t i = *pc++;
+        if constexpr (kCount) {
+            ++opcodeCounts_[GET_OPCODE(i)];
+        }
+        LuaValue* ra = RA(i);
+        switch (GET_OPCODE(i)) {
+            case OP_MOVE:
+                *ra = *RB(i);
+                break;
+            case OP_LOADK:
+                *ra = k[GETARG_Bx(i)];
+                break;
+            case OP_LOADKX:
+                *ra = k[GETARG_Ax(*pc)];
+                pc++;
+                break;
+            case OP_LOADBOOL:
+                *ra = LuaValue::Boolean(GETARG_B(i) != 0);
+                if (GETARG_C(i)) {
+                    pc++;
+                }
+                break;
+            case OP_LOADNIL:
+                for (int b = GETARG_B(i); b >= 0; --b) {
+                    *ra++ = LuaValue();
+                }
+                break;
+            case OP_GETUPVAL:
+                *ra = *cl->upvals_[GETARG_B(i)]->v_;
+                break;
+            case OP_GETTABUP: {
+                const LuaValue* t = cl->upvals_[GETARG_B(i)]->v_;
+                const LuaValue* key = RKC(i);
+                if (t->IsTable()) {
+                    const LuaValue* v = key->IsString() ? t->table_->GetStr(key->str_)
+                                                        : t->table_->Get(*key);
+                    if (!v->IsNil() || t->table_->metatable_ == nullptr) {
+                        *ra = *v;
+                        break;
+                    }
+                }
+                LuaValue v;
+                Protect(v = GetTable(*t, *key));
+                *RA(i) = v;
+                break;
+            }
+            case OP_GETTABLE: {
+                const LuaValue* t = RB(i);
+                const LuaValue* key = RKC(i);
+                if (t->IsTable()) {
+                    const LuaValue* v = t->table_->Get(*key);
+                    if (!v->IsNil() || t->table_->metatable_ == nullptr) {
+                        *ra = *v;
+                        break;
+                    }
+                }
+                LuaValue v;
+                Protect(v = GetTable(*t, *key));
+                *RA(i) = v;
+                break;
+            }
+            case OP_SETTABUP: {
+                const LuaValue* t = cl->upvals_[GETARG_A(i)]->v_;
+                const LuaValue* key = RKB(i);
+                if (t->IsTable() && t->table_->metatable_ == nullptr && key->IsString()) {
+                    t->table_->Set(*key, *RKC(i));
+                    break;
+                }
+                Protect(SetTable(*t, *key, *RKC(i)));
+                break;
+            }
+            case OP_SETUPVAL:
+                *cl->upvals_[GETARG_B(i)]->v_ = *ra;
+                break;
+            case OP_SETTABLE: {
+                const LuaValue* key = RKB(i);
+                if (ra->IsTable() && ra->table_->metatable_ == nullptr &&
+                    (key->IsInteger() || key->IsString())) {
+                    ra->table_->Set(*key, *RKC(i));
+                    break;
+                }
+                Protect(SetTable(*ra, *key, *RKC(i)));
+                break;
+            }
+            case OP_NEWTABLE:
+                *ra = LuaValue::Object(NewTable(FbToInt(GETARG_B(i)), FbToInt(GETARG_C(i))));
+                break;
+            case OP_SELF: {
+                LuaValue rb = *RB(i);
+                const LuaValue* key = RKC(i);
+                ra[1] = rb;
+                if (rb.IsTable()) {
+                    const LuaValue* v = rb.table_->Get(*key);
+                    if (!v->IsNil() || rb.table_->metatable_ == nullptr) {
+                        *ra = *v;
+                        break;
+                    }
+                }
+                LuaValue v;
+                Protect(v = GetTable(rb, *key));
+                *RA(i) = v;
+                break;
+            }
+            case OP_ADD:
+                ArithOp(IntAdd, ADD);
+                break;
+            case OP_SUB:
+                ArithOp(IntSub, SUB);
+                break;
+            case OP_MUL:
+                ArithOp(IntMul, MUL);
+                break;
+            case OP_MOD:
+                DivOp(IntMod, NumMod);
+                break;
+            case OP_POW:
+                FloatOp(NumPow);
+                break;
+            case OP_DIV:
+                FloatOp(DIV);
+                break;
+            case OP_IDIV:
+                DivOp(IntDiv, NumIDiv);
+                break;
+            case OP_BAND:
+                BitOp(BAND);
+                break;
+            case OP_BOR:
+                BitOp(BOR);
+                break;
+            case OP_BXOR:
+                BitOp(BXOR);
+                break;
+            case OP_SHL:
+                BitOp(SHL);
+                break;
+            case OP_SHR:
+                BitOp(SHR);
+                break;
+            case OP_UNM: {
+                const LuaValue* rb = RB(i);
+                if (rb->IsInteger()) {
+                    *ra = LuaValue::Integer(IntSub(0, rb->i_));
+                } else if (rb->IsFloat()) {
+                    *ra = LuaValue::Number(-rb->n_);
+                } else {
+                    LuaValue v;
+                    Protect(v = Arith(OP_UNM, *rb, *rb));
+                    *RA(i) = v;
+                }
+                break;
+            }
+            case OP_BNOT: {
+                const LuaValue* rb = RB(i);
+                if (rb->IsInteger()) {
+                    *ra = LuaValue::Integer(~rb->i_);
+                } else {
+                    LuaValue v;
+                    Protect(v = Arith(OP_BNOT, *rb, *rb));
+                    *RA(i) = v;
+                }
+                break;
+            }
+            case OP_NOT:
+                *ra = LuaValue::Boolean(RB(i)->IsFalsy());
+                break;
+            case OP_LEN: {
+                const LuaValue* rb = RB(i);
+                if (rb->IsString()) {
+                    *ra = LuaValue::Integer(LuaInteger(rb->str_->size()));
+                } else if (rb->IsTable() && rb->table_->metatable_ == nullptr) {
+                    *ra = LuaValue::Integer(rb->table_->Length());
+                } else {
+                    LuaValue v;
+                    Protect(v = Length(*rb));
+                    *RA(i) = v;
+                }
+                break;
+            }
+            case OP_CONCAT: {
+                int b = GETARG_B(i);
+                int c = GETARG_C(i);
+                top_ = base + c + 1;
+                Protect(Concat(c - b + 1));
+                *RA(i) = base[b];
+                top_ = ci->top_;
+                break;
+            }
+            case OP_JMP:
+                DoJump(i);
+                break;
+            case OP_EQ: {
+                const LuaValue* rb = RKB(i);
+                const LuaValue* rc = RKC(i);
+                bool res;
+                if (rb->type_ == rc->type_ && !rb->IsTable()) {
+                    res = rb->RawEquals(*rc);
+                } else {
+                    Protect(res = Equals(*rb, *rc));
+                }
+                if (res != (GETARG_A(i) != 0)) {
+                    pc++;
+                } else {
+                    DoNextJump();
+                }
+                break;
+            }
+            case OP_LT: {
+                const LuaValue* rb = RKB(i);
+                const LuaValue* rc = RKC(i);
+                bool res;
+                if (rb->IsNumber() && rc->IsNumber()) {
+                    res = LTnum(*rb, *rc);
+                } else {
+                    Protect(res = LessThan(*rb, *rc));
+                }
+                if (res != (GETARG_A(i) != 0)) {
+                    pc++;
+                } else {
+                    DoNextJump();
+                }
+                break;
+            }
+            case OP_LE: {
+                const LuaValue* rb = RKB(i);
+                const LuaValue* rc = RKC(i);
+                bool res;
+                if (rb->IsNumber() && rc->IsNumber()) {
+                    res = LEnum(*rb, *rc);
+                } else {
+                    Protect(res = LessEqual(*rb, *rc));
+                }
+                if (res != (GETARG_A(i) != 0)) {
+                    pc++;
+                } else {
+                    DoNextJump();
+                }
+                break;
+            }
+            case OP_TEST:
+                if (GETARG_C(i) ? ra->IsFalsy() : !ra->IsFalsy()) {
+                    pc++;
+                } else {
+                    DoNextJump();
+                }
+                break;
+            case OP_TESTSET: {
+                const LuaValue* rb = RB(i);
+                if (GETARG_C(i) ? rb->IsFalsy() : !rb->IsFalsy()) {
+                    pc++;
+                } else {
+                    *ra = *rb;
+                    DoNextJump();
+                }
+                break;
+            }
+            case OP_CALL: {
+                int b = GETARG_B(i);
+                int nresults = GETARG_C(i) - 1;
+                if (b != 0) {
+                    top_ = ra + b;  // else the previous instruction set top_
+                }
+                ci->savedpc_ = pc;
+                if (PreCall(ra, nresults)) {
+                    goto newframe;
+                }
+                // a native function, already finished
+                ci = ci_;
+                base = ci->base_;
+                if (nresults >= 0) {
+                    top_ = ci->top_;
+                }
+                break;
+            }
+            case OP_TAILCALL: {
+                int b = GETARG_B(i);
+                if (b != 0) {
+                    top_ = ra + b;
+                }
+                ci->savedpc_ = pc;
+                if (ra->type_ != ValueType::LuaFunction) {
+                    // not reusable, run it as a regular call whose results
+                    // are returned by the RETURN that follows
+                    if (PreCall(ra, LUA_MULTRET)) {
+                        goto newframe;
+                    }
+                    ci = ci_;
+                    base = ci->base_;
+                    break;
+                }
+                if (openUpval_) {
+                    CloseUpvals(base);
+                }
+                // slide function and arguments down over the current frame
+                LuaValue* dst = ci->func_;
+                int n = int(top_ - ra);
+                for (int j = 0; j < n; ++j) {
+                    dst[j] = ra[j];
+                }
+                top_ = dst + n;
+                byte_t fresh = ci->status_ & CIST_FRESH;
+                int nresults = ci->nresults_;
+                ci_ = ci - 1;
+                PreCall(dst, nresults);     // pushes the frame into the same slot
+                ci_->status_ |= CIST_TAIL | fresh;
+                goto newframe;
+            }
+            case OP_RETURN: {
+                int b = GETARG_B(i);
+                if (openUpval_) {
+                    CloseUpvals(base);
+                }
+                int nres = b != 0 ? b - 1 : int(top_ - ra);
+                bool fresh = (ci->status_ & CIST_FRESH) != 0;
+                bool fixed = PosCall(ci, ra, nres);
+                if (fresh) {
+                    return;
+                }
+                if (fixed) {
+                    top_ = ci_->top_;
+                }
+                goto newframe;
+            }
+            case OP_FORLOOP:
+                if (ra->IsInteger()) {
+                    LuaInteger step = ra[2].i_;
+                    LuaInteger idx = IntAdd(ra->i_, step);
+                    LuaInteger limit = ra[1].i_;
+                    if (step > 0 ? idx <= limit : limit <= idx) {
+                        pc += GETARG_sBx(i);
+                        ra->i_ = idx;
+                        ra[3] = LuaValue::Integer(idx);
+                    }
+                } else {
+                    LuaNumber step = ra[2].n_;
+                    LuaNumber idx = ra->n_ + step;
+                    LuaNumber limit = ra[1].n_;
+                    if (step > 0 ? idx <= limit : limit <= idx) {
+                        pc += GETARG_sBx(i);
+                        ra->n_ = idx;
+                        ra[3] = LuaValue::Number(idx);
+                    }
+                }
+                break;
+            case OP_FORPREP: {
+                LuaValue* init = ra;
+                LuaValue* plimit = ra + 1;
+                LuaValue* pstep = ra + 2;
+                LuaInteger ilimit;
+                bool stop;
+                if (init->IsInteger() && pstep->IsInteger() &&
+                    ForLimit(*plimit, &ilimit, pstep->i_, &stop)) {
+                    LuaInteger initv = stop ? 0 : init->i_;
+                    *plimit = LuaValue::Integer(ilimit);
+                    *init = LuaValue::Integer(IntSub(initv, pstep->i_));
+                } else {
+                    LuaValue ninit, nlimit, nstep;
+                    ci->savedpc_ = pc;
+                    if (!ToNumber(*plimit, &nlimit)) {
+                        Error("'for' limit must be a number");
+                    }
+                    if (!ToNumber(*pstep, &nstep)) {
+                        Error("'for' step must be a number");
+                    }
+                    if (!ToNumber(*init, &ninit)) {
+                        Error("'for' initial value must be a number");
+                    }
+                    *plimit = LuaValue::Number(nlimit.AsNumber());
+                    *pstep = LuaValue::Number(nstep.AsNumber());
+                    *init = LuaValue::Number(ninit.AsNumber() - nstep.AsNumber());
+                }
+                pc += GETARG_sBx(i);
+                break;
+            }
+            case OP_TFORCALL: {
+                LuaValue* cb = ra + 3;  // call base
+                cb[2] = ra[2];
+                cb[1] = ra[1];
+                cb[0] = ra[0];
+                top_ = cb + 3;
+                Protect(Call(2, GETARG_C(i)));
+                top_ = ci->top_;
+                break;
+            }
+            case OP_TFORLOOP:
+                if (!ra[1].IsNil()) {
+                    ra[0] = ra[1];
+                    pc += GETARG_sBx(i);
+                }
+                break;
+            case OP_SETLIST: {
+                int n = GETARG_B(i);
+                int c = GETARG_C(i);
+                if (n == 0) {
+                    n = int(top_ - ra) - 1;
+                }
+                if (c == 0) {
+                    c = GETARG_Ax(*pc);
+                    pc++;
+                }
+                LuaTable* t = ra->table_;
+                LuaInteger first = LuaInteger(c - 1) * LFIELDS_PER_FLUSH;
+                for (int j = 1; j <= n; ++j) {
+                    t->SetInt(first + j, ra[j]);
+                }
+                top_ = ci->top_;
+                break;
+            }
+            case OP_CLOSURE: {
+                Prototype* p = cl->proto_->protos_[GETARG_Bx(i)];
+                LuaClosure* ncl = CachedClosure(p, cl->upvals_, base);
+                if (ncl == nullptr) {
+                    ncl = NewLuaClosure(p);
+                    const Upvalue* uv = p->upvalues_.data();
+                    for (uint32_t j = 0; j < ncl->nupvals_; ++j) {
+                        ncl->upvals_[j] = uv[j].inStack_ ? FindUpval(base + uv[j].idx_)
+                                                         : cl->upvals_[uv[j].idx_];
+                    }
+                    p->cache_ = ncl;
+                }
+                *ra = LuaValue::Object(ncl);
+                break;
+            }
+            case OP_VARARG: {
+                // the extra arguments sit right below base
+                int n = int(base - ci->func_) - cl->proto_->numParams_ - 1;
+                if (n < 0) {
+                    n = 0;
+                }
+                int b = GETARG_B(i) - 1;
+                if (b < 0) {
+                    b = n;
+                    Protect(CheckStack(n));
+                    ra = RA(i);
+                    top_ = ra + n;
+                }
+                int j = 0;
+                for (; j < b && j < n; ++j) {
+                    ra[j] = base[j - n];
+                }
+                for (; j < b; ++j) {
+                    ra[j] = LuaValue();
+                }
+                break;
+            }
+            default:
+                ci->savedpc_ = pc;
+                Error("invalid opcode %d", GET_OPCODE(i));
+        }
+    }
+}
+
+template void LuaState::Execute<false>();
+template void LuaState::Execute<true>();
@@ -0,0 +1,38 @@
+-- numeric for loops with limits that are not representable as integers
+
+-- runs the body of a loop at most max times, returns the count
+local function count(init, limit, step, max)
+    local c = 0
+    for _ = init, limit, step do
+        c = c + 1
+        if c == max then
+            break
+        end
+    end
+    return c
+end
+
+local nan, inf = 0 / 0, 1 / 0
+
+-- a NaN limit is not above 0: an integer loop going up never runs, one
+-- going down runs towards math.mininteger as in Lua 5.3
+assert(count(1, nan, 1, 3) == 0)
+assert(count(-1, nan, 1, 3) == 0)
+assert(count(1, nan, -1, 3) == 3)
+assert(count(1.0, nan, 1, 3) == 0)
+assert(count(1.0, nan, -1, 3) == 0)
+
+assert(count(1, inf, 1, 3) == 3)
+assert(count(1, inf, -1, 3) == 0)
+assert(count(1, -inf, 1, 3) == 0)
+assert(count(1, -inf, -1, 3) == 3)
+assert(count(1.0, inf, 1, 3) == 3)
+assert(count(1.0, -inf, -1, 3) == 3)
+
+-- floats in range are clipped towards the loop
+assert(count(1, 3.5, 1, 10) == 3)
+assert(count(3, 0.5, -1, 10) == 3)
+assert(count(1, 2 ^ 63, 1, 3) == 3)
+assert(count(1, -2 ^ 63, 1, 3) == 0)
+
+print("forloop ok")
@@ -0,0 +1,38 @@
+-- load from a string and from a reader function
+
+assert(load("return 1 + 1")() == 2)
+
+local function reader(...)
+    local pieces = {...}
+    local i = 0
+    return function()
+        i = i + 1
+        return pieces[i]
+    end
+end
+
+assert(load(reader("return ", "4", "2"))() == 42)
+assert(load(reader())() == nil)
+
+-- an empty piece ends the chunk
+assert(load(reader("return 1", "", "+ 1"))() == 1)
+
+-- sources from a reader are named (load)
+local f, err = load(reader("x = "))
+assert(f == nil and err:find("(load)", 1, true), err)
+f = load(reader("error('e')"), "=named")
+local ok, msg = pcall(f)
+assert(not ok and msg:find("^named:1:"), msg)
+
+-- errors of the reader and bad pieces are returned, not raised
+f, err = load(function() error("broken reader") end)
+assert(f == nil and err:find("broken reader", 1, true), err)
+f, err = load(reader("return 1", {}))
+assert(f == nil and err == "reader function must return a string", err)
+
+-- mode and env apply as for strings
+f, err = load(reader("return 1"), "chunk", "b")
+assert(f == nil and err:find("attempt to load a text chunk", 1, true), err)
+assert(load(reader("return x"), "chunk", "t", {x = 7})() == 7)
+
+print("load ok")
@@ -0,0 +1,60 @@
+#include "binding.h"
+#include "lualib.h"
+#include "parser.h"
+#include "chunk.h"
+#include <cstdio>
+#include <cstring>
+
+/*
+ * Conversions of the binding layer at the edges of their types
+ */
+
+static const char* Lookup(const char* key) {
+    return strcmp(key, "a") == 0 ? "found" : nullptr;
+}
+
+static int32_t Narrow(int32_t i) {
+    return i;
+}
+
+static uint8_t Byte(uint8_t b) {
+    return b;
+}
+
+static void Run(LuaState* L, const char* source) {
+    L->Load(new Chunk(Parser::Compile(source, strlen(source), "=test")));
+    L->Call(0, 0);
+}
+
+int main() {
+    try {
+        LuaState L;
+        OpenLibs(&L);
+        RegisterFunction(&L, "lookup", &Lookup);
+        RegisterFunction(&L, "narrow", &Narrow);
+        RegisterFunction(&L, "byte", &Byte);
+        Run(&L, R"lua(
+            assert(lookup("a") == "found")
+            assert(lookup("b") == nil and select("#", lookup("b")) == 1)
+
+            assert(narrow(2147483647) == 2147483647)
+            assert(narrow(-2147483648) == -2147483648)
+            assert(narrow(3.0) == 3)
+            local ok, err = pcall(narrow, 2147483648)
+            assert(not ok and err:find("bad argument #1 to 'narrow' (value out of range)", 1, true), err)
+            ok, err = pcall(narrow, -2147483649)
+            assert(not ok and err:find("value out of range", 1, true), err)
+
+            assert(byte(255) == 255 and byte(0) == 0)
+            ok, err = pcall(byte, 256)
+            assert(not ok and err:find("value out of range", 1, true), err)
+            ok, err = pcall(byte, -1)
+            assert(not ok and err:find("value out of range", 1, true), err)
+        )lua");
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    printf("binding ok\n");
+    return 0;
+}